@@ -1,6 +1,11 @@
 #pragma once
 
 #include "..\include\g3d.h"
+#include "..\include\subdivide.h"
+#include "..\include\voxelize.h"
+#include "..\include\clash.h"
+#include "..\include\section.h"
+#include "..\include\unify.h"
 
 #include <msclr/marshal_cppstd.h>
 using namespace msclr::interop;
@@ -11,6 +16,72 @@ namespace Vim
 {
     namespace G3d
     {
+        /// A sparse voxel grid made by ManagedG3d::Voxelize
+        public ref class ManagedVoxels
+        {
+        public:
+            g3d::BrickMap* map;
+
+            ManagedVoxels()
+                : map(new g3d::BrickMap)
+            { }
+
+            ~ManagedVoxels()
+            {
+                this->!ManagedVoxels();
+            }
+
+            !ManagedVoxels()
+            {
+                delete map;
+                map = nullptr;
+            }
+
+            long long VoxelCount()
+            {
+                return (long long)map->count();
+            }
+
+            int BrickCount()
+            {
+                return (int)map->bricks.size();
+            }
+
+            bool IsSet(int x, int y, int z)
+            {
+                return map->get(x, y, z);
+            }
+
+            /// The index of the instance that set the voxel, or -1
+            int GetId(int x, int y, int z)
+            {
+                return map->id(x, y, z);
+            }
+
+            /// Expands the grid with g3d::to_dense, and returns whether each voxel is set, with x varying fastest, then y, then z
+            array<bool>^ ToDense()
+            {
+                auto dense = g3d::to_dense(*map);
+                auto& grid = dense.grid;
+                auto r = gcnew array<bool>((int)grid.num_voxels());
+                for (int z = 0, i = 0; z < grid.nz; ++z)
+                    for (int y = 0; y < grid.ny; ++y)
+                        for (int x = 0; x < grid.nx; ++x)
+                            r[i++] = dense.get(x, y, z);
+                return r;
+            }
+
+            /// Expands the grid with g3d::to_dense, and returns the id of each voxel in the order of ToDense
+            array<int>^ ToDenseIds()
+            {
+                auto dense = g3d::to_dense(*map);
+                auto r = gcnew array<int>((int)dense.grid.num_voxels());
+                for (int i = 0; i < r->Length; ++i)
+                    r[i] = dense.ids.empty() ? -1 : dense.ids[i];
+                return r;
+            }
+        };
+
         public ref class ManagedG3d
         {
         private:
@@ -57,6 +128,167 @@ namespace Vim
             {
                 return (int)g3d->attributes[index].num_elements();
             }
+
+            /// Adds (or replaces) an attribute holding a copy of the values
+            void AddAttribute(String^ descriptor, array<float>^ values)
+            {
+                AddValues<float>(descriptor, values);
+            }
+
+            /// Adds (or replaces) an attribute holding a copy of the values
+            void AddAttribute(String^ descriptor, array<int>^ values)
+            {
+                AddValues<int>(descriptor, values);
+            }
+
+            /// Returns null if there is no such attribute
+            array<float>^ GetFloatAttribute(String^ descriptor)
+            {
+                return GetValues<float>(descriptor);
+            }
+
+            /// Returns null if there is no such attribute
+            array<int>^ GetIntAttribute(String^ descriptor)
+            {
+                return GetValues<int>(descriptor);
+            }
+
+            /// Returns the polygon mesh refined by the given number of Catmull-Clark levels (see g3d::subdivide)
+            ManagedG3d^ Subdivide(int levels)
+            {
+                try
+                {
+                    return Wrap(g3d::subdivide(*g3d, levels));
+                }
+                catch (const std::exception& e)
+                {
+                    throw gcnew InvalidOperationException(gcnew String(e.what()));
+                }
+            }
+
+            /// Voxelizes the instances, or each sub-geometry in place if there are none, on a grid of nx * ny * nz voxels starting at the origin (see g3d::voxelize)
+            ManagedVoxels^ Voxelize(array<float>^ origin, float voxelSize, int nx, int ny, int nz, bool solid)
+            {
+                g3d::VoxelGrid grid;
+                grid.origin = { origin[0], origin[1], origin[2] };
+                grid.voxel_size = voxelSize;
+                grid.nx = nx;
+                grid.ny = ny;
+                grid.nz = nz;
+                g3d::VoxelizeOptions options;
+                options.mode = solid ? g3d::voxel_solid : g3d::voxel_surface;
+                auto r = gcnew ManagedVoxels();
+                try
+                {
+                    *r->map = g3d::voxelize(*g3d, grid, options);
+                }
+                catch (const std::exception& e)
+                {
+                    throw gcnew InvalidOperationException(gcnew String(e.what()));
+                }
+                return r;
+            }
+
+            /// Returns the pairs of instances whose triangles cross each other by more than the tolerance, as a, b with a < b (see g3d::find_clashes)
+            array<int>^ FindHardClashes(float tolerance)
+            {
+                g3d::ClashOptions options;
+                options.tolerance = tolerance;
+                return FindClashes(options);
+            }
+
+            /// Returns the pairs of instances whose triangles are closer than the clearance, as a, b with a < b (see g3d::find_clashes)
+            array<int>^ FindClearanceClashes(float clearance)
+            {
+                g3d::ClashOptions options;
+                options.mode = g3d::clash_clearance;
+                options.clearance = clearance;
+                return FindClashes(options);
+            }
+
+            /// Cuts the instances, or each sub-geometry in place if there are none, with the planes dot(normal, p) == offset for the sorted offsets.
+            /// Returns the loops as lines, one sub-geometry per loop (see g3d::SectionCutter).
+            ManagedG3d^ Section(array<float>^ normal, array<float>^ offsets)
+            {
+                std::vector<float> planes(offsets->Length);
+                for (int i = 0; i < offsets->Length; ++i)
+                    planes[i] = offsets[i];
+                try
+                {
+                    return Wrap(g3d::section(*g3d, { normal[0], normal[1], normal[2] }, planes));
+                }
+                catch (const std::exception& e)
+                {
+                    throw gcnew InvalidOperationException(gcnew String(e.what()));
+                }
+            }
+
+            /// Returns the mesh with its map channels unified into the position index (see g3d::AttributeUnifier)
+            ManagedG3d^ Unify()
+            {
+                try
+                {
+                    return Wrap(g3d::unify_attributes(*g3d));
+                }
+                catch (const std::exception& e)
+                {
+                    throw gcnew InvalidOperationException(gcnew String(e.what()));
+                }
+            }
+
+            /// Sets the number of threads used by the geometry algorithms. Zero uses one per hardware thread.
+            static void SetThreadCount(int count)
+            {
+                g3d::set_thread_count((size_t)count);
+            }
+
+        private:
+            array<int>^ FindClashes(const g3d::ClashOptions& options)
+            {
+                std::vector<std::pair<int32_t, int32_t>> pairs;
+                try
+                {
+                    pairs = g3d::find_clashes(*g3d, options);
+                }
+                catch (const std::exception& e)
+                {
+                    throw gcnew InvalidOperationException(gcnew String(e.what()));
+                }
+                auto r = gcnew array<int>((int)pairs.size() * 2);
+                for (int i = 0; i < (int)pairs.size(); ++i)
+                {
+                    r[i * 2] = pairs[i].first;
+                    r[i * 2 + 1] = pairs[i].second;
+                }
+                return r;
+            }
+
+            static ManagedG3d^ Wrap(g3d::G3d&& g)
+            {
+                auto r = gcnew ManagedG3d();
+                *r->g3d = std::move(g);
+                return r;
+            }
+
+            template<typename T>
+            void AddValues(String^ descriptor, array<T>^ values)
+            {
+                auto data = g3d->add_owned_attribute<T>(marshal_as<std::string>(descriptor), values->Length);
+                for (int i = 0; i < values->Length; ++i)
+                    data[i] = values[i];
+            }
+
+            template<typename T>
+            array<T>^ GetValues(String^ descriptor)
+            {
+                auto attr = g3d->find_attribute(marshal_as<std::string>(descriptor));
+                if (!attr)
+                    return nullptr;
+                auto r = gcnew array<T>((int)attr->count<T>());
+                for (int i = 0; i < r->Length; ++i)
+                    r[i] = attr->data<T>()[i];
+                return r;
+            }
         };
     }
 }
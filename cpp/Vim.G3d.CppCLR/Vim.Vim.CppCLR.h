@@ -33,7 +33,26 @@ namespace Vim
 
         void Load(String^ filePath)
         {
-            VimScene->ReadFile(marshal_as<std::string>(filePath));
+            Read(filePath, Vim::ReadOptions());
+        }
+
+        /// Loads the file, failing if it needs more than the given number of bytes
+        void Load(String^ filePath, long long memoryBudget)
+        {
+            Vim::ReadOptions options;
+            options.mMemoryBudget = (size_t)memoryBudget;
+            Read(filePath, options);
+        }
+
+        /// Loads only the given columns of the given entity tables
+        void LoadColumns(String^ filePath, array<String^>^ tables, array<String^>^ columns)
+        {
+            Read(filePath, Vim::ReadOptions::Columns(ToStrings(tables), ToStrings(columns)));
+        }
+
+        long long GetMemoryUsed()
+        {
+            return (long long)VimScene->mMemoryUsed;
         }
 
         int GetStringCount()
@@ -65,5 +84,94 @@ namespace Vim
         {
             return (int)VimScene->mNodes[index].mGeometry;
         }
+
+        float GetNodeTransform(int index, int element)
+        {
+            return VimScene->mNodes[index].mTransform[element];
+        }
+
+        int GetEntityTableCount()
+        {
+            return (int)VimScene->mEntityTables.size();
+        }
+
+        bool HasEntityTable(String^ table)
+        {
+            return FindTable(table) != nullptr;
+        }
+
+        /// Returns -1 if the table was not read
+        int GetPropertyCount(String^ table)
+        {
+            auto t = FindTable(table);
+            return t ? (int)t->mProperties.size() : -1;
+        }
+
+        int GetColumnCount(String^ table)
+        {
+            auto t = FindTable(table);
+            return t ? (int)(t->mNumericColumns.size() + t->mIndexColumns.size() + t->mStringColumns.size()) : 0;
+        }
+
+        /// Returns null if the column was not read
+        array<double>^ GetNumericColumn(String^ table, String^ column)
+        {
+            auto t = FindTable(table);
+            return t ? ToArray<double>(t->mNumericColumns, column) : nullptr;
+        }
+
+        /// Returns null if the column was not read
+        array<int>^ GetIndexColumn(String^ table, String^ column)
+        {
+            auto t = FindTable(table);
+            return t ? ToArray<int>(t->mIndexColumns, column) : nullptr;
+        }
+
+        /// Returns null if the column was not read
+        array<int>^ GetStringColumn(String^ table, String^ column)
+        {
+            auto t = FindTable(table);
+            return t ? ToArray<int>(t->mStringColumns, column) : nullptr;
+        }
+
+    private:
+        void Read(String^ filePath, const Vim::ReadOptions& options)
+        {
+            try
+            {
+                VimScene->ReadFile(marshal_as<std::string>(filePath), options);
+            }
+            catch (const std::exception& e)
+            {
+                throw gcnew InvalidOperationException(gcnew String(e.what()));
+            }
+        }
+
+        static std::vector<std::string> ToStrings(array<String^>^ xs)
+        {
+            std::vector<std::string> r;
+            if (xs != nullptr)
+                for each (String^ x in xs)
+                    r.push_back(marshal_as<std::string>(x));
+            return r;
+        }
+
+        const Vim::EntityTable* FindTable(String^ table)
+        {
+            auto it = VimScene->mEntityTables.find(marshal_as<std::string>(table));
+            return it == VimScene->mEntityTables.end() ? nullptr : &it->second;
+        }
+
+        template<typename T>
+        static array<T>^ ToArray(const std::unordered_map<std::string, std::vector<T>>& columns, String^ column)
+        {
+            auto it = columns.find(marshal_as<std::string>(column));
+            if (it == columns.end())
+                return nullptr;
+            auto r = gcnew array<T>((int)it->second.size());
+            for (int i = 0; i < r->Length; ++i)
+                r[i] = it->second[i];
+            return r;
+        }
     };
 }
@@ -0,0 +1,332 @@
+/*
+    Group-By Aggregation over VIM Entity Tables
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <climits>
+
+#include "bits.h"
+#include "parallel.h"
+#include "query.h"
+
+namespace Vim
+{
+    enum class AggregateOp { Count, Sum, Min, Max };
+
+    /// An aggregate over the rows of each group of a numeric, index or string column. Count has no column.
+    struct Aggregate
+    {
+        AggregateOp mOp;
+        std::string mColumn;
+
+        static Aggregate Count() { return { AggregateOp::Count, "" }; }
+        static Aggregate Sum(const std::string& column) { return { AggregateOp::Sum, column }; }
+        static Aggregate Min(const std::string& column) { return { AggregateOp::Min, column }; }
+        static Aggregate Max(const std::string& column) { return { AggregateOp::Max, column }; }
+    };
+
+    /// The groups found by GroupBy, sorted by their keys with the first key most significant
+    class GroupByResult
+    {
+    public:
+        /// The value of each key of each group: mKeys[key][group]
+        std::vector<std::vector<int>> mKeys;
+        /// The value of each aggregate of each group: mValues[aggregate][group]
+        std::vector<std::vector<double>> mValues;
+        /// The number of rows in each group
+        std::vector<size_t> mCounts;
+
+        size_t NumGroups() const { return mCounts.size(); }
+    };
+
+    /// Groups the rows of a table by the values of one or more index or string columns, and computes any number of aggregates
+    /// of each group in one pass over the columns. The rows are split into one part per thread, and each part accumulates into its own table,
+    /// which the parts then merge. Since index columns are dense integers, the table is an array indexed directly by the keys
+    /// when their ranges are small enough, and a hash table otherwise, of the keys combined into one number when they fit in 64 bits,
+    /// or of the tuple of key values when they don't.
+    class GroupBy
+    {
+    public:
+        /// Each part has its own table, so key ranges whose combinations times the number of parts exceed this,
+        /// and the number of rows, use hash tables
+        static const size_t MaxDirectSlots = 1 << 16;
+
+        GroupBy(const TableColumns& columns, const std::vector<std::string>& keys, const std::vector<Aggregate>& aggregates)
+            : mNumRows(columns.mNumRows)
+        {
+            for (auto& k : keys)
+            {
+                auto c = columns.Find(k);
+                if (c.mNumeric)
+                    throw std::runtime_error("Group key " + k + " is not an index or string column");
+                mKeys.push_back(c.mInts);
+            }
+            for (auto& a : aggregates)
+            {
+                mOps.push_back(a.mOp);
+                mColumns.push_back(a.mOp == AggregateOp::Count ? TableColumns::Column() : columns.Find(a.mColumn));
+            }
+        }
+
+        GroupByResult Run() const
+        {
+            return Run(nullptr);
+        }
+
+        /// Aggregates the selected rows only
+        GroupByResult Run(const g3d::Bitset& selection) const
+        {
+            if (selection.size != mNumRows)
+                throw std::runtime_error("The selection doesn't have a bit per row");
+            return Run(&selection);
+        }
+
+    private:
+        size_t mNumRows;
+        std::vector<const int*> mKeys;
+        std::vector<AggregateOp> mOps;
+        std::vector<TableColumns::Column> mColumns;
+
+        /// Accumulated counts and aggregates of groups, stored by aggregate then group
+        struct Table
+        {
+            std::vector<size_t> mCounts;
+            std::vector<std::vector<double>> mValues;
+        };
+
+        static double Initial(AggregateOp op)
+        {
+            switch (op)
+            {
+            case AggregateOp::Min: return std::numeric_limits<double>::infinity();
+            case AggregateOp::Max: return -std::numeric_limits<double>::infinity();
+            default: return 0;
+            }
+        }
+
+        static double Combine(AggregateOp op, double a, double b)
+        {
+            switch (op)
+            {
+            case AggregateOp::Min: return b < a ? b : a;
+            case AggregateOp::Max: return b > a ? b : a;
+            default: return a + b;
+            }
+        }
+
+        size_t AddGroups(Table& t, size_t n) const
+        {
+            auto begin = t.mCounts.size();
+            t.mCounts.resize(begin + n, 0);
+            t.mValues.resize(mOps.size());
+            for (size_t a = 0; a < mOps.size(); ++a)
+                t.mValues[a].resize(begin + n, Initial(mOps[a]));
+            return begin;
+        }
+
+        void Accumulate(Table& t, size_t group, size_t row) const
+        {
+            t.mCounts[group]++;
+            for (size_t a = 0; a < mOps.size(); ++a)
+            {
+                auto& c = mColumns[a];
+                auto v = mOps[a] == AggregateOp::Count ? 1.0 : c.mNumeric ? c.mDoubles[row] : (double)c.mInts[row];
+                t.mValues[a][group] = Combine(mOps[a], t.mValues[a][group], v);
+            }
+        }
+
+        void Merge(Table& t, size_t group, const Table& from, size_t fromGroup) const
+        {
+            t.mCounts[group] += from.mCounts[fromGroup];
+            for (size_t a = 0; a < mOps.size(); ++a)
+                t.mValues[a][group] = Combine(mOps[a], t.mValues[a][group], from.mValues[a][fromGroup]);
+        }
+
+        /// Calls f(row) for the rows of words [begin, end) of the selection, or of all rows
+        template<typename F>
+        void ForEachRow(const g3d::Bitset* selection, size_t begin, size_t end, F f) const
+        {
+            for (auto w = begin; w < end; ++w)
+            {
+                auto bits = selection ? selection->words[w] : w * 64 + 64 <= mNumRows ? ~0ull : (1ull << (mNumRows % 64)) - 1;
+                for (; bits != 0; bits &= bits - 1)
+                    f(w * 64 + g3d::count_trailing_zeros(bits));
+            }
+        }
+
+        /// Hashes the values of all the keys of a row, for groups whose keys don't combine into one 64-bit number
+        struct KeyTupleHash
+        {
+            size_t operator()(const std::vector<int>& keys) const
+            {
+                uint64_t h = 0xcbf29ce484222325ull;
+                for (auto k : keys)
+                    h = (h ^ (uint32_t)k) * 0x100000001b3ull;
+                return (size_t)h;
+            }
+        };
+
+        /// Each part accumulates into a hash table of the group keys it sees, where keyOf(row, key) sets the key of a row;
+        /// then the parts are merged and the groups sorted by key
+        template<typename Key, typename Hash, typename KeyOf>
+        void RunHashed(const g3d::Bitset* selection, KeyOf keyOf, Table& merged, std::vector<Key>& keys) const
+        {
+            const auto num_words = (mNumRows + 63) / 64;
+            const auto max_parts = g3d::thread_count();
+            std::vector<Table> tables(max_parts);
+            std::vector<std::unordered_map<Key, size_t, Hash>> groups(max_parts);
+            auto num_parts = g3d::parallel_partition(num_words, max_parts, [&](size_t part, size_t begin, size_t end) {
+                auto& t = tables[part];
+                auto& g = groups[part];
+                Key key;
+                ForEachRow(selection, begin, end, [&](size_t row) {
+                    keyOf(row, key);
+                    auto it = g.find(key);
+                    if (it == g.end())
+                        it = g.emplace(key, AddGroups(t, 1)).first;
+                    Accumulate(t, it->second, row);
+                });
+            });
+            for (size_t p = 0; p < num_parts; ++p)
+                for (auto& kv : groups[p])
+                    keys.push_back(kv.first);
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            AddGroups(merged, keys.size());
+            g3d::parallel_for(keys.size(), [&](size_t g) {
+                for (size_t p = 0; p < num_parts; ++p)
+                {
+                    auto it = groups[p].find(keys[g]);
+                    if (it != groups[p].end())
+                        Merge(merged, g, tables[p], it->second);
+                }
+            }, 1024);
+        }
+
+        GroupByResult Run(const g3d::Bitset* selection) const
+        {
+            const auto num_words = (mNumRows + 63) / 64;
+            const auto num_keys = mKeys.size();
+            const auto max_parts = g3d::thread_count();
+
+            // The range of each key, over all rows
+            std::vector<std::vector<int>> part_min(max_parts, std::vector<int>(num_keys, INT_MAX));
+            std::vector<std::vector<int>> part_max(max_parts, std::vector<int>(num_keys, INT_MIN));
+            auto num_parts = g3d::parallel_partition(mNumRows, max_parts, [&](size_t part, size_t begin, size_t end) {
+                for (size_t k = 0; k < num_keys; ++k)
+                    for (auto i = begin; i < end; ++i)
+                    {
+                        part_min[part][k] = std::min(part_min[part][k], mKeys[k][i]);
+                        part_max[part][k] = std::max(part_max[part][k], mKeys[k][i]);
+                    }
+            });
+            std::vector<int> mins(num_keys, 0);
+            std::vector<uint64_t> strides(num_keys, 1), ranges(num_keys, 1);
+            for (size_t k = 0; k < num_keys; ++k)
+            {
+                int lo = INT_MAX, hi = INT_MIN;
+                for (size_t p = 0; p < num_parts; ++p)
+                {
+                    lo = std::min(lo, part_min[p][k]);
+                    hi = std::max(hi, part_max[p][k]);
+                }
+                if (lo <= hi)
+                {
+                    mins[k] = lo;
+                    ranges[k] = (uint64_t)((int64_t)hi - lo) + 1;
+                }
+            }
+            // The keys of a row combine into one number, with the first key most significant, so that groups sort by their keys
+            uint64_t num_slots = 1;
+            for (size_t k = num_keys; k-- > 0;)
+            {
+                strides[k] = num_slots;
+                if (num_slots > UINT64_MAX / ranges[k])
+                    return RunTuples(selection);
+                num_slots *= ranges[k];
+            }
+            auto slot = [&](size_t row) {
+                uint64_t r = 0;
+                for (size_t k = 0; k < num_keys; ++k)
+                    r += (uint64_t)((int64_t)mKeys[k][row] - mins[k]) * strides[k];
+                return r;
+            };
+
+            std::vector<uint64_t> slots;
+            Table merged;
+            const auto limit = std::max<uint64_t>((uint64_t)MaxDirectSlots, mNumRows);
+            if (num_slots <= limit / max_parts)
+            {
+                // Each part accumulates into an array of every combination of keys; then the parts are merged slot by slot in parallel
+                std::vector<Table> tables(max_parts);
+                num_parts = g3d::parallel_partition(num_words, max_parts, [&](size_t part, size_t begin, size_t end) {
+                    AddGroups(tables[part], (size_t)num_slots);
+                    ForEachRow(selection, begin, end, [&](size_t row) { Accumulate(tables[part], (size_t)slot(row), row); });
+                });
+                merged = std::move(tables[0]);
+                g3d::parallel_for((size_t)num_slots, [&](size_t s) {
+                    for (size_t p = 1; p < num_parts; ++p)
+                        Merge(merged, s, tables[p], s);
+                }, 4096);
+                std::vector<size_t> used;
+                for (size_t s = 0; s < num_slots; ++s)
+                    if (merged.mCounts[s] != 0)
+                        used.push_back(s);
+                Table compact;
+                AddGroups(compact, used.size());
+                for (size_t g = 0; g < used.size(); ++g)
+                    Merge(compact, g, merged, used[g]);
+                merged = std::move(compact);
+                slots.assign(used.begin(), used.end());
+            }
+            else
+            {
+                RunHashed<uint64_t, std::hash<uint64_t>>(selection, [&](size_t row, uint64_t& key) { key = slot(row); }, merged, slots);
+            }
+
+            GroupByResult r;
+            r.mCounts = std::move(merged.mCounts);
+            r.mValues = std::move(merged.mValues);
+            r.mKeys.resize(num_keys, std::vector<int>(slots.size()));
+            g3d::parallel_for(slots.size(), [&](size_t g) {
+                for (size_t k = 0; k < num_keys; ++k)
+                    r.mKeys[k][g] = (int)((int64_t)mins[k] + (int64_t)(slots[g] / strides[k] % ranges[k]));
+            }, 4096);
+            return r;
+        }
+
+        /// Groups by the tuple of the key values, when their combinations are too many to number
+        GroupByResult RunTuples(const g3d::Bitset* selection) const
+        {
+            const auto num_keys = mKeys.size();
+            Table merged;
+            std::vector<std::vector<int>> tuples;
+            RunHashed<std::vector<int>, KeyTupleHash>(selection, [&](size_t row, std::vector<int>& key) {
+                key.resize(num_keys);
+                for (size_t k = 0; k < num_keys; ++k)
+                    key[k] = mKeys[k][row];
+            }, merged, tuples);
+
+            GroupByResult r;
+            r.mCounts = std::move(merged.mCounts);
+            r.mValues = std::move(merged.mValues);
+            r.mKeys.resize(num_keys, std::vector<int>(tuples.size()));
+            g3d::parallel_for(tuples.size(), [&](size_t g) {
+                for (size_t k = 0; k < num_keys; ++k)
+                    r.mKeys[k][g] = tuples[g][k];
+            }, 4096);
+            return r;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+    Instance Batching of VIM Scene Nodes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __BATCHING_H__
+#define __BATCHING_H__
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+
+#include "parallel.h"
+#include "geometry.h"
+#include "derived.h"
+#include "vim.h"
+#include "vimview.h"
+#include "transforms.h"
+
+namespace Vim
+{
+    /// The nodes that share a geometry, drawn with one instanced call
+    struct InstanceBatch
+    {
+        int mGeometry;
+        /// The material of the geometry, or -1 when batching without materials
+        int mMaterial;
+        /// The instances of the batch are NodeIndices()[i] for i in [mBegin, mBegin + mCount)
+        uint32_t mBegin;
+        uint32_t mCount;
+    };
+
+    struct InstancingStats
+    {
+        size_t mNumNodes = 0;
+        /// The nodes with a valid geometry
+        size_t mNumInstances = 0;
+        size_t mNumBatches = 0;
+        /// The batches with a single instance, which gain nothing from instancing
+        size_t mNumSingleInstanceBatches = 0;
+        size_t mLargestBatch = 0;
+        /// The distinct materials of the batches, not counting the geometries without a material
+        size_t mNumMaterials = 0;
+
+        double AverageBatchSize() const { return mNumBatches == 0 ? 0 : (double)mNumInstances / mNumBatches; }
+        /// The draw calls saved by instancing, compared to one call per instance
+        size_t DrawCallsSaved() const { return mNumInstances - mNumBatches; }
+    };
+
+    /// Groups the nodes of a scene by geometry, so that each group can be submitted as one instanced draw. The nodes are sorted on their
+    /// geometry with the stable parallel radix sort, so that the instances of a batch stay in node order. The node indices and world matrices
+    /// of each batch are contiguous, with 16 floats per instance, aligned to 64 bytes. When batching by material, the batches are ordered
+    /// by the material of their geometry then by geometry, so that the batches of a material are submitted together.
+    class InstanceBatches
+    {
+    public:
+        InstanceBatches() = default;
+
+        /// Batches the nodes of a Scene or SceneView. The world transforms must be of the same nodes.
+        template<typename SceneT>
+        InstanceBatches(const SceneT& scene, const WorldTransforms& world, bool byMaterial = false)
+            : InstanceBatches(scene.mNodes.data(), scene.mNodes.size(), world, g3d::MeshView(scene.mGeometry).num_subgeos,
+                byMaterial ? GeometryMaterials(scene.mGeometry) : std::vector<int>())
+        { }
+
+        /// Batches nodes whose mGeometry is a sub-geometry in [0, numGeometries). Other nodes are left out.
+        /// Materials, if not empty, has the material of each geometry.
+        InstanceBatches(const SceneNode* nodes, size_t count, const WorldTransforms& world, size_t numGeometries, const std::vector<int>& materials = std::vector<int>())
+        {
+            if (world.Size() != count)
+                throw std::runtime_error("The world transforms are not of the nodes");
+            if (!materials.empty() && materials.size() != numGeometries)
+                throw std::runtime_error("There must be a material per geometry");
+
+            // The rank of each geometry in batch order
+            std::vector<int> geometries(numGeometries);
+            std::iota(geometries.begin(), geometries.end(), 0);
+            if (!materials.empty())
+                std::stable_sort(geometries.begin(), geometries.end(), [&](int a, int b) { return materials[a] < materials[b]; });
+            std::vector<uint32_t> ranks(numGeometries);
+            for (size_t r = 0; r < numGeometries; ++r)
+                ranks[geometries[r]] = (uint32_t)r;
+
+            // The stable radix sort on the rank keeps the instances of a batch in node order
+            std::vector<uint64_t> keys;
+            for (size_t i = 0; i < count; ++i)
+            {
+                auto g = nodes[i].mGeometry;
+                if (g >= 0 && (size_t)g < numGeometries)
+                {
+                    keys.push_back(ranks[g]);
+                    mNodeIndices.push_back((int)i);
+                }
+            }
+            g3d::radix_sort(keys, mNodeIndices);
+            auto offsets = g3d::sorted_key_offsets(keys, numGeometries);
+            for (size_t r = 0; r < numGeometries; ++r)
+                if (offsets[r + 1] > offsets[r])
+                    mBatches.push_back({ geometries[r], materials.empty() ? -1 : materials[geometries[r]], offsets[r], offsets[r + 1] - offsets[r] });
+
+            auto matrices = mMatrices.allocate<float>(mNodeIndices.size() * 16);
+            g3d::parallel_for(mNodeIndices.size(), [&](size_t i) { world.GetMatrix(mNodeIndices[i], matrices + i * 16); }, 4096);
+
+            mStats.mNumNodes = count;
+            mStats.mNumInstances = mNodeIndices.size();
+            mStats.mNumBatches = mBatches.size();
+            int last_material = -1;
+            for (auto& b : mBatches)
+            {
+                mStats.mNumSingleInstanceBatches += b.mCount == 1 ? 1 : 0;
+                mStats.mLargestBatch = std::max<size_t>(mStats.mLargestBatch, b.mCount);
+                // The batches are ordered by material, so each material starts a new run
+                if (b.mMaterial >= 0 && b.mMaterial != last_material)
+                    mStats.mNumMaterials++;
+                last_material = b.mMaterial;
+            }
+        }
+
+        InstanceBatches(const InstanceBatches&) = delete;
+        InstanceBatches& operator=(const InstanceBatches&) = delete;
+        InstanceBatches(InstanceBatches&&) = default;
+        InstanceBatches& operator=(InstanceBatches&&) = default;
+
+        const std::vector<InstanceBatch>& Batches() const { return mBatches; }
+
+        /// The nodes of all batches, one after the other
+        const std::vector<int>& NodeIndices() const { return mNodeIndices; }
+
+        /// The world matrices of all batches, one after the other, 16 floats per instance
+        const float* Matrices() const { return mMatrices.data<float>(); }
+
+        /// The nodes of a batch
+        Span<int> Nodes(size_t batch) const
+        {
+            auto& b = mBatches[batch];
+            return Span<int>(mNodeIndices.data() + b.mBegin, mNodeIndices.data() + b.mBegin + b.mCount);
+        }
+
+        /// The world matrices of the nodes of a batch
+        Span<float> Matrices(size_t batch) const
+        {
+            auto& b = mBatches[batch];
+            return Span<float>(Matrices() + b.mBegin * 16, Matrices() + (b.mBegin + b.mCount) * 16);
+        }
+
+        const InstancingStats& Stats() const { return mStats; }
+
+        /// The material of each sub-geometry: the group material of its first face, or -1 if it has no faces or no material
+        static std::vector<int> GeometryMaterials(const g3d::G3d& g)
+        {
+            g3d::DerivedAttributes cache(g);
+            auto& mesh = cache.mesh_view();
+            auto face_materials = cache.data<int32_t>(g3d::descriptors::FaceMaterialId);
+            auto num_faces = cache.count<int32_t>(g3d::descriptors::FaceMaterialId);
+            std::vector<int> r(mesh.num_subgeos, -1);
+            g3d::parallel_for(r.size(), [&](size_t s) {
+                auto f = mesh.face_begin(s);
+                if (face_materials && f < mesh.face_end(s) && f < num_faces)
+                    r[s] = face_materials[f];
+            }, 1024);
+            return r;
+        }
+
+    private:
+        std::vector<InstanceBatch> mBatches;
+        std::vector<int> mNodeIndices;
+        g3d::AlignedBuffer mMatrices;
+        InstancingStats mStats;
+    };
+}
+
+#endif
@@ -100,7 +100,9 @@ namespace bfast
             {
                 auto& range = ranges[i];
                 assert(is_aligned(n));
-                r[i] = { n, n += range.size() };
+                auto begin = n;
+                n += range.size();
+                r[i] = { begin, n };
                 n = aligned_value(n);
             }
             return r;
@@ -173,11 +175,11 @@ namespace bfast
             assert(current == 32 + offsets.size() * 16);
             out = output_padding(out, current);
             assert(is_aligned(current));
-            assert(current = compute_data_start());
+            assert(current == compute_data_start());
 
             // Copy the arrays 
             for (auto i = 0; i < ranges.size(); ++i) {
-                output_padding(out, current);
+                out = output_padding(out, current);
                 const auto& range = ranges[i];
                 const auto& offset = offsets[i];
                 assert(range.size() == (offset._end - offset._begin));
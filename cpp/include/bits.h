@@ -0,0 +1,110 @@
+/*
+    Bit Set Helpers
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __BITS_H__
+#define __BITS_H__
+
+#include <vector>
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace g3d
+{
+    using namespace std;
+
+    /// Returns the index of the lowest set bit. The value must not be zero.
+    inline int count_trailing_zeros(uint64_t x) {
+#if defined(_MSC_VER)
+        unsigned long r;
+        _BitScanForward64(&r, x);
+        return (int)r;
+#else
+        return __builtin_ctzll(x);
+#endif
+    }
+
+    inline int popcount(uint64_t x) {
+#if defined(_MSC_VER)
+        return (int)__popcnt64(x);
+#else
+        return __builtin_popcountll(x);
+#endif
+    }
+
+    /// A fixed size set of bits stored in 64-bit words. Bits past the size in the last word are always zero.
+    struct Bitset
+    {
+        vector<uint64_t> words;
+        size_t size = 0;
+
+        Bitset() = default;
+        Bitset(size_t n, bool value = false) { resize(n, value); }
+
+        static size_t num_words(size_t n) { return (n + 63) / 64; }
+
+        void resize(size_t n, bool value = false) {
+            size = n;
+            words.assign(num_words(n), value ? ~0ull : 0ull);
+            clear_padding();
+        }
+
+        bool get(size_t i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+        void set(size_t i) { words[i >> 6] |= 1ull << (i & 63); }
+        void reset(size_t i) { words[i >> 6] &= ~(1ull << (i & 63)); }
+
+        void clear_padding() {
+            if (size % 64 != 0)
+                words.back() &= (1ull << (size % 64)) - 1;
+        }
+
+        Bitset& operator&=(const Bitset& b) {
+            for (size_t w = 0; w < words.size() && w < b.words.size(); ++w)
+                words[w] &= b.words[w];
+            return *this;
+        }
+
+        Bitset& operator|=(const Bitset& b) {
+            for (size_t w = 0; w < words.size() && w < b.words.size(); ++w)
+                words[w] |= b.words[w];
+            return *this;
+        }
+
+        /// Inverts every bit
+        void flip() {
+            for (auto& w : words)
+                w = ~w;
+            clear_padding();
+        }
+
+        size_t count() const {
+            size_t r = 0;
+            for (auto w : words)
+                r += popcount(w);
+            return r;
+        }
+
+        /// Calls f(i) for each set bit in increasing order
+        template<typename F>
+        void for_each(F f) const {
+            for (size_t w = 0; w < words.size(); ++w)
+                for (auto bits = words[w]; bits != 0; bits &= bits - 1)
+                    f(w * 64 + count_trailing_zeros(bits));
+        }
+
+        /// Returns the indices of the set bits in increasing order
+        vector<int32_t> to_indices() const {
+            vector<int32_t> r;
+            r.reserve(count());
+            for_each([&](size_t i) { r.push_back((int32_t)i); });
+            return r;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*
+    Bounding Volume Hierarchy over Axis-Aligned Boxes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include "geometry.h"
+#include "parallel.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// A node of a BVH. A leaf refers to count items starting at first in the item list.
+    /// An internal node has count == 0 and its two children are at first and first + 1.
+    struct BvhNode
+    {
+        AABox box;
+        int32_t first;
+        int32_t count;
+
+        bool is_leaf() const { return count > 0; }
+    };
+
+    /// A binary BVH built by splitting at the median along the longest axis of the box centers.
+    /// Nodes and items are flat arrays, so they can be stored and reused without rebuilding.
+    struct Bvh
+    {
+        vector<BvhNode> nodes;
+        vector<int32_t> items;
+
+        bool empty() const { return nodes.empty(); }
+        const AABox& bounds() const { return nodes[0].box; }
+
+        /// Builds a BVH over the given boxes. Empty boxes are left out. The top levels are split serially until the subtrees are small
+        /// enough to give every thread several of them, and the subtrees are then built in parallel.
+        static Bvh build(const vector<AABox>& boxes, int max_leaf_size = 4)
+        {
+            Bvh r;
+            for (size_t i = 0; i < boxes.size(); ++i)
+                if (!boxes[i].is_empty())
+                    r.items.push_back((int32_t)i);
+            if (r.items.empty())
+                return r;
+
+            vector<Vector3> centers(boxes.size());
+            for (auto i : r.items)
+                centers[i] = boxes[i].center();
+
+            r.nodes.resize(r.items.size() * 2);
+            atomic<int32_t> next_node(1);
+            vector<BuildTask> subtrees;
+            const auto subtree_size = (int32_t)max<size_t>(4096, r.items.size() / (thread_count() * 4));
+            r.build_node(0, 0, (int32_t)r.items.size(), boxes, centers, max(1, max_leaf_size), next_node, subtree_size, &subtrees);
+            parallel_for(subtrees.size(), [&](size_t i) {
+                auto& t = subtrees[i];
+                r.build_node(t.node, t.begin, t.end, boxes, centers, max(1, max_leaf_size), next_node, 0, nullptr);
+            }, 1);
+            r.nodes.resize(next_node);
+            return r;
+        }
+
+        /// Calls visit(item) for each item in the subtree of the given node
+        template<typename Visit>
+        void visit_subtree(int32_t node, Visit visit) const
+        {
+            const auto& n = nodes[node];
+            if (n.is_leaf()) {
+                for (auto i = n.first; i < n.first + n.count; ++i)
+                    visit(items[i]);
+                return;
+            }
+            visit_subtree(n.first, visit);
+            visit_subtree(n.first + 1, visit);
+        }
+
+        /// Walks the tree from the root. classify(box) returns 0 when the box is rejected, 1 when it partially passes, and 2 when it fully passes.
+        /// Items of a fully passing node are visited without further tests; items of partially passing leaves are passed to visit_partial(item).
+        template<typename Classify, typename VisitAll, typename VisitPartial>
+        void traverse(Classify classify, VisitAll visit_all, VisitPartial visit_partial) const
+        {
+            if (empty()) return;
+            int32_t stack[64];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0) {
+                auto node = stack[--top];
+                const auto& n = nodes[node];
+                auto c = classify(n.box);
+                if (c == 0)
+                    continue;
+                if (c == 2)
+                    visit_subtree(node, visit_all);
+                else if (n.is_leaf())
+                    for (auto i = n.first; i < n.first + n.count; ++i)
+                        visit_partial(items[i]);
+                else {
+                    stack[top++] = n.first + 1;
+                    stack[top++] = n.first;
+                }
+            }
+        }
+
+        /// Calls f(item) for each item whose node box intersects the given box. Callers test the item boxes themselves if they need an exact answer.
+        template<typename F>
+        void query(const AABox& box, F f) const
+        {
+            traverse([&](const AABox& b) { return box.intersects(b) ? 1 : 0; }, f, f);
+        }
+
+        /// Calls f(a, b) once for each pair of distinct items of this tree whose leaf boxes overlap
+        template<typename F>
+        void self_pairs(F f) const
+        {
+            if (!empty())
+                pairs_of_nodes(*this, 0, 0, f);
+        }
+
+        /// Returns the node pairs that are the roots of the independent subproblems of a self-intersection query, so that they can be processed in parallel
+        vector<pair<int32_t, int32_t>> self_pair_tasks(size_t min_tasks = 256) const
+        {
+            vector<pair<int32_t, int32_t>> tasks;
+            if (empty()) return tasks;
+            tasks.push_back({ 0, 0 });
+            while (tasks.size() < min_tasks) {
+                auto size = tasks.size();
+                collect_pair_tasks(*this, tasks);
+                if (tasks.size() == size) break;
+            }
+            return tasks;
+        }
+
+        /// Calls f(a, b) for the pairs of items under the given pair of nodes whose leaf boxes overlap. When both nodes are the same, each pair is reported once.
+        template<typename F>
+        void pairs_of_nodes(const Bvh& other, int32_t a, int32_t b, F f) const
+        {
+            const auto& na = nodes[a];
+            const auto& nb = other.nodes[b];
+            const bool same = this == &other && a == b;
+            if (!same && !na.box.intersects(nb.box))
+                return;
+            if (na.is_leaf() && nb.is_leaf()) {
+                for (auto i = na.first; i < na.first + na.count; ++i)
+                    for (auto j = same ? i + 1 : nb.first; j < nb.first + nb.count; ++j)
+                        f(items[i], other.items[j]);
+                return;
+            }
+            if (same) {
+                pairs_of_nodes(other, na.first, na.first, f);
+                pairs_of_nodes(other, na.first + 1, na.first + 1, f);
+                pairs_of_nodes(other, na.first, na.first + 1, f);
+                return;
+            }
+            // Descend into the larger node first
+            if (nb.is_leaf() || (!na.is_leaf() && volume(na.box) >= volume(nb.box))) {
+                pairs_of_nodes(other, na.first, b, f);
+                pairs_of_nodes(other, na.first + 1, b, f);
+            }
+            else {
+                pairs_of_nodes(other, a, nb.first, f);
+                pairs_of_nodes(other, a, nb.first + 1, f);
+            }
+        }
+
+        static float volume(const AABox& b) {
+            auto e = b.extent();
+            return e.x * e.y * e.z;
+        }
+
+    private:
+        // Replaces each self pair (n, n) of an internal node with its three sub-problems, and each other pair of overlapping internal nodes with its four
+        static void collect_pair_tasks(const Bvh& bvh, vector<pair<int32_t, int32_t>>& tasks)
+        {
+            vector<pair<int32_t, int32_t>> r;
+            for (auto& t : tasks) {
+                const auto& na = bvh.nodes[t.first];
+                const auto& nb = bvh.nodes[t.second];
+                if (t.first == t.second && !na.is_leaf()) {
+                    r.push_back({ na.first, na.first });
+                    r.push_back({ na.first + 1, na.first + 1 });
+                    r.push_back({ na.first, na.first + 1 });
+                }
+                else if (t.first != t.second && !na.is_leaf() && !nb.is_leaf()) {
+                    if (!na.box.intersects(nb.box)) continue;
+                    for (auto i = 0; i < 2; ++i)
+                        for (auto j = 0; j < 2; ++j)
+                            r.push_back({ na.first + i, nb.first + j });
+                }
+                else if (t.first == t.second || na.box.intersects(nb.box))
+                    r.push_back(t);
+            }
+            tasks.swap(r);
+        }
+
+        struct BuildTask { int32_t node, begin, end; };
+
+        /// Builds the subtree of a node over items [begin, end). With a list of subtrees, subtrees of at most subtree_size items are added to it instead of built.
+        void build_node(int32_t node, int32_t begin, int32_t end, const vector<AABox>& boxes, const vector<Vector3>& centers, int max_leaf_size,
+            atomic<int32_t>& next_node, int32_t subtree_size, vector<BuildTask>* subtrees)
+        {
+            if (subtrees && end - begin <= subtree_size) {
+                subtrees->push_back({ node, begin, end });
+                return;
+            }
+            AABox box, center_box;
+            for (auto i = begin; i < end; ++i) {
+                box.merge(boxes[items[i]]);
+                center_box.merge(centers[items[i]]);
+            }
+            auto& n = nodes[node];
+            n.box = box;
+            auto e = center_box.extent();
+            if (end - begin <= max_leaf_size || (e.x == 0 && e.y == 0 && e.z == 0)) {
+                n.first = begin;
+                n.count = end - begin;
+                return;
+            }
+            auto axis = e.x >= e.y && e.x >= e.z ? 0 : e.y >= e.z ? 1 : 2;
+            auto mid = begin + (end - begin) / 2;
+            nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                [&](int32_t a, int32_t b) { return centers[a][axis] < centers[b][axis]; });
+            auto left = next_node.fetch_add(2);
+            n.first = left;
+            n.count = 0;
+            build_node(left, begin, mid, boxes, centers, max_leaf_size, next_node, subtree_size, subtrees);
+            build_node(left + 1, mid, end, boxes, centers, max_leaf_size, next_node, subtree_size, subtrees);
+        }
+    };
+
+    /// Builds a BVH over the local-space triangles of a sub-geometry. The items are triangle indices within the sub-geometry (see MeshView::triangle_corners).
+    inline Bvh build_triangle_bvh(const MeshView& mesh, size_t subgeo, int max_leaf_size = 4)
+    {
+        vector<AABox> boxes(mesh.num_triangles(subgeo));
+        for (size_t t = 0; t < boxes.size(); ++t) {
+            size_t c[3];
+            mesh.triangle_corners(subgeo, t, c);
+            for (auto k = 0; k < 3; ++k)
+                boxes[t].merge(mesh.corner_position(c[k]));
+        }
+        return Bvh::build(boxes, max_leaf_size);
+    }
+}
+
+#endif
@@ -0,0 +1,389 @@
+/*
+    Clash Detection between G3D Instances and VIM Scene Nodes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __CLASH_H__
+#define __CLASH_H__
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "geometry.h"
+#include "parallel.h"
+#include "bvh.h"
+#include "culling.h"
+#include "vim.h"
+#include "transforms.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    enum ClashMode
+    {
+        clash_hard,         // the triangles of the two elements cross each other
+        clash_clearance,    // the two elements are closer than the clearance distance
+    };
+
+    struct ClashOptions
+    {
+        ClashMode mode = clash_hard;
+
+        /// Hard mode: triangles must cross each other's planes, and overlap along their line of intersection, by more than this distance.
+        /// Touching or coplanar contact is never a hard clash.
+        float tolerance = 0;
+
+        /// Clearance mode: elements whose triangles are closer than this distance clash
+        float clearance = 0;
+
+        /// Optional filter, called with each candidate pair of instances. Return false to skip the pair.
+        function<bool(int32_t, int32_t)> filter;
+    };
+
+    /// World-space triangles of an instance with their unit normals, plane offsets and bounds.
+    /// Degenerate triangles are left out, since they can't clash.
+    struct ClashTriangles
+    {
+        vector<Vector3> points;
+        vector<Vector3> normals;
+        vector<float> offsets;
+        vector<AABox> boxes;
+
+        size_t size() const { return normals.size(); }
+        const Vector3* triangle(size_t i) const { return &points[i * 3]; }
+
+        void clear() {
+            points.clear();
+            normals.clear();
+            offsets.clear();
+            boxes.clear();
+        }
+
+        void add(const Vector3& a, const Vector3& b, const Vector3& c) {
+            auto n = cross(b - a, c - a);
+            auto l = length(n);
+            if (!(l > 0)) return;
+            n = n * (1.0f / l);
+            points.push_back(a);
+            points.push_back(b);
+            points.push_back(c);
+            normals.push_back(n);
+            offsets.push_back(dot(n, a));
+            AABox box;
+            box.merge(a);
+            box.merge(b);
+            box.merge(c);
+            boxes.push_back(box);
+        }
+    };
+
+    /// Computes the interval of projections onto dir of the points where a triangle meets a plane, given the signed distances of its vertices to the plane
+    inline bool plane_crossing_interval(const Vector3* p, const float* d, const Vector3& dir, float& lo, float& hi)
+    {
+        lo = FLT_MAX;
+        hi = -FLT_MAX;
+        for (auto i = 0; i < 3; ++i) {
+            auto j = (i + 1) % 3;
+            if (d[i] == 0) {
+                lo = min(lo, dot(dir, p[i]));
+                hi = max(hi, dot(dir, p[i]));
+            }
+            if ((d[i] < 0 && d[j] > 0) || (d[i] > 0 && d[j] < 0)) {
+                auto q = p[i] + (p[j] - p[i]) * (d[i] / (d[i] - d[j]));
+                lo = min(lo, dot(dir, q));
+                hi = max(hi, dot(dir, q));
+            }
+        }
+        return lo <= hi;
+    }
+
+    /// Returns true if each triangle crosses the plane of the other by more than the tolerance, and their crossings overlap by more than the tolerance.
+    /// This is the interval overlap test of Moller, with touching and coplanar contact treated as not crossing.
+    inline bool triangles_cross(const Vector3* a, const Vector3& na, float da, const Vector3* b, const Vector3& nb, float db, float tolerance)
+    {
+        float dist_a[3], dist_b[3];
+        for (auto i = 0; i < 3; ++i) {
+            dist_a[i] = dot(nb, a[i]) - db;
+            dist_b[i] = dot(na, b[i]) - da;
+        }
+        auto straddles = [&](const float* d) {
+            return min(d[0], min(d[1], d[2])) < -tolerance && max(d[0], max(d[1], d[2])) > tolerance;
+        };
+        if (!straddles(dist_a) || !straddles(dist_b))
+            return false;
+        auto dir = cross(na, nb);
+        if (dot(dir, dir) < 1e-12f)
+            return false;
+        float lo_a, hi_a, lo_b, hi_b;
+        if (!plane_crossing_interval(a, dist_a, dir, lo_a, hi_a) || !plane_crossing_interval(b, dist_b, dir, lo_b, hi_b))
+            return false;
+        return min(hi_a, hi_b) - max(lo_a, lo_b) > tolerance * length(dir);
+    }
+
+    /// Returns the closest point to p on the triangle abc (Ericson, Real-Time Collision Detection 5.1.5)
+    inline Vector3 closest_point_on_triangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c)
+    {
+        auto ab = b - a, ac = c - a, ap = p - a;
+        auto d1 = dot(ab, ap), d2 = dot(ac, ap);
+        if (d1 <= 0 && d2 <= 0) return a;
+        auto bp = p - b;
+        auto d3 = dot(ab, bp), d4 = dot(ac, bp);
+        if (d3 >= 0 && d4 <= d3) return b;
+        auto vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab * (d1 / (d1 - d3));
+        auto cp = p - c;
+        auto d5 = dot(ab, cp), d6 = dot(ac, cp);
+        if (d6 >= 0 && d5 <= d6) return c;
+        auto vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac * (d2 / (d2 - d6));
+        auto va = d3 * d6 - d5 * d4;
+        if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+        auto denom = 1.0f / (va + vb + vc);
+        return a + ab * (vb * denom) + ac * (vc * denom);
+    }
+
+    /// Returns the squared distance between the segments pq and rs (Ericson, Real-Time Collision Detection 5.1.9)
+    inline float segment_distance_squared(const Vector3& p, const Vector3& q, const Vector3& r, const Vector3& s)
+    {
+        auto d1 = q - p, d2 = s - r, e = p - r;
+        auto a = dot(d1, d1), b = dot(d1, d2), c = dot(d1, e), f = dot(d2, e), g = dot(d2, d2);
+        float t1 = 0, t2 = 0;
+        if (a <= FLT_EPSILON && g <= FLT_EPSILON) {}
+        else if (a <= FLT_EPSILON)
+            t2 = std::min(std::max(f / g, 0.0f), 1.0f);
+        else if (g <= FLT_EPSILON)
+            t1 = std::min(std::max(-c / a, 0.0f), 1.0f);
+        else {
+            auto denom = a * g - b * b;
+            t1 = denom != 0 ? std::min(std::max((b * f - c * g) / denom, 0.0f), 1.0f) : 0.0f;
+            t2 = (b * t1 + f) / g;
+            if (t2 < 0) {
+                t2 = 0;
+                t1 = std::min(std::max(-c / a, 0.0f), 1.0f);
+            }
+            else if (t2 > 1) {
+                t2 = 1;
+                t1 = std::min(std::max((b - c) / a, 0.0f), 1.0f);
+            }
+        }
+        auto v = (p + d1 * t1) - (r + d2 * t2);
+        return dot(v, v);
+    }
+
+    /// Returns the squared distance between two triangles that don't cross: the smallest of the vertex to triangle and edge to edge distances
+    inline float triangle_distance_squared(const Vector3* a, const Vector3* b)
+    {
+        auto r = FLT_MAX;
+        for (auto i = 0; i < 3; ++i) {
+            auto p = closest_point_on_triangle(a[i], b[0], b[1], b[2]) - a[i];
+            r = min(r, dot(p, p));
+            auto q = closest_point_on_triangle(b[i], a[0], a[1], a[2]) - b[i];
+            r = min(r, dot(q, q));
+        }
+        for (auto i = 0; i < 3; ++i)
+            for (auto j = 0; j < 3; ++j)
+                r = min(r, segment_distance_squared(a[i], a[(i + 1) % 3], b[j], b[(j + 1) % 3]));
+        return r;
+    }
+
+    /// Tests triangle i of the first set against the given candidates of the second set, and returns true at the first clash.
+    /// Candidates are processed in blocks of lanes in structure-of-arrays layout, so that the plane-side rejection test is vectorized.
+    /// Only the candidates that pass it get the exact test.
+    inline bool triangle_clashes(const ClashTriangles& first, size_t i, const ClashTriangles& second, const int32_t* candidates, size_t count, const ClashOptions& options)
+    {
+        const size_t lanes = 8;
+        const auto a = first.triangle(i);
+        const auto na = first.normals[i];
+        const auto da = first.offsets[i];
+        const auto hard = options.mode == clash_hard;
+        const auto limit = hard ? options.tolerance : options.clearance;
+
+        for (size_t begin = 0; begin < count; begin += lanes)
+        {
+            auto n = min(lanes, count - begin);
+            float bx[3][lanes], by[3][lanes], bz[3][lanes], nx[lanes], ny[lanes], nz[lanes], db[lanes];
+            for (size_t l = 0; l < lanes; ++l) {
+                auto j = candidates[begin + min(l, n - 1)];
+                auto b = second.triangle(j);
+                for (auto k = 0; k < 3; ++k) {
+                    bx[k][l] = b[k].x;
+                    by[k][l] = b[k].y;
+                    bz[k][l] = b[k].z;
+                }
+                nx[l] = second.normals[j].x;
+                ny[l] = second.normals[j].y;
+                nz[l] = second.normals[j].z;
+                db[l] = second.offsets[j];
+            }
+
+            int pass[lanes];
+            for (size_t l = 0; l < lanes; ++l) {
+                float min_b = FLT_MAX, max_b = -FLT_MAX, min_a = FLT_MAX, max_a = -FLT_MAX;
+                for (auto k = 0; k < 3; ++k) {
+                    auto d = na.x * bx[k][l] + na.y * by[k][l] + na.z * bz[k][l] - da;
+                    min_b = min(min_b, d);
+                    max_b = max(max_b, d);
+                    auto e = nx[l] * a[k].x + ny[l] * a[k].y + nz[l] * a[k].z - db[l];
+                    min_a = min(min_a, e);
+                    max_a = max(max_a, e);
+                }
+                pass[l] = hard
+                    ? (min_b < -limit) & (max_b > limit) & (min_a < -limit) & (max_a > limit)
+                    : (min_b < limit) & (max_b > -limit) & (min_a < limit) & (max_a > -limit);
+            }
+
+            for (size_t l = 0; l < n; ++l) {
+                if (!pass[l]) continue;
+                auto j = candidates[begin + l];
+                auto b = second.triangle(j);
+                if (triangles_cross(a, na, da, b, second.normals[j], second.offsets[j], hard ? limit : 0))
+                    return true;
+                if (!hard && triangle_distance_squared(a, b) < limit * limit)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    /// Returns true if any triangle of the first set clashes with any of the second. A BVH is built over the larger set when it is big enough to pay off.
+    inline bool triangle_sets_clash(const ClashTriangles& a, const ClashTriangles& b, const ClashOptions& options)
+    {
+        if (a.size() == 0 || b.size() == 0)
+            return false;
+        const auto& first = a.size() <= b.size() ? a : b;
+        const auto& second = a.size() <= b.size() ? b : a;
+        const auto margin = options.mode == clash_clearance ? options.clearance : 0.0f;
+
+        vector<int32_t> candidates;
+        if (second.size() <= 32) {
+            candidates.resize(second.size());
+            for (size_t j = 0; j < second.size(); ++j)
+                candidates[j] = (int32_t)j;
+            for (size_t i = 0; i < first.size(); ++i)
+                if (triangle_clashes(first, i, second, candidates.data(), candidates.size(), options))
+                    return true;
+            return false;
+        }
+
+        auto bvh = Bvh::build(second.boxes);
+        for (size_t i = 0; i < first.size(); ++i) {
+            candidates.clear();
+            auto box = first.boxes[i].inflate(margin);
+            bvh.query(box, [&](int32_t j) {
+                if (box.intersects(second.boxes[j]))
+                    candidates.push_back(j);
+            });
+            if (triangle_clashes(first, i, second, candidates.data(), candidates.size(), options))
+                return true;
+        }
+        return false;
+    }
+
+    /// Finds clashing pairs of instances.
+    /// The broad phase finds the pairs of instances whose world-space boxes overlap with a parallel self-intersection query of a BVH over the instance boxes.
+    /// The narrow phase uses a local-space triangle BVH per sub-geometry to gather the triangles of each instance that lie in the overlap of the two boxes,
+    /// then tests those triangles against each other. Candidate pairs are claimed dynamically by the worker threads, so that expensive pairs don't hold up the others.
+    /// Returns the pairs (a, b) of instance indices with a < b, sorted.
+    inline vector<pair<int32_t, int32_t>> find_clashes(const G3d& g, const InstanceView& instances, const ClashOptions& options = {})
+    {
+        MeshView mesh(g);
+        const auto margin = options.mode == clash_clearance ? options.clearance : 0.0f;
+
+        // Broad phase
+        auto boxes = FrustumCuller::instance_boxes(mesh, instances);
+        vector<AABox> inflated(boxes.size());
+        for (size_t i = 0; i < boxes.size(); ++i)
+            inflated[i] = boxes[i].is_empty() ? boxes[i] : boxes[i].inflate(margin * 0.5f);
+        auto bvh = Bvh::build(inflated);
+        auto tasks = bvh.self_pair_tasks(thread_count() * 64);
+        vector<vector<pair<int32_t, int32_t>>> task_pairs(tasks.size());
+        parallel_for(tasks.size(), [&](size_t t) {
+            bvh.pairs_of_nodes(bvh, tasks[t].first, tasks[t].second, [&](int32_t a, int32_t b) {
+                if (!inflated[a].intersects(inflated[b])) return;
+                auto p = a < b ? make_pair(a, b) : make_pair(b, a);
+                if (!options.filter || options.filter(p.first, p.second))
+                    task_pairs[t].push_back(p);
+            });
+        }, 1);
+        vector<pair<int32_t, int32_t>> candidates;
+        for (auto& pairs : task_pairs)
+            candidates.insert(candidates.end(), pairs.begin(), pairs.end());
+        sort(candidates.begin(), candidates.end());
+
+        // Triangle BVHs in local space of the sub-geometries that take part in a candidate pair
+        vector<uint8_t> needed(mesh.num_subgeos, 0);
+        for (auto& p : candidates) {
+            needed[instances.subgeo(p.first)] = 1;
+            needed[instances.subgeo(p.second)] = 1;
+        }
+        vector<Bvh> local_bvhs(mesh.num_subgeos);
+        parallel_for(mesh.num_subgeos, [&](size_t s) {
+            if (needed[s])
+                local_bvhs[s] = build_triangle_bvh(mesh, s);
+        }, 1);
+
+        // Narrow phase
+        auto gather = [&](int32_t instance, const AABox& region, ClashTriangles& out) {
+            out.clear();
+            auto s = instances.subgeo(instance);
+            auto m = instances.transform(instance);
+            float inverse[16];
+            if (!invert_affine(m, inverse))
+                return;
+            auto local_region = transform_box(inverse, region);
+            local_bvhs[s].query(local_region, [&](int32_t t) {
+                size_t c[3];
+                mesh.triangle_corners(s, t, c);
+                Vector3 p[3];
+                AABox box;
+                for (auto k = 0; k < 3; ++k) {
+                    p[k] = transform_point(m, mesh.corner_position(c[k]));
+                    box.merge(p[k]);
+                }
+                if (box.intersects(region))
+                    out.add(p[0], p[1], p[2]);
+            });
+        };
+
+        vector<uint8_t> clashes(candidates.size(), 0);
+        parallel_for_chunks(candidates.size(), 8, [&](size_t begin, size_t end) {
+            ClashTriangles a, b;
+            for (auto i = begin; i < end; ++i) {
+                auto p = candidates[i];
+                auto region = boxes[p.first].inflate(margin);
+                auto other = boxes[p.second].inflate(margin);
+                region.min = component_max(region.min, other.min);
+                region.max = component_min(region.max, other.max);
+                if (region.is_empty()) continue;
+                gather(p.first, region, a);
+                gather(p.second, region, b);
+                clashes[i] = triangle_sets_clash(a, b, options) ? 1 : 0;
+            }
+        });
+
+        vector<pair<int32_t, int32_t>> r;
+        for (size_t i = 0; i < candidates.size(); ++i)
+            if (clashes[i])
+                r.push_back(candidates[i]);
+        return r;
+    }
+
+    inline vector<pair<int32_t, int32_t>> find_clashes(const G3d& g, const ClashOptions& options = {})
+    {
+        return find_clashes(g, InstanceView::from_g3d(g), options);
+    }
+}
+
+namespace Vim
+{
+    /// Finds the pairs of scene nodes whose geometry clashes (see g3d::find_clashes). Returns pairs of node indices (a, b) with a < b, sorted.
+    inline std::vector<std::pair<int32_t, int32_t>> FindClashes(const Scene& scene, const g3d::ClashOptions& options = {})
+    {
+        return g3d::find_clashes(scene.mGeometry, WorldInstances(scene).View(), options);
+    }
+}
+
+#endif
@@ -0,0 +1,327 @@
+/*
+    Frustum Culling of G3D Instances and Sub-Geometries
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __CULLING_H__
+#define __CULLING_H__
+
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "bits.h"
+#include "bvh.h"
+#include "vim.h"
+#include "transforms.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// A plane with normal n and offset d. Points p with dot(n, p) + d >= 0 are on the inner side.
+    struct Plane
+    {
+        Vector3 normal;
+        float d;
+
+        float distance(const Vector3& p) const { return dot(normal, p) + d; }
+    };
+
+    /// Six planes facing inwards: left, right, bottom, top, near, far
+    struct Frustum
+    {
+        Plane planes[6];
+
+        /// Extracts the planes from a view-projection matrix using the row-vector convention of the rest of the library (clip = p * m).
+        /// Set zero_to_one_depth for Direct3D-style projections, whose clip depth range is [0, w] rather than [-w, w].
+        static Frustum from_matrix(const float* m, bool zero_to_one_depth = true)
+        {
+            // Each plane is a combination of a column of the matrix with the w column
+            auto plane = [&](int j, float s, float w) {
+                Plane p;
+                p.normal = { m[j] * s + m[3] * w, m[4 + j] * s + m[7] * w, m[8 + j] * s + m[11] * w };
+                p.d = m[12 + j] * s + m[15] * w;
+                auto l = length(p.normal);
+                if (l > 0) { p.normal = p.normal * (1.0f / l); p.d /= l; }
+                return p;
+            };
+            Frustum f;
+            f.planes[0] = plane(0, 1, 1);
+            f.planes[1] = plane(0, -1, 1);
+            f.planes[2] = plane(1, 1, 1);
+            f.planes[3] = plane(1, -1, 1);
+            f.planes[4] = plane(2, 1, zero_to_one_depth ? 0.0f : 1.0f);
+            f.planes[5] = plane(2, -1, 1);
+            return f;
+        }
+
+        /// Returns 0 if the box is outside, 1 if it intersects the boundary, and 2 if it is fully inside
+        int classify(const AABox& b) const
+        {
+            auto r = 2;
+            for (const auto& p : planes) {
+                const auto& n = p.normal;
+                Vector3 pos = { n.x >= 0 ? b.max.x : b.min.x, n.y >= 0 ? b.max.y : b.min.y, n.z >= 0 ? b.max.z : b.min.z };
+                if (p.distance(pos) < 0)
+                    return 0;
+                Vector3 neg = { n.x >= 0 ? b.min.x : b.max.x, n.y >= 0 ? b.min.y : b.max.y, n.z >= 0 ? b.min.z : b.max.z };
+                if (p.distance(neg) < 0)
+                    r = 1;
+            }
+            return r;
+        }
+    };
+
+    /// The visible boxes of one view: as a bit set, and optionally as a sorted list of indices
+    struct CullResult
+    {
+        Bitset visible;
+        vector<int32_t> indices;
+    };
+
+    /// Culls a set of world-space boxes against view frustums.
+    /// The boxes are kept in structure-of-arrays layout and tested 16 at a time with AVX-512, 8 at a time with AVX2, or with a scalar loop otherwise.
+    /// The hierarchical mode walks a BVH over the same boxes instead, which is faster when only a small part of the scene is visible.
+    struct FrustumCuller
+    {
+        vector<float> min_x, min_y, min_z, max_x, max_y, max_z;
+        Bitset empty;
+        size_t count = 0;
+        Bvh bvh;
+        bool has_bvh = false;
+
+        static const size_t lanes = 16;
+
+        FrustumCuller() = default;
+
+        FrustumCuller(const vector<AABox>& boxes, bool build_bvh = false)
+        {
+            count = boxes.size();
+            auto padded = (count + lanes - 1) / lanes * lanes;
+            for (auto v : { &min_x, &min_y, &min_z, &max_x, &max_y, &max_z })
+                v->assign(padded, 0.0f);
+            empty.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                const auto& b = boxes[i];
+                if (b.is_empty()) { empty.set(i); continue; }
+                min_x[i] = b.min.x; min_y[i] = b.min.y; min_z[i] = b.min.z;
+                max_x[i] = b.max.x; max_y[i] = b.max.y; max_z[i] = b.max.z;
+            }
+            if (build_bvh)
+                bvh = Bvh::build(boxes);
+            has_bvh = build_bvh;
+        }
+
+        /// Computes the world-space box of each instance in parallel
+        static vector<AABox> instance_boxes(const MeshView& mesh, const InstanceView& instances)
+        {
+            vector<AABox> local(mesh.num_subgeos);
+            parallel_for(mesh.num_subgeos, [&](size_t s) { local[s] = mesh.subgeo_bounds(s); }, 256);
+            vector<AABox> r(instances.count);
+            parallel_for(instances.count, [&](size_t i) {
+                auto s = instances.subgeo(i);
+                if (s >= 0 && (size_t)s < local.size())
+                    r[i] = transform_box(instances.transform(i), local[s]);
+            });
+            return r;
+        }
+
+        /// Creates a culler over the instances of a G3d
+        static FrustumCuller from_instances(const G3d& g, bool build_bvh = false) {
+            return FrustumCuller(instance_boxes(MeshView(g), InstanceView::from_g3d(g)), build_bvh);
+        }
+
+        /// Creates a culler over the untransformed sub-geometries of a G3d
+        static FrustumCuller from_subgeos(const G3d& g, bool build_bvh = false) {
+            MeshView mesh(g);
+            vector<AABox> boxes(mesh.num_subgeos);
+            parallel_for(mesh.num_subgeos, [&](size_t s) { boxes[s] = mesh.subgeo_bounds(s); }, 256);
+            return FrustumCuller(boxes, build_bvh);
+        }
+
+        /// Culls the boxes against several views in one pass over the boxes. Each block of boxes is loaded once and tested against every view.
+        vector<CullResult> cull(const vector<Frustum>& views, bool make_indices = true) const
+        {
+            vector<CullResult> r(views.size());
+            for (auto& x : r)
+                x.visible.resize(count);
+            // Blocks are multiples of 64 boxes so that each writes whole words of the bit sets
+            parallel_for_chunks(count, 4096, [&](size_t begin, size_t end) {
+                for (size_t v = 0; v < views.size(); ++v)
+                    cull_range(views[v], begin, end, r[v].visible.words.data());
+            });
+            for (auto& x : r) {
+                for (size_t w = 0; w < x.visible.words.size(); ++w)
+                    x.visible.words[w] &= ~empty.words[w];
+                if (make_indices)
+                    x.indices = to_indices_parallel(x.visible);
+            }
+            return r;
+        }
+
+        CullResult cull(const Frustum& view, bool make_indices = true) const
+        {
+            return move(cull(vector<Frustum>{ view }, make_indices)[0]);
+        }
+
+        /// Culls by walking the BVH. Nodes fully inside the frustum are accepted without testing their boxes, and planes that a node is fully inside of are skipped for its children.
+        /// Multiple views are processed in parallel.
+        vector<CullResult> cull_hierarchical(const vector<Frustum>& views, bool make_indices = true) const
+        {
+            if (!has_bvh)
+                throw runtime_error("The culler was created without a BVH");
+            vector<CullResult> r(views.size());
+            parallel_for(views.size(), [&](size_t v) {
+                auto& result = r[v];
+                result.visible.resize(count);
+                if (!bvh.empty())
+                    walk(views[v], 0, 0x3F, result.visible);
+                if (make_indices)
+                    result.indices = result.visible.to_indices();
+            }, 1);
+            return r;
+        }
+
+        CullResult cull_hierarchical(const Frustum& view, bool make_indices = true) const
+        {
+            return move(cull_hierarchical(vector<Frustum>{ view }, make_indices)[0]);
+        }
+
+    private:
+        /// Tests the boxes [begin, end) against the frustum and sets the visible bits. begin must be a multiple of 64.
+        void cull_range(const Frustum& f, size_t begin, size_t end, uint64_t* words) const
+        {
+            // For each plane, the corner furthest along the normal decides whether a box is fully outside
+            const float* px[6]; const float* py[6]; const float* pz[6];
+            for (auto k = 0; k < 6; ++k) {
+                const auto& n = f.planes[k].normal;
+                px[k] = n.x >= 0 ? max_x.data() : min_x.data();
+                py[k] = n.y >= 0 ? max_y.data() : min_y.data();
+                pz[k] = n.z >= 0 ? max_z.data() : min_z.data();
+            }
+
+            for (auto i = begin; i < end; i += lanes) {
+                uint32_t outside = 0;
+#if defined(__AVX512F__)
+                __mmask16 out = 0;
+                for (auto k = 0; k < 6; ++k) {
+                    const auto& p = f.planes[k];
+                    auto d = _mm512_fmadd_ps(_mm512_set1_ps(p.normal.x), _mm512_loadu_ps(px[k] + i),
+                        _mm512_fmadd_ps(_mm512_set1_ps(p.normal.y), _mm512_loadu_ps(py[k] + i),
+                        _mm512_fmadd_ps(_mm512_set1_ps(p.normal.z), _mm512_loadu_ps(pz[k] + i), _mm512_set1_ps(p.d))));
+                    out |= _mm512_cmp_ps_mask(d, _mm512_setzero_ps(), _CMP_LT_OQ);
+                }
+                outside = out;
+#elif defined(__AVX2__)
+                for (auto half = 0; half < 2; ++half) {
+                    auto j = i + half * 8;
+                    auto out = _mm256_setzero_ps();
+                    for (auto k = 0; k < 6; ++k) {
+                        const auto& p = f.planes[k];
+                        auto d = _mm256_fmadd_ps(_mm256_set1_ps(p.normal.x), _mm256_loadu_ps(px[k] + j),
+                            _mm256_fmadd_ps(_mm256_set1_ps(p.normal.y), _mm256_loadu_ps(py[k] + j),
+                            _mm256_fmadd_ps(_mm256_set1_ps(p.normal.z), _mm256_loadu_ps(pz[k] + j), _mm256_set1_ps(p.d))));
+                        out = _mm256_or_ps(out, _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_LT_OQ));
+                    }
+                    outside |= (uint32_t)_mm256_movemask_ps(out) << (half * 8);
+                }
+#else
+                for (size_t l = 0; l < lanes; ++l) {
+                    auto out = false;
+                    for (auto k = 0; k < 6; ++k) {
+                        const auto& p = f.planes[k];
+                        out |= p.normal.x * px[k][i + l] + p.normal.y * py[k][i + l] + p.normal.z * pz[k][i + l] + p.d < 0;
+                    }
+                    outside |= (uint32_t)out << l;
+                }
+#endif
+                auto visible = (uint64_t)(~outside & 0xFFFF);
+                if (i + lanes > end)
+                    visible &= (1ull << (end - i)) - 1;
+                words[i >> 6] |= visible << (i & 63);
+            }
+        }
+
+        static vector<int32_t> to_indices_parallel(const Bitset& bits)
+        {
+            const size_t words_per_part = 1024;
+            auto parts = (bits.words.size() + words_per_part - 1) / words_per_part;
+            vector<size_t> offsets(parts + 1, 0);
+            parallel_for(parts, [&](size_t p) {
+                size_t n = 0;
+                for (auto w = p * words_per_part; w < min(bits.words.size(), (p + 1) * words_per_part); ++w)
+                    n += popcount(bits.words[w]);
+                offsets[p + 1] = n;
+            }, 1);
+            for (size_t p = 0; p < parts; ++p)
+                offsets[p + 1] += offsets[p];
+            vector<int32_t> r(offsets.back());
+            parallel_for(parts, [&](size_t p) {
+                auto out = offsets[p];
+                for (auto w = p * words_per_part; w < min(bits.words.size(), (p + 1) * words_per_part); ++w)
+                    for (auto b = bits.words[w]; b != 0; b &= b - 1)
+                        r[out++] = (int32_t)(w * 64 + count_trailing_zeros(b));
+            }, 1);
+            return r;
+        }
+
+        AABox box(size_t i) const {
+            return { { min_x[i], min_y[i], min_z[i] }, { max_x[i], max_y[i], max_z[i] } };
+        }
+
+        // Returns 0 if outside, otherwise clears the bits of the planes that the box is fully inside of
+        static int classify(const Frustum& f, const AABox& b, int& plane_mask)
+        {
+            for (auto k = 0; k < 6; ++k) {
+                if (!(plane_mask & (1 << k))) continue;
+                const auto& p = f.planes[k];
+                const auto& n = p.normal;
+                Vector3 pos = { n.x >= 0 ? b.max.x : b.min.x, n.y >= 0 ? b.max.y : b.min.y, n.z >= 0 ? b.max.z : b.min.z };
+                if (p.distance(pos) < 0)
+                    return 0;
+                Vector3 neg = { n.x >= 0 ? b.min.x : b.max.x, n.y >= 0 ? b.min.y : b.max.y, n.z >= 0 ? b.min.z : b.max.z };
+                if (p.distance(neg) >= 0)
+                    plane_mask &= ~(1 << k);
+            }
+            return 1;
+        }
+
+        void walk(const Frustum& f, int32_t node, int plane_mask, Bitset& visible) const
+        {
+            const auto& n = bvh.nodes[node];
+            if (!classify(f, n.box, plane_mask))
+                return;
+            if (plane_mask == 0) {
+                bvh.visit_subtree(node, [&](int32_t i) { visible.set(i); });
+                return;
+            }
+            if (n.is_leaf()) {
+                for (auto i = n.first; i < n.first + n.count; ++i) {
+                    auto item = bvh.items[i];
+                    auto mask = plane_mask;
+                    if (classify(f, box(item), mask))
+                        visible.set(item);
+                }
+                return;
+            }
+            walk(f, n.first, plane_mask, visible);
+            walk(f, n.first + 1, plane_mask, visible);
+        }
+    };
+}
+
+namespace Vim
+{
+    /// Creates a culler whose box indices are scene node indices. Nodes without geometry are never visible.
+    inline g3d::FrustumCuller CreateNodeCuller(const Scene& scene, bool buildBvh = false)
+    {
+        auto boxes = g3d::FrustumCuller::instance_boxes(g3d::MeshView(scene.mGeometry), WorldInstances(scene).View());
+        return g3d::FrustumCuller(boxes, buildBvh);
+    }
+}
+
+#endif
@@ -0,0 +1,258 @@
+/*
+    Lazily Computed Derived Attributes of a G3D
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __DERIVED_H__
+#define __DERIVED_H__
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+
+#include "geometry.h"
+#include "parallel.h"
+#include "edges.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// Zero-initialized storage whose data is aligned to 64 bytes, the size of a cache line and of an AVX-512 register
+    class AlignedBuffer
+    {
+    public:
+        static const size_t alignment = 64;
+
+        AlignedBuffer() = default;
+        AlignedBuffer(const AlignedBuffer&) = delete;
+        AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+        AlignedBuffer(AlignedBuffer&&) = default;
+        AlignedBuffer& operator=(AlignedBuffer&&) = default;
+
+        void resize(size_t size) {
+            storage.assign(size + alignment, 0);
+            auto p = (uintptr_t)storage.data();
+            _begin = storage.data() + ((alignment - p % alignment) % alignment);
+            _size = size;
+        }
+
+        /// Resizes the buffer to count elements of type T and returns them
+        template<typename T>
+        T* allocate(size_t count) {
+            resize(count * sizeof(T));
+            return data<T>();
+        }
+
+        template<typename T>
+        T* data() const { return (T*)_begin; }
+        uint8_t* begin() const { return _begin; }
+        uint8_t* end() const { return _begin + _size; }
+        size_t size() const { return _size; }
+
+    private:
+        vector<uint8_t> storage;
+        uint8_t* _begin = nullptr;
+        size_t _size = 0;
+    };
+
+    /// Attributes of a G3d that are computed from other attributes on first request, and kept for later requests.
+    /// Each descriptor has a producer, registered by descriptor string. When the G3d already stores an attribute with that descriptor, it is used instead.
+    /// Concurrent readers are safe: each attribute is produced exactly once, and the other readers wait for it.
+    /// The cache refers to the G3d, so the G3d must outlive it and must not have attributes added or removed while it is in use.
+    class DerivedAttributes
+    {
+    public:
+        /// Computes an attribute into the buffer. It can request other attributes from the cache. Returns false if its inputs are missing.
+        typedef function<bool(DerivedAttributes& cache, AlignedBuffer& out)> Producer;
+
+        /// The registered producers. Built-in producers are registered for the descriptors they compute.
+        static map<string, Producer>& producers() {
+            static map<string, Producer> r = builtin_producers();
+            return r;
+        }
+
+        /// Registers (or replaces) the producer of a descriptor. Not thread-safe: call it during initialization.
+        static void register_producer(const string& desc, Producer producer) {
+            producers()[desc] = producer;
+        }
+
+        explicit DerivedAttributes(const G3d& g)
+            : g(g), mesh(g)
+        {
+            for (auto& p : producers()) {
+                unique_ptr<Entry> e(new Entry());
+                e->producer = p.second;
+                e->stored = g.find_attribute(p.first);
+                entries[p.first] = move(e);
+            }
+        }
+
+        DerivedAttributes(const DerivedAttributes&) = delete;
+        DerivedAttributes& operator=(const DerivedAttributes&) = delete;
+
+        const G3d& source() const { return g; }
+        const MeshView& mesh_view() const { return mesh; }
+
+        /// Returns the stored attribute with the descriptor if there is one, otherwise the derived one, computing it on first request.
+        /// Returns nullptr if the attribute can't be derived.
+        const Attribute* get(const string& desc)
+        {
+            auto it = entries.find(desc);
+            if (it == entries.end())
+                return g.find_attribute(desc);
+            auto& e = *it->second;
+            if (e.stored)
+                return e.stored;
+#if !defined(_M_CEE)
+            call_once(e.once, [&]() { produce(desc, e); });
+#else
+            if (!e.done) {
+                produce(desc, e);
+                e.done = true;
+            }
+#endif
+            return e.derived.get();
+        }
+
+        template<typename T>
+        const T* data(const string& desc) {
+            auto attr = get(desc);
+            return attr ? attr->data<T>() : nullptr;
+        }
+
+        template<typename T>
+        size_t count(const string& desc) {
+            auto attr = get(desc);
+            return attr ? attr->count<T>() : 0;
+        }
+
+    private:
+        struct Entry
+        {
+            Producer producer;
+            const Attribute* stored = nullptr;
+            AlignedBuffer buffer;
+            unique_ptr<Attribute> derived;
+#if !defined(_M_CEE)
+            once_flag once;
+#else
+            bool done = false;
+#endif
+        };
+
+        const G3d& g;
+        MeshView mesh;
+        map<string, unique_ptr<Entry>> entries;
+
+        void produce(const string& desc, Entry& e)
+        {
+            if (e.producer(*this, e.buffer))
+                e.derived.reset(new Attribute(desc, e.buffer.begin(), e.buffer.end()));
+        }
+
+        /// Expands a per-group attribute to faces through the face groups. Faces without a valid group get the default value.
+        template<typename T, size_t N>
+        static Producer expand_group(const char* group_desc, const T (&default_value)[N])
+        {
+            vector<T> def(default_value, default_value + N);
+            return [group_desc, def](DerivedAttributes& cache, AlignedBuffer& out) {
+                auto groups = cache.get(descriptors::FaceGroupId);
+                auto values = cache.get(group_desc);
+                if (!groups || !values)
+                    return false;
+                const auto n = groups->count<int32_t>();
+                const auto num_groups = values->count<T>() / N;
+                auto face_groups = groups->data<int32_t>();
+                auto group_values = values->data<T>();
+                auto r = out.allocate<T>(n * N);
+                parallel_for(n, [&](size_t f) {
+                    auto src = face_groups[f] >= 0 && (size_t)face_groups[f] < num_groups ? group_values + face_groups[f] * N : def.data();
+                    copy(src, src + N, r + f * N);
+                });
+                return true;
+            };
+        }
+
+        static map<string, Producer> builtin_producers()
+        {
+            map<string, Producer> r;
+
+            r[descriptors::FaceNormal] = [](DerivedAttributes& cache, AlignedBuffer& out) {
+                vector<float> nx, ny, nz;
+                compute_face_normals(cache.mesh, nx, ny, nz);
+                auto n = out.allocate<Vector3>(nx.size());
+                parallel_for(nx.size(), [&](size_t f) { n[f] = { nx[f], ny[f], nz[f] }; }, 4096);
+                return true;
+            };
+
+            // Vertex normals are the area-weighted average of the normals of the faces around them. Sub-geometries are processed in parallel, since they don't share vertices.
+            r[descriptors::VertexNormal] = [](DerivedAttributes& cache, AlignedBuffer& out) {
+                const auto& mesh = cache.mesh;
+                const auto fs = (size_t)mesh.face_size;
+                if (fs < 3) return false;
+                auto n = out.allocate<Vector3>(mesh.num_vertices);
+                parallel_for(mesh.num_subgeos, [&](size_t s) {
+                    for (auto f = mesh.face_begin(s); f < mesh.face_end(s); ++f) {
+                        auto a = mesh.corner_position(f * fs);
+                        Vector3 area = { 0, 0, 0 };
+                        for (size_t k = 1; k + 1 < fs; ++k)
+                            area = area + cross(mesh.corner_position(f * fs + k) - a, mesh.corner_position(f * fs + k + 1) - a);
+                        for (size_t k = 0; k < fs; ++k) {
+                            auto& v = n[mesh.index(f * fs + k)];
+                            v = v + area;
+                        }
+                    }
+                    for (auto v = mesh.vertex_begin(s); v < mesh.vertex_end(s); ++v)
+                        n[v] = normalize(n[v]);
+                }, 1);
+                return true;
+            };
+
+            const int32_t no_id[1] = { -1 };
+            const float default_color[4] = { 0.5f, 0.5f, 0.5f, 1.0f };
+            r[descriptors::FaceMaterialId] = expand_group(descriptors::GroupMaterialId, no_id);
+            r[descriptors::FaceObjectId] = expand_group(descriptors::GroupObjectId, no_id);
+            r[descriptors::FaceColor] = expand_group(descriptors::GroupColor, default_color);
+
+            r[descriptors::SubGeoIndexCount] = [](DerivedAttributes& cache, AlignedBuffer& out) {
+                const auto& mesh = cache.mesh;
+                auto c = out.allocate<int32_t>(mesh.num_subgeos);
+                for (size_t s = 0; s < mesh.num_subgeos; ++s)
+                    c[s] = (int32_t)(mesh.index_end(s) - mesh.index_begin(s));
+                return true;
+            };
+
+            r[descriptors::SubGeoVertexCount] = [](DerivedAttributes& cache, AlignedBuffer& out) {
+                const auto& mesh = cache.mesh;
+                auto c = out.allocate<int32_t>(mesh.num_subgeos);
+                for (size_t s = 0; s < mesh.num_subgeos; ++s)
+                    c[s] = (int32_t)(mesh.vertex_end(s) - mesh.vertex_begin(s));
+                return true;
+            };
+
+            r[descriptors::SubGeoBounds] = [](DerivedAttributes& cache, AlignedBuffer& out) {
+                const auto& mesh = cache.mesh;
+                auto b = out.allocate<AABox>(mesh.num_subgeos);
+                parallel_for(mesh.num_subgeos, [&](size_t s) { b[s] = mesh.subgeo_bounds(s); }, 64);
+                return true;
+            };
+
+            r[descriptors::Bounds] = [](DerivedAttributes& cache, AlignedBuffer& out) {
+                auto subgeos = cache.get(descriptors::SubGeoBounds);
+                auto b = out.allocate<AABox>(1);
+                // The buffer is zeroed, which is not an empty box
+                *b = AABox();
+                for (size_t s = 0; s < subgeos->count<AABox>(); ++s)
+                    b->merge(subgeos->data<AABox>()[s]);
+                return true;
+            };
+
+            return r;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,168 @@
+/*
+    Feature Edge Extraction for G3D Sub-Geometries
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __EDGES_H__
+#define __EDGES_H__
+
+#include <vector>
+#include <cmath>
+
+#include "geometry.h"
+#include "parallel.h"
+#include "vim.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    struct edge_descriptors
+    {
+        // Pairs of vertex indices, grouped by sub-geometry
+        static constexpr const char* FeatureEdges = "g3d:all:featureedge:0:int32:2";
+        // The index of the first feature edge of each sub-geometry
+        static constexpr const char* SubGeoFeatureEdgeOffset = "g3d:subgeo:featureedgeoffset:0:int32:1";
+    };
+
+    /// Line segments that outline the sub-geometries: each segment is a pair of vertex indices, and the segments of sub-geometry s start at subgeo_offsets[s]
+    struct FeatureEdges
+    {
+        vector<int32_t> indices;
+        vector<int32_t> subgeo_offsets;
+
+        size_t num_edges() const { return indices.size() / 2; }
+    };
+
+    /// Computes the unit normal of every face with Newell's method, which also handles non-planar polygons, into structure-of-arrays buffers
+    inline void compute_face_normals(const MeshView& mesh, vector<float>& nx, vector<float>& ny, vector<float>& nz)
+    {
+        const auto n = mesh.num_faces();
+        const auto fs = (size_t)mesh.face_size;
+        nx.resize(n);
+        ny.resize(n);
+        nz.resize(n);
+        parallel_for(n, [&](size_t f) {
+            Vector3 r = { 0, 0, 0 };
+            for (size_t k = 0; k < fs; ++k) {
+                auto a = mesh.corner_position(f * fs + k);
+                auto b = mesh.corner_position(f * fs + (k + 1) % fs);
+                r.x += (a.y - b.y) * (a.z + b.z);
+                r.y += (a.z - b.z) * (a.x + b.x);
+                r.z += (a.x - b.x) * (a.y + b.y);
+            }
+            r = normalize(r);
+            nx[f] = r.x;
+            ny[f] = r.y;
+            nz[f] = r.z;
+        }, 4096);
+    }
+
+    /// Finds the feature edges of every sub-geometry: boundary edges, non-manifold edges, and edges between two faces whose normals differ by more than the crease angle.
+    /// Vertices at the same position are welded first, so edges along seams where vertices are split for normals or texture coordinates are not reported as boundaries.
+    /// The edges of all faces are keyed by their welded end vertices and sorted with the parallel radix sort, so the faces that share an edge are adjacent.
+    /// The dihedral test is then done on all shared edges at once over the face normals.
+    inline FeatureEdges compute_feature_edges(const MeshView& mesh, float crease_angle_degrees = 30)
+    {
+        mesh.validate();
+        FeatureEdges r;
+        r.subgeo_offsets.assign(mesh.num_subgeos, 0);
+        const auto fs = (size_t)mesh.face_size;
+        if (fs < 2 || mesh.num_subgeos == 0)
+            return r;
+
+        vector<int32_t> weld(mesh.num_vertices);
+        for (size_t v = 0; v < weld.size(); ++v)
+            weld[v] = (int32_t)v;
+        parallel_for(mesh.num_subgeos, [&](size_t s) {
+            auto w = mesh.weld_vertices(s);
+            copy(w.begin(), w.end(), weld.begin() + mesh.vertex_begin(s));
+        }, 1);
+
+        // One entry per polygon side, keyed by its welded end vertices; the value is the corner the side starts at
+        const auto sides = fs == 2 ? mesh.num_faces() : mesh.num_corners();
+        const auto sides_per_face = fs == 2 ? 1 : fs;
+        vector<uint64_t> keys(sides);
+        vector<uint32_t> corners(sides);
+        parallel_for(sides, [&](size_t i) {
+            auto f = i / sides_per_face, k = i % sides_per_face;
+            auto a = weld[mesh.index(f * fs + k)];
+            auto b = weld[mesh.index(f * fs + (k + 1) % fs)];
+            if (a > b) swap(a, b);
+            keys[i] = (uint64_t)(uint32_t)a << 32 | (uint32_t)b;
+            corners[i] = (uint32_t)(f * fs + k);
+        }, 4096);
+        radix_sort(keys, corners);
+
+        // Runs of equal keys are the faces around an edge
+        vector<uint32_t> runs;
+        for (size_t i = 0; i < keys.size(); ++i)
+            if ((i == 0 || keys[i] != keys[i - 1]) && (keys[i] >> 32) != (keys[i] & 0xFFFFFFFF))
+                runs.push_back((uint32_t)i);
+        vector<uint32_t> run_ends(runs.size());
+        for (size_t j = 0; j < runs.size(); ++j) {
+            auto e = runs[j] + 1;
+            while (e < keys.size() && keys[e] == keys[runs[j]]) ++e;
+            run_ends[j] = (uint32_t)e;
+        }
+
+        vector<float> nx, ny, nz;
+        compute_face_normals(mesh, nx, ny, nz);
+        const auto cos_crease = (float)cos(crease_angle_degrees * 3.14159265358979323846 / 180.0);
+
+        // Gather the face pairs of the shared edges into flat arrays, so that the dihedral test vectorizes
+        vector<uint32_t> fa(runs.size()), fb(runs.size());
+        vector<uint8_t> feature(runs.size());
+        parallel_for(runs.size(), [&](size_t j) {
+            auto n = run_ends[j] - runs[j];
+            fa[j] = corners[runs[j]] / (uint32_t)fs;
+            fb[j] = n == 2 ? corners[runs[j] + 1] / (uint32_t)fs : fa[j];
+            feature[j] = n != 2;
+        }, 4096);
+        parallel_for_chunks(runs.size(), 4096, [&](size_t begin, size_t end) {
+            for (auto j = begin; j < end; ++j) {
+                auto d = nx[fa[j]] * nx[fb[j]] + ny[fa[j]] * ny[fb[j]] + nz[fa[j]] * nz[fb[j]];
+                feature[j] |= d < cos_crease;
+            }
+        });
+
+        // Emit the edges with the original vertex indices of the first face, grouped by sub-geometry.
+        // Vertex ranges of sub-geometries are ascending, so the sorted edges are already grouped.
+        size_t s = 0;
+        for (size_t j = 0; j < runs.size(); ++j) {
+            if (!feature[j]) continue;
+            auto c = corners[runs[j]];
+            auto a = mesh.index(c);
+            while (s + 1 < mesh.num_subgeos && (size_t)a >= mesh.vertex_begin(s + 1))
+                r.subgeo_offsets[++s] = (int32_t)r.num_edges();
+            r.indices.push_back(a);
+            r.indices.push_back(mesh.index(c / fs * fs + (c % fs + 1) % fs));
+        }
+        while (s + 1 < mesh.num_subgeos)
+            r.subgeo_offsets[++s] = (int32_t)r.num_edges();
+        return r;
+    }
+
+    /// Computes the feature edges and stores them in the G3d (see edge_descriptors), replacing any that are there, so that they are written out with it
+    inline FeatureEdges add_feature_edges(G3d& g, float crease_angle_degrees = 30)
+    {
+        auto r = compute_feature_edges(MeshView(g), crease_angle_degrees);
+        auto indices = g.add_owned_attribute<int32_t>(edge_descriptors::FeatureEdges, r.indices.size());
+        copy(r.indices.begin(), r.indices.end(), indices);
+        auto offsets = g.add_owned_attribute<int32_t>(edge_descriptors::SubGeoFeatureEdgeOffset, r.subgeo_offsets.size());
+        copy(r.subgeo_offsets.begin(), r.subgeo_offsets.end(), offsets);
+        return r;
+    }
+}
+
+namespace Vim
+{
+    /// Computes the feature edges of the scene geometry and stores them in it (see g3d::add_feature_edges)
+    inline g3d::FeatureEdges AddFeatureEdges(Scene& scene, float creaseAngleDegrees = 30)
+    {
+        return g3d::add_feature_edges(scene.mGeometry, creaseAngleDegrees);
+    }
+}
+
+#endif
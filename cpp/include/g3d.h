@@ -11,6 +11,7 @@
 #include <vector>
 #include <sstream>
 #include <map>
+#include <memory>
 
 #include "bfast.h"
 
@@ -44,6 +45,8 @@ namespace g3d
         assoc_group,
         assoc_all,
         assoc_none,
+        assoc_subgeo,
+        assoc_instance,
     };
 
     // Contains all the information necessary to parse an attribute data channel and associate it with some part of the geometry 
@@ -124,6 +127,8 @@ namespace g3d
                 { assoc_group,      "group" },
                 { assoc_all,        "all" },
                 { assoc_none,       "none" },
+                { assoc_subgeo,     "subgeo" },
+                { assoc_instance,   "instance" },
             };
             return names;
         }
@@ -206,6 +211,14 @@ namespace g3d
         size_t num_elements() const {
             return byte_size() / data_element_size();
         }
+        template<typename T>
+        T* data() const {
+            return (T*)_begin;
+        }
+        template<typename T>
+        size_t count() const {
+            return byte_size() / sizeof(T);
+        }
         bfast::Buffer to_buffer() {
             return bfast::Buffer{ descriptor.to_string(), bfast::ByteRange { _begin, _end } };
         }
@@ -224,6 +237,9 @@ namespace g3d
         bfast::Bfast bfast;
         std::vector<Attribute> attributes;
 
+        // Buffers for attributes created by add_owned_attribute. They are shared, so copies of a G3d refer to the same data.
+        std::vector<std::shared_ptr<std::vector<uint8_t>>> owned_buffers;
+
         G3d()
             : meta(default_meta())
         { }
@@ -231,7 +247,9 @@ namespace g3d
         G3d(bfast::Bfast& inputBfast)
         {
             attributes.clear();
-            bfast = inputBfast;
+            // The attributes refer to the data of the input, so only its buffer table is kept, not a copy of its data
+            bfast.data = inputBfast.data;
+            bfast.buffers = inputBfast.buffers;
             for (auto i = 0; i < bfast.buffers.size(); ++i)
             {
                 auto b = bfast.buffers[i];
@@ -282,6 +300,34 @@ namespace g3d
         void add_attribute(const string& name, void* begin, size_t size) {
             add_attribute(name, begin, (uint8_t*)begin + size);
         }
+
+        /// Returns the first attribute with the given descriptor string, or nullptr if there is none 
+        Attribute* find_attribute(const string& desc) {
+            for (auto& attr : attributes)
+                if (attr.descriptor.to_string() == desc)
+                    return &attr;
+            return nullptr;
+        }
+
+        const Attribute* find_attribute(const string& desc) const {
+            return const_cast<G3d*>(this)->find_attribute(desc);
+        }
+
+        /// Removes all attributes with the given descriptor string 
+        void remove_attribute(const string& desc) {
+            attributes.erase(remove_if(attributes.begin(), attributes.end(),
+                [&](const Attribute& attr) { return attr.descriptor.to_string() == desc; }), attributes.end());
+        }
+
+        /// Adds (or replaces) an attribute of count elements of type T whose zero-initialized data is owned by the G3d, and returns its data 
+        template<typename T>
+        T* add_owned_attribute(const string& desc, size_t count) {
+            remove_attribute(desc);
+            auto buffer = make_shared<vector<uint8_t>>(max<size_t>(1, count * sizeof(T)));
+            owned_buffers.push_back(buffer);
+            attributes.push_back(Attribute(desc, buffer->data(), buffer->data() + count * sizeof(T)));
+            return (T*)buffer->data();
+        }
     };
 
     struct descriptors
@@ -302,8 +348,9 @@ namespace g3d
 
         static constexpr const char* FaceMaterialId = "g3d:face:materialid:0:int32:1";
         static constexpr const char* FaceObjectId = "g3d:face:objectid:0:int32:1";
-        static constexpr const char* FaceGroupId = "g3d:face:groupid:0:int32:1";
-        static constexpr const char* FaceNormal = "g3d:vertex:normal:0:float32:3";
+        static constexpr const char* FaceGroupId = "g3d:face:group:0:int32:1";
+        static constexpr const char* FaceNormal = "g3d:face:normal:0:float32:3";
+        static constexpr const char* FaceColor = "g3d:face:color:0:float32:4";
         static constexpr const char* FaceSize = "g3d:face:facesize:0:int32:1";
         static constexpr const char* FaceIndexOffset = "g3d:face:indexoffset:0:int32:1";
         static constexpr const char* FaceSelectionWeight = "g3d:face:weight:0:float32:1";
@@ -312,8 +359,9 @@ namespace g3d
         static constexpr const char* GroupObjectId = "g3d:group:objectid:0:int32:1";
         static constexpr const char* GroupIndexOffset = "g3d:group:indexoffset:0:int32:1";
         static constexpr const char* GroupVertexOffset = "g3d:group:vertexoffset:0:int32:1";
-        static constexpr const char* GroupNormal = "g3d:vertex:normal:0:float32:3";
+        static constexpr const char* GroupNormal = "g3d:group:normal:0:float32:3";
         static constexpr const char* GroupFaceSize = "g3d:group:facesize:0:int32:1";
+        static constexpr const char* GroupColor = "g3d:group:color:0:float32:4";
 
         // https://docs.thinkboxsoftware.com/products/krakatoa/2.6/1_Documentation/manual/formats/particle_channels.html
         static constexpr const char* PointVelocity = "g3d:vertex:velocity:0:float32:3";
@@ -327,6 +375,17 @@ namespace g3d
         static constexpr const char* PointParticleId = "g3d:vertex:particleid:0:int32:1";
         static constexpr const char* PointAge = "g3d:vertex:age:0:int32:1";
 
+        static constexpr const char* SubGeoVertexOffset = "g3d:subgeo:vertexoffset:0:int32:1";
+        static constexpr const char* SubGeoIndexOffset = "g3d:subgeo:indexoffset:0:int32:1";
+        static constexpr const char* SubGeoIndexCount = "g3d:subgeo:indexcount:0:int32:1";
+        static constexpr const char* SubGeoVertexCount = "g3d:subgeo:vertexcount:0:int32:1";
+        static constexpr const char* SubGeoBounds = "g3d:subgeo:bounds:0:float32:6";
+
+        static constexpr const char* Bounds = "g3d:all:bounds:0:float32:6";
+
+        static constexpr const char* InstanceTransforms = "g3d:instance:transform:0:float32:16";
+        static constexpr const char* InstanceSubGeometries = "g3d:instance:subgeometry:0:int32:1";
+
         // Line specific attributes 
         static constexpr const char* LineTangentIn = "g3d:vertex:tangent:0:float32:3";
         static constexpr const char* LineTangentOut = "g3d:vertex:tangent:1:float32:3";
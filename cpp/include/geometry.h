@@ -0,0 +1,377 @@
+/*
+    Geometry Helpers for G3D
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __G3D_GEOMETRY_H__
+#define __G3D_GEOMETRY_H__
+
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#include "g3d.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    struct Vector3
+    {
+        float x, y, z;
+
+        Vector3 operator+(const Vector3& v) const { return { x + v.x, y + v.y, z + v.z }; }
+        Vector3 operator-(const Vector3& v) const { return { x - v.x, y - v.y, z - v.z }; }
+        Vector3 operator*(float s) const { return { x * s, y * s, z * s }; }
+        Vector3 operator-() const { return { -x, -y, -z }; }
+        float operator[](int i) const { return (&x)[i]; }
+        float& operator[](int i) { return (&x)[i]; }
+    };
+
+    inline float dot(const Vector3& a, const Vector3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    inline Vector3 cross(const Vector3& a, const Vector3& b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+    inline float length(const Vector3& v) { return sqrt(dot(v, v)); }
+    inline Vector3 normalize(const Vector3& v) { auto l = length(v); return l > 0 ? v * (1.0f / l) : v; }
+    inline Vector3 component_min(const Vector3& a, const Vector3& b) { return { std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) }; }
+    inline Vector3 component_max(const Vector3& a, const Vector3& b) { return { std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) }; }
+
+    /// An axis-aligned bounding box. An empty box has min greater than max.
+    struct AABox
+    {
+        Vector3 min = { FLT_MAX, FLT_MAX, FLT_MAX };
+        Vector3 max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+        bool is_empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+        Vector3 center() const { return (min + max) * 0.5f; }
+        Vector3 extent() const { return max - min; }
+        void merge(const Vector3& p) { min = component_min(min, p); max = component_max(max, p); }
+        void merge(const AABox& b) { min = component_min(min, b.min); max = component_max(max, b.max); }
+        AABox inflate(float d) const { return { min - Vector3{ d, d, d }, max + Vector3{ d, d, d } }; }
+
+        bool intersects(const AABox& b) const {
+            return min.x <= b.max.x && b.min.x <= max.x
+                && min.y <= b.max.y && b.min.y <= max.y
+                && min.z <= b.max.z && b.min.z <= max.z;
+        }
+
+        bool contains(const AABox& b) const {
+            return min.x <= b.min.x && b.max.x <= max.x
+                && min.y <= b.min.y && b.max.y <= max.y
+                && min.z <= b.min.z && b.max.z <= max.z;
+        }
+
+        float distance_squared(const Vector3& p) const {
+            auto dx = std::max(0.0f, std::max(min.x - p.x, p.x - max.x));
+            auto dy = std::max(0.0f, std::max(min.y - p.y, p.y - max.y));
+            auto dz = std::max(0.0f, std::max(min.z - p.z, p.z - max.z));
+            return dx * dx + dy * dy + dz * dz;
+        }
+    };
+
+    // Matrices are 16 floats in row-major order using row vectors, so the translation is in elements 12, 13 and 14.
+    // This is the layout of SceneNode::mTransform and of the instance transform attribute.
+
+    inline Vector3 transform_point(const float* m, const Vector3& p) {
+        return {
+            p.x * m[0] + p.y * m[4] + p.z * m[8] + m[12],
+            p.x * m[1] + p.y * m[5] + p.z * m[9] + m[13],
+            p.x * m[2] + p.y * m[6] + p.z * m[10] + m[14] };
+    }
+
+    inline Vector3 transform_direction(const float* m, const Vector3& v) {
+        return {
+            v.x * m[0] + v.y * m[4] + v.z * m[8],
+            v.x * m[1] + v.y * m[5] + v.z * m[9],
+            v.x * m[2] + v.y * m[6] + v.z * m[10] };
+    }
+
+    /// Returns the box that bounds the transformed box (Arvo's method)
+    inline AABox transform_box(const float* m, const AABox& b) {
+        if (b.is_empty()) return b;
+        AABox r;
+        for (auto j = 0; j < 3; ++j) {
+            r.min[j] = r.max[j] = m[12 + j];
+            for (auto i = 0; i < 3; ++i) {
+                auto e = m[i * 4 + j] * b.min[i];
+                auto f = m[i * 4 + j] * b.max[i];
+                r.min[j] += std::min(e, f);
+                r.max[j] += std::max(e, f);
+            }
+        }
+        return r;
+    }
+
+    /// The determinant of the upper 3x3 part of the matrix. This is the volume scale factor of the transform.
+    inline float determinant3x3(const float* m) {
+        return m[0] * (m[5] * m[10] - m[6] * m[9])
+            - m[1] * (m[4] * m[10] - m[6] * m[8])
+            + m[2] * (m[4] * m[9] - m[5] * m[8]);
+    }
+
+    /// Computes r = a * b. Applying r is the same as applying a, then b.
+    inline void multiply(const float* a, const float* b, float* r) {
+        for (auto i = 0; i < 4; ++i)
+            for (auto j = 0; j < 4; ++j)
+                r[i * 4 + j] = a[i * 4] * b[j] + a[i * 4 + 1] * b[4 + j] + a[i * 4 + 2] * b[8 + j] + a[i * 4 + 3] * b[12 + j];
+    }
+
+    /// Inverts an affine transform (the last column is 0, 0, 0, 1). Returns false if the transform is singular.
+    inline bool invert_affine(const float* m, float* r) {
+        auto det = determinant3x3(m);
+        if (det == 0) return false;
+        auto s = 1.0f / det;
+        r[0] = (m[5] * m[10] - m[6] * m[9]) * s;
+        r[1] = (m[2] * m[9] - m[1] * m[10]) * s;
+        r[2] = (m[1] * m[6] - m[2] * m[5]) * s;
+        r[4] = (m[6] * m[8] - m[4] * m[10]) * s;
+        r[5] = (m[0] * m[10] - m[2] * m[8]) * s;
+        r[6] = (m[2] * m[4] - m[0] * m[6]) * s;
+        r[8] = (m[4] * m[9] - m[5] * m[8]) * s;
+        r[9] = (m[1] * m[8] - m[0] * m[9]) * s;
+        r[10] = (m[0] * m[5] - m[1] * m[4]) * s;
+        r[3] = r[7] = r[11] = 0;
+        r[15] = 1;
+        for (auto j = 0; j < 3; ++j)
+            r[12 + j] = -(m[12] * r[j] + m[13] * r[4 + j] + m[14] * r[8 + j]);
+        return true;
+    }
+
+    inline const float* identity_matrix() {
+        static const float m[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+        return m;
+    }
+
+    /// Spreads the lower 21 bits of v so that there are two zero bits between each
+    inline uint64_t spread_bits_by_3(uint64_t v) {
+        v &= 0x1FFFFF;
+        v = (v | v << 32) & 0x1F00000000FFFFull;
+        v = (v | v << 16) & 0x1F0000FF0000FFull;
+        v = (v | v << 8) & 0x100F00F00F00F00Full;
+        v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    /// Returns the 63-bit Morton code (Z-order) of a point, quantized to 21 bits per axis within the given bounds
+    inline uint64_t morton_code(const Vector3& p, const AABox& bounds) {
+        const auto e = bounds.extent();
+        uint64_t code = 0;
+        for (auto i = 0; i < 3; ++i) {
+            auto t = e[i] > 0 ? (p[i] - bounds.min[i]) / e[i] : 0.0f;
+            auto q = (uint64_t)std::min(std::max(t, 0.0f) * 2097151.0f, 2097151.0f);
+            code |= spread_bits_by_3(q) << (2 - i);
+        }
+        return code;
+    }
+
+    /// Returns the 63-bit index of a point along a 3D Hilbert curve, quantized to 21 bits per axis within the given bounds.
+    /// Unlike the Morton order, consecutive codes are always adjacent cells, so runs of codes make more compact boxes.
+    inline uint64_t hilbert_code(const Vector3& p, const AABox& bounds) {
+        const auto e = bounds.extent();
+        uint32_t x[3];
+        for (auto i = 0; i < 3; ++i) {
+            auto t = e[i] > 0 ? (p[i] - bounds.min[i]) / e[i] : 0.0f;
+            x[i] = (uint32_t)std::min(std::max(t, 0.0f) * 2097151.0f, 2097151.0f);
+        }
+        // Skilling's transform of the axes to the transposed Hilbert index
+        for (uint32_t q = 1u << 20; q > 1; q >>= 1) {
+            auto low = q - 1;
+            for (auto i = 0; i < 3; ++i) {
+                if (x[i] & q)
+                    x[0] ^= low;
+                else {
+                    auto t = (x[0] ^ x[i]) & low;
+                    x[0] ^= t;
+                    x[i] ^= t;
+                }
+            }
+        }
+        x[1] ^= x[0];
+        x[2] ^= x[1];
+        uint32_t t = 0;
+        for (uint32_t q = 1u << 20; q > 1; q >>= 1)
+            if (x[2] & q)
+                t ^= q - 1;
+        uint64_t code = 0;
+        for (auto i = 0; i < 3; ++i)
+            code |= spread_bits_by_3(x[i] ^ t) << (2 - i);
+        return code;
+    }
+
+    /// A read/write view of the common mesh attributes of a G3d: positions, indices, face size and sub-geometries.
+    /// A G3d without sub-geometry offsets is viewed as a single sub-geometry, and one without indices as a point list.
+    struct MeshView
+    {
+        Vector3* vertices = nullptr;
+        size_t num_vertices = 0;
+        int32_t* indices = nullptr;
+        size_t num_indices = 0;
+        int face_size = 3;
+        int32_t* subgeo_vertex_offsets = nullptr;
+        int32_t* subgeo_index_offsets = nullptr;
+        size_t num_subgeos = 0;
+
+        MeshView() = default;
+
+        MeshView(const G3d& g)
+        {
+            if (auto attr = g.find_attribute(descriptors::Position)) {
+                vertices = attr->data<Vector3>();
+                num_vertices = attr->count<Vector3>();
+            }
+            if (auto attr = g.find_attribute(descriptors::Index)) {
+                indices = attr->data<int32_t>();
+                num_indices = attr->count<int32_t>();
+            }
+            if (auto attr = g.find_attribute(descriptors::ObjectFaceSize))
+                if (attr->count<int32_t>() > 0)
+                    face_size = attr->data<int32_t>()[0];
+            if (face_size <= 0)
+                throw runtime_error("Invalid face size");
+            auto vo = g.find_attribute(descriptors::SubGeoVertexOffset);
+            auto io = g.find_attribute(descriptors::SubGeoIndexOffset);
+            if (vo && io) {
+                if (vo->count<int32_t>() != io->count<int32_t>())
+                    throw runtime_error("The number of sub-geometry vertex offsets does not match the number of index offsets");
+                subgeo_vertex_offsets = vo->data<int32_t>();
+                subgeo_index_offsets = io->data<int32_t>();
+                num_subgeos = vo->count<int32_t>();
+            }
+            else {
+                num_subgeos = num_vertices > 0 ? 1 : 0;
+            }
+        }
+
+        size_t num_faces() const { return num_corners() / face_size; }
+        int32_t index(size_t corner) const { return indices ? indices[corner] : (int32_t)corner; }
+        size_t num_corners() const { return indices ? num_indices : num_vertices; }
+
+        size_t vertex_begin(size_t subgeo) const { return subgeo_vertex_offsets ? subgeo_vertex_offsets[subgeo] : 0; }
+        size_t vertex_end(size_t subgeo) const { return subgeo_vertex_offsets && subgeo + 1 < num_subgeos ? subgeo_vertex_offsets[subgeo + 1] : num_vertices; }
+        size_t index_begin(size_t subgeo) const { return subgeo_index_offsets ? subgeo_index_offsets[subgeo] : 0; }
+        size_t index_end(size_t subgeo) const { return subgeo_index_offsets && subgeo + 1 < num_subgeos ? subgeo_index_offsets[subgeo + 1] : num_corners(); }
+        size_t face_begin(size_t subgeo) const { return index_begin(subgeo) / face_size; }
+        size_t face_end(size_t subgeo) const { return index_end(subgeo) / face_size; }
+
+        Vector3 corner_position(size_t corner) const { return vertices[index(corner)]; }
+
+        /// Polygons are split into triangle fans, so each face has face_size - 2 triangles
+        size_t triangles_per_face() const { return face_size >= 3 ? face_size - 2 : 0; }
+        size_t num_triangles(size_t subgeo) const { return (face_end(subgeo) - face_begin(subgeo)) * triangles_per_face(); }
+
+        /// Gets the three corners of triangle t of a sub-geometry
+        void triangle_corners(size_t subgeo, size_t t, size_t* corners) const {
+            auto f = face_begin(subgeo) + t / triangles_per_face();
+            auto k = t % triangles_per_face();
+            corners[0] = f * face_size;
+            corners[1] = corners[0] + k + 1;
+            corners[2] = corners[0] + k + 2;
+        }
+
+        AABox subgeo_bounds(size_t subgeo) const {
+            AABox r;
+            for (auto i = vertex_begin(subgeo); i < vertex_end(subgeo); ++i)
+                r.merge(vertices[i]);
+            return r;
+        }
+
+        /// Returns, for each vertex of a sub-geometry, the index of the first vertex of the sub-geometry with exactly the same position.
+        /// Use it to follow connectivity across vertices that are split for normals or texture coordinates.
+        vector<int32_t> weld_vertices(size_t subgeo) const {
+            auto vb = vertex_begin(subgeo), ve = vertex_end(subgeo);
+            vector<int32_t> order(ve - vb), r(ve - vb);
+            for (size_t i = 0; i < order.size(); ++i)
+                order[i] = (int32_t)(vb + i);
+            auto less = [&](int32_t a, int32_t b) {
+                const auto& p = vertices[a];
+                const auto& q = vertices[b];
+                return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z != q.z ? p.z < q.z : a < b;
+            };
+            sort(order.begin(), order.end(), less);
+            for (size_t i = 0; i < order.size(); ++i) {
+                auto same = i > 0
+                    && vertices[order[i - 1]].x == vertices[order[i]].x
+                    && vertices[order[i - 1]].y == vertices[order[i]].y
+                    && vertices[order[i - 1]].z == vertices[order[i]].z;
+                r[order[i] - vb] = same ? r[order[i - 1] - vb] : order[i];
+            }
+            return r;
+        }
+
+        /// Validates that offsets are ascending and in range, and that every index refers to a vertex of its own sub-geometry
+        void validate() const {
+            if (num_corners() % face_size != 0)
+                throw runtime_error("The number of indices is not a multiple of the face size");
+            for (size_t s = 0; s < num_subgeos; ++s) {
+                if (vertex_begin(s) > vertex_end(s) || vertex_end(s) > num_vertices)
+                    throw runtime_error("Sub-geometry vertex offsets are out of range or not ascending");
+                if (index_begin(s) > index_end(s) || index_end(s) > num_corners())
+                    throw runtime_error("Sub-geometry index offsets are out of range or not ascending");
+                for (auto i = index_begin(s); i < index_end(s); ++i)
+                    if (index(i) < (int32_t)vertex_begin(s) || index(i) >= (int32_t)vertex_end(s))
+                        throw runtime_error("Index refers to a vertex outside of its sub-geometry");
+            }
+        }
+    };
+
+    /// A view of instances: a transform and a sub-geometry index per instance.
+    /// The data is strided so that it can refer to the instance attributes of a G3d, or directly to an array of VIM scene nodes.
+    struct InstanceView
+    {
+        const uint8_t* transforms = nullptr;
+        const uint8_t* subgeos = nullptr;
+        size_t transform_stride = 0;
+        size_t subgeo_stride = 0;
+        size_t count = 0;
+
+        const float* transform(size_t i) const { return transforms ? (const float*)(transforms + i * transform_stride) : identity_matrix(); }
+        int32_t subgeo(size_t i) const { return subgeos ? *(const int32_t*)(subgeos + i * subgeo_stride) : (int32_t)i; }
+
+        /// Views each sub-geometry as an untransformed instance of itself
+        static InstanceView from_subgeos(size_t num_subgeos) {
+            InstanceView r;
+            r.count = num_subgeos;
+            return r;
+        }
+
+        /// Views the instances of a G3d if it has any, otherwise each of its sub-geometries as an untransformed instance
+        static InstanceView from_g3d_or_subgeos(const G3d& g) {
+            auto r = from_g3d(g);
+            return r.count > 0 ? r : from_subgeos(MeshView(g).num_subgeos);
+        }
+
+        /// Views the instance attributes of a G3d, or returns an empty view if there are none
+        static InstanceView from_g3d(const G3d& g) {
+            InstanceView r;
+            auto geos = g.find_attribute(descriptors::InstanceSubGeometries);
+            if (!geos) return r;
+            r.subgeos = geos->_begin;
+            r.subgeo_stride = sizeof(int32_t);
+            r.count = geos->count<int32_t>();
+            if (auto xforms = g.find_attribute(descriptors::InstanceTransforms)) {
+                if (xforms->count<float>() != r.count * 16)
+                    throw runtime_error("The number of instance transforms does not match the number of instance sub-geometries");
+                r.transforms = xforms->_begin;
+                r.transform_stride = 16 * sizeof(float);
+            }
+            return r;
+        }
+
+        /// Views an array of nodes that have an "mTransform" float[16] and an "mGeometry" sub-geometry index, such as Vim::SceneNode
+        template<typename Node>
+        static InstanceView from_nodes(const Node* nodes, size_t count) {
+            InstanceView r;
+            if (count == 0) return r;
+            r.transforms = (const uint8_t*)nodes->mTransform;
+            r.subgeos = (const uint8_t*)&nodes->mGeometry;
+            r.transform_stride = r.subgeo_stride = sizeof(Node);
+            r.count = count;
+            return r;
+        }
+    };
+}
+
+#endif
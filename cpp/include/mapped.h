@@ -0,0 +1,153 @@
+/*
+    Read-Only Memory Mapped Files
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __MAPPED_H__
+#define __MAPPED_H__
+
+#include <string>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "bfast.h"
+
+namespace bfast
+{
+    using namespace std;
+
+    /// A file mapped read-only into memory. Pages are only read from disk when they are touched, and the OS can drop them again under memory pressure.
+    /// The mapping stays at the same address when the object is moved, so ranges into it remain valid until it is closed or destroyed.
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+
+        explicit MappedFile(const string& path) { open(path); }
+
+        ~MappedFile() { close(); }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        MappedFile(MappedFile&& other) noexcept { swap(other); }
+        MappedFile& operator=(MappedFile&& other) noexcept {
+            if (this != &other) {
+                close();
+                swap(other);
+            }
+            return *this;
+        }
+
+        void open(const string& path)
+        {
+            close();
+#if defined(_WIN32)
+            file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                throw runtime_error("Couldn't open file " + path);
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file, &size)) {
+                close();
+                throw runtime_error("Couldn't get the size of file " + path);
+            }
+            _size = (size_t)size.QuadPart;
+            if (_size == 0)
+                return;
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping) {
+                close();
+                throw runtime_error("Couldn't map file " + path);
+            }
+            _data = (const byte*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (!_data) {
+                close();
+                throw runtime_error("Couldn't map file " + path);
+            }
+#else
+            file = ::open(path.c_str(), O_RDONLY);
+            if (file < 0)
+                throw runtime_error("Couldn't open file " + path);
+            struct stat st;
+            if (fstat(file, &st) != 0) {
+                close();
+                throw runtime_error("Couldn't get the size of file " + path);
+            }
+            _size = (size_t)st.st_size;
+            if (_size == 0)
+                return;
+            auto p = mmap(nullptr, _size, PROT_READ, MAP_SHARED, file, 0);
+            if (p == MAP_FAILED) {
+                close();
+                throw runtime_error("Couldn't map file " + path);
+            }
+            _data = (const byte*)p;
+#endif
+        }
+
+        void close()
+        {
+#if defined(_WIN32)
+            if (_data) UnmapViewOfFile(_data);
+            if (mapping) CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if (_data) munmap((void*)_data, _size);
+            if (file >= 0) ::close(file);
+            file = -1;
+#endif
+            _data = nullptr;
+            _size = 0;
+        }
+
+        bool is_open() const {
+#if defined(_WIN32)
+            return file != INVALID_HANDLE_VALUE;
+#else
+            return file >= 0;
+#endif
+        }
+
+        const byte* data() const { return _data; }
+        size_t size() const { return _size; }
+        ByteRange range() const { return ByteRange{ _data, _data + _size }; }
+
+    private:
+        const byte* _data = nullptr;
+        size_t _size = 0;
+#if defined(_WIN32)
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        int file = -1;
+#endif
+
+        void swap(MappedFile& other) noexcept {
+            std::swap(_data, other._data);
+            std::swap(_size, other._size);
+            std::swap(file, other.file);
+#if defined(_WIN32)
+            std::swap(mapping, other.mapping);
+#endif
+        }
+    };
+}
+
+#endif
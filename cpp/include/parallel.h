@@ -0,0 +1,287 @@
+/*
+    Parallel Helpers for G3D and VIM processing
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <cstdint>
+
+// Threads are not available when compiling managed code (/clr), so everything runs on the calling thread there
+#if !defined(_M_CEE)
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#endif
+
+namespace g3d
+{
+    using namespace std;
+
+    /// The number of threads requested with set_thread_count, or zero for one per hardware thread
+    inline size_t& requested_thread_count() {
+        static size_t n = 0;
+        return n;
+    }
+
+    /// Sets the number of threads used by the parallel helpers. Zero uses one per hardware thread. Not thread-safe: call it during initialization.
+    inline void set_thread_count(size_t n) {
+        requested_thread_count() = n;
+    }
+
+    /// The number of threads used by the parallel helpers
+    inline size_t thread_count() {
+#if defined(_M_CEE)
+        return 1;
+#else
+        static const size_t hardware = max<size_t>(1, thread::hardware_concurrency());
+        return requested_thread_count() > 0 ? requested_thread_count() : hardware;
+#endif
+    }
+
+#if !defined(_M_CEE)
+    /// True on the threads that are running the chunks of a parallel loop
+    inline bool& in_parallel_worker() {
+        static thread_local bool r = false;
+        return r;
+    }
+
+    /// The threads that help the calling thread run a parallel loop. They are started as they are first needed,
+    /// and wait for the next loop in between, so that loops don't pay for starting threads.
+    class thread_pool
+    {
+    public:
+        static thread_pool& instance() {
+            static thread_pool pool;
+            return pool;
+        }
+
+        ~thread_pool() {
+            {
+                lock_guard<mutex> lock(m);
+                stopping = true;
+            }
+            work.notify_all();
+            for (auto& t : threads)
+                t.join();
+        }
+
+        /// Calls f on the calling thread and on up to the given number of pool threads, and returns when all the calls are done.
+        /// Threads that become free only after the calling thread is done are not used.
+        void run(size_t helpers, const function<void()>& f) {
+            job j = { &f, helpers, 0 };
+            {
+                lock_guard<mutex> lock(m);
+                while (threads.size() < helpers)
+                    threads.emplace_back([this]() { work_loop(); });
+                jobs.push_back(&j);
+            }
+            work.notify_all();
+            in_parallel_worker() = true;
+            f();
+            in_parallel_worker() = false;
+            unique_lock<mutex> lock(m);
+            auto it = find(jobs.begin(), jobs.end(), &j);
+            if (it != jobs.end())
+                jobs.erase(it);
+            done.wait(lock, [&]() { return j.active == 0; });
+        }
+
+    private:
+        struct job {
+            const function<void()>* f;
+            // The pool threads still wanted, and the ones running f
+            size_t helpers;
+            size_t active;
+        };
+
+        thread_pool() = default;
+
+        void work_loop() {
+            in_parallel_worker() = true;
+            unique_lock<mutex> lock(m);
+            for (;;) {
+                work.wait(lock, [&]() { return stopping || !jobs.empty(); });
+                if (stopping)
+                    return;
+                auto j = jobs.front();
+                if (--j->helpers == 0)
+                    jobs.pop_front();
+                j->active++;
+                lock.unlock();
+                (*j->f)();
+                lock.lock();
+                if (--j->active == 0)
+                    done.notify_all();
+            }
+        }
+
+        mutex m;
+        condition_variable work;
+        condition_variable done;
+        deque<job*> jobs;
+        vector<thread> threads;
+        bool stopping = false;
+    };
+#endif
+
+    /// Calls f(begin, end) over chunks of [0, n) of at most grain elements.
+    /// Chunks are claimed from a shared counter, so threads that finish early take over the remaining work.
+    /// The calling thread participates with the threads of the pool, and the first exception thrown by any chunk is rethrown here.
+    /// A loop called from inside a chunk runs serially on its thread, since the other threads are busy with the outer loop.
+    template<typename F>
+    void parallel_for_chunks(size_t n, size_t grain, F f)
+    {
+        if (n == 0) return;
+        grain = max<size_t>(1, grain);
+        auto num_chunks = (n + grain - 1) / grain;
+        auto num_threads = min(thread_count(), num_chunks);
+#if !defined(_M_CEE)
+        if (in_parallel_worker())
+            num_threads = 1;
+#endif
+        if (num_threads <= 1) {
+            for (size_t begin = 0; begin < n; begin += grain)
+                f(begin, min(n, begin + grain));
+            return;
+        }
+#if !defined(_M_CEE)
+        atomic<size_t> next(0);
+        exception_ptr error;
+        mutex error_mutex;
+        auto worker = [&]() {
+            try {
+                for (size_t chunk = next++; chunk < num_chunks; chunk = next++) {
+                    auto begin = chunk * grain;
+                    f(begin, min(n, begin + grain));
+                }
+            }
+            catch (...) {
+                lock_guard<mutex> lock(error_mutex);
+                if (!error) error = current_exception();
+                next = num_chunks;
+            }
+        };
+        thread_pool::instance().run(num_threads - 1, worker);
+        if (error)
+            rethrow_exception(error);
+#endif
+    }
+
+    /// Calls f(i) for each i in [0, n) in parallel
+    template<typename F>
+    void parallel_for(size_t n, F f, size_t grain = 1024)
+    {
+        parallel_for_chunks(n, grain, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i)
+                f(i);
+        });
+    }
+
+    /// Splits [0, n) into at most the given number of contiguous parts and calls f(part, begin, end) for each in parallel.
+    /// Use this when results are accumulated per part and merged afterwards. Returns the number of parts used.
+    template<typename F>
+    size_t parallel_partition(size_t n, size_t parts, F f)
+    {
+        parts = max<size_t>(1, min(parts, n));
+        auto size = (n + parts - 1) / max<size_t>(1, parts);
+        parts = n == 0 ? 1 : (n + size - 1) / size;
+        parallel_for(parts, [&](size_t part) {
+            f(part, part * size, min(n, (part + 1) * size));
+        }, 1);
+        return parts;
+    }
+
+    /// Runs independent tasks concurrently and waits for all of them
+    template<typename... Fs>
+    void parallel_invoke(Fs... fs)
+    {
+        vector<function<void()>> tasks = { fs... };
+        parallel_for(tasks.size(), [&](size_t i) { tasks[i](); }, 1);
+    }
+
+    /// Sorts the values by their 64-bit keys with a stable least-significant-digit radix sort.
+    /// Histograms and scatters are computed in parallel over contiguous parts of the input, and passes over digits that are the same for every key are skipped.
+    template<typename V>
+    void radix_sort(vector<uint64_t>& keys, vector<V>& values)
+    {
+        if (keys.size() != values.size())
+            throw runtime_error("The number of keys does not match the number of values");
+        const auto n = keys.size();
+        if (n < 2) return;
+
+        const size_t radix = 256;
+        const size_t parts = min(thread_count(), max<size_t>(1, n / 4096));
+        vector<uint64_t> tmp_keys(n);
+        vector<V> tmp_values(n);
+        vector<size_t> counts(parts * radix);
+
+        uint64_t all_or = 0, all_and = ~0ull;
+        for (auto k : keys) { all_or |= k; all_and &= k; }
+        const auto varying = all_or ^ all_and;
+
+        for (int shift = 0; shift < 64; shift += 8)
+        {
+            if (((varying >> shift) & 0xFF) == 0)
+                continue;
+
+            fill(counts.begin(), counts.end(), 0);
+            auto used = parallel_partition(n, parts, [&](size_t part, size_t begin, size_t end) {
+                auto* c = &counts[part * radix];
+                for (auto i = begin; i < end; ++i)
+                    c[(keys[i] >> shift) & 0xFF]++;
+            });
+
+            // Exclusive prefix sum in digit-major order keeps the sort stable across parts
+            size_t sum = 0;
+            for (size_t d = 0; d < radix; ++d)
+                for (size_t part = 0; part < used; ++part) {
+                    auto c = counts[part * radix + d];
+                    counts[part * radix + d] = sum;
+                    sum += c;
+                }
+
+            parallel_partition(n, parts, [&](size_t part, size_t begin, size_t end) {
+                auto* c = &counts[part * radix];
+                for (auto i = begin; i < end; ++i) {
+                    auto dst = c[(keys[i] >> shift) & 0xFF]++;
+                    tmp_keys[dst] = keys[i];
+                    tmp_values[dst] = values[i];
+                }
+            });
+
+            keys.swap(tmp_keys);
+            values.swap(tmp_values);
+        }
+    }
+
+    /// Computes the compressed row offsets of keys sorted ascending, all less than num_keys: the rows of key k are [r[k], r[k + 1]).
+    inline vector<uint32_t> sorted_key_offsets(const vector<uint64_t>& sorted, size_t num_keys)
+    {
+        const auto n = sorted.size();
+        if (n > 0 && sorted.back() >= num_keys)
+            throw runtime_error("A sorted key is out of range");
+        vector<uint32_t> r(num_keys + 1);
+        // Every row where the key changes fills the offsets of the keys since the previous row, so the ranges written are disjoint
+        parallel_for(n, [&](size_t i) {
+            if (i > 0 && sorted[i] == sorted[i - 1])
+                return;
+            for (auto k = i == 0 ? 0 : (size_t)sorted[i - 1] + 1; k <= (size_t)sorted[i]; ++k)
+                r[k] = (uint32_t)i;
+        }, 4096);
+        for (auto k = n == 0 ? 0 : (size_t)sorted.back() + 1; k <= num_keys; ++k)
+            r[k] = (uint32_t)n;
+        return r;
+    }
+}
+
+#endif
@@ -0,0 +1,209 @@
+/*
+    Property Indexes of VIM Entity Tables
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __PROPERTIES_H__
+#define __PROPERTIES_H__
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "parallel.h"
+#include "vim.h"
+#include "vimview.h"
+
+namespace Vim
+{
+    /// Indexes the properties of an entity table two ways: by entity, and by name then value.
+    /// Both are built with the parallel radix sort, as copies of the properties in sorted order with compressed row offsets,
+    /// so the properties of an entity, or with a name, are found in constant time, and those with a name and value in logarithmic time.
+    /// Properties with a negative entity, name or value index are left out.
+    /// The index can be saved, and viewed in place in the saved data, such as a memory mapped sidecar, instead of being rebuilt.
+    class PropertyIndex
+    {
+    public:
+        PropertyIndex() = default;
+        PropertyIndex(const PropertyIndex&) = delete;
+        PropertyIndex& operator=(const PropertyIndex&) = delete;
+        PropertyIndex(PropertyIndex&&) = default;
+        PropertyIndex& operator=(PropertyIndex&&) = default;
+
+        /// Indexes any contiguous range of properties, such as EntityTable::mProperties or EntityTableView::mProperties
+        template<typename Properties>
+        explicit PropertyIndex(const Properties& properties)
+        {
+            Build(properties.data(), properties.size());
+        }
+
+        /// The properties of an entity, sorted by name then value
+        Span<SerializableProperty> GetProperties(int entity) const
+        {
+            return Range(mByEntity, mEntityOffsets, entity);
+        }
+
+        /// The properties with a name, sorted by value then entity
+        Span<SerializableProperty> WithName(int name) const
+        {
+            return Range(mByName, mNameOffsets, name);
+        }
+
+        /// The properties with a name and value, sorted by entity
+        Span<SerializableProperty> WithNameValue(int name, int value) const
+        {
+            auto r = WithName(name);
+            auto less = [](const SerializableProperty& p, int v) { return p.mValue < v; };
+            auto begin = std::lower_bound(r.begin(), r.end(), value, less);
+            auto end = begin;
+            while (end < r.end() && end->mValue == value)
+                ++end;
+            return Span<SerializableProperty>(begin, end);
+        }
+
+        /// The entities that have a property with the name and value, in ascending order
+        std::vector<int> FindEntities(int name, int value) const
+        {
+            std::vector<int> r;
+            for (auto& p : WithNameValue(name, value))
+                if (r.empty() || r.back() != p.mEntityId)
+                    r.push_back(p.mEntityId);
+            return r;
+        }
+
+        size_t NumEntities() const { return mEntityOffsets.empty() ? 0 : mEntityOffsets.size() - 1; }
+        size_t NumNames() const { return mNameOffsets.empty() ? 0 : mNameOffsets.size() - 1; }
+
+        /// Serializes the sorted properties and their offsets
+        std::vector<uint8_t> Save() const
+        {
+            Header h = { Magic, (uint64_t)mByEntity.size(), (uint64_t)mEntityOffsets.size(), (uint64_t)mNameOffsets.size() };
+            std::vector<uint8_t> r(sizeof(h) + 2 * mByEntity.size() * sizeof(SerializableProperty) + (mEntityOffsets.size() + mNameOffsets.size()) * sizeof(uint32_t));
+            auto p = r.data();
+            p = Write(p, &h, sizeof(h));
+            p = Write(p, mByEntity.data(), mByEntity.size() * sizeof(SerializableProperty));
+            p = Write(p, mEntityOffsets.data(), mEntityOffsets.size() * sizeof(uint32_t));
+            p = Write(p, mByName.data(), mByName.size() * sizeof(SerializableProperty));
+            Write(p, mNameOffsets.data(), mNameOffsets.size() * sizeof(uint32_t));
+            return r;
+        }
+
+        /// Uses an index saved by Save in place, without copying it, so the data must outlive the index. Returns false if the data isn't a saved index.
+        bool View(const bfast::ByteRange& data)
+        {
+            Header h;
+            if (data.size() < sizeof(h))
+                return false;
+            memcpy(&h, data.begin(), sizeof(h));
+            if (h.mMagic != Magic || data.size() != sizeof(h) + 2 * h.mNumProperties * sizeof(SerializableProperty) + (h.mNumEntityOffsets + h.mNumNameOffsets) * sizeof(uint32_t))
+                return false;
+            auto p = data.begin() + sizeof(h);
+            auto byEntity = Next<SerializableProperty>(p, (size_t)h.mNumProperties);
+            auto entityOffsets = Next<uint32_t>(p, (size_t)h.mNumEntityOffsets);
+            auto byName = Next<SerializableProperty>(p, (size_t)h.mNumProperties);
+            auto nameOffsets = Next<uint32_t>(p, (size_t)h.mNumNameOffsets);
+            if ((!entityOffsets.empty() && entityOffsets[entityOffsets.size() - 1] != h.mNumProperties)
+                || (!nameOffsets.empty() && nameOffsets[nameOffsets.size() - 1] != h.mNumProperties))
+                return false;
+            mOwned = Storage();
+            mByEntity = byEntity;
+            mEntityOffsets = entityOffsets;
+            mByName = byName;
+            mNameOffsets = nameOffsets;
+            return true;
+        }
+
+    private:
+        struct Header
+        {
+            uint64_t mMagic;
+            uint64_t mNumProperties;
+            uint64_t mNumEntityOffsets;
+            uint64_t mNumNameOffsets;
+        };
+
+        static const uint64_t Magic = 0x58444E4950505250ull;
+
+        /// The arrays built by the index. When the index is viewed in saved data, they are empty.
+        struct Storage
+        {
+            std::vector<SerializableProperty> mByEntity;
+            std::vector<uint32_t> mEntityOffsets;
+            std::vector<SerializableProperty> mByName;
+            std::vector<uint32_t> mNameOffsets;
+        };
+
+        Storage mOwned;
+        Span<SerializableProperty> mByEntity;
+        Span<uint32_t> mEntityOffsets;
+        Span<SerializableProperty> mByName;
+        Span<uint32_t> mNameOffsets;
+
+        template<typename T>
+        static Span<T> ToSpan(const std::vector<T>& v)
+        {
+            return Span<T>(v.data(), v.data() + v.size());
+        }
+
+        template<typename T>
+        static Span<T> Next(const bfast::byte*& p, size_t count)
+        {
+            auto r = Span<T>((const T*)p, (const T*)p + count);
+            p += count * sizeof(T);
+            return r;
+        }
+
+        static uint8_t* Write(uint8_t* p, const void* data, size_t size)
+        {
+            if (size > 0)
+                memcpy(p, data, size);
+            return p + size;
+        }
+
+        static Span<SerializableProperty> Range(const Span<SerializableProperty>& sorted, const Span<uint32_t>& offsets, int key)
+        {
+            if (key < 0 || (size_t)key + 1 >= offsets.size())
+                return Span<SerializableProperty>();
+            return Span<SerializableProperty>(sorted.data() + offsets[key], sorted.data() + offsets[key + 1]);
+        }
+
+        void Build(const SerializableProperty* properties, size_t n)
+        {
+            // Sort by (entity, name, value), so that the stable sort by name and value below leaves entities ascending
+            auto& byEntity = mOwned.mByEntity;
+            auto& byName = mOwned.mByName;
+            std::vector<uint64_t> keys;
+            byEntity.clear();
+            for (size_t i = 0; i < n; ++i)
+            {
+                auto& p = properties[i];
+                if (p.mEntityId >= 0 && p.mName >= 0 && p.mValue >= 0)
+                    byEntity.push_back(p);
+            }
+            keys.resize(byEntity.size());
+            g3d::parallel_for(keys.size(), [&](size_t i) {
+                keys[i] = (uint64_t)(uint32_t)byEntity[i].mName << 32 | (uint32_t)byEntity[i].mValue;
+            }, 4096);
+            g3d::radix_sort(keys, byEntity);
+            g3d::parallel_for(keys.size(), [&](size_t i) { keys[i] = (uint32_t)byEntity[i].mEntityId; }, 4096);
+            g3d::radix_sort(keys, byEntity);
+            mOwned.mEntityOffsets = g3d::sorted_key_offsets(keys, keys.empty() ? 0 : (size_t)keys.back() + 1);
+
+            byName = byEntity;
+            g3d::parallel_for(keys.size(), [&](size_t i) {
+                keys[i] = (uint64_t)(uint32_t)byName[i].mName << 32 | (uint32_t)byName[i].mValue;
+            }, 4096);
+            g3d::radix_sort(keys, byName);
+            g3d::parallel_for(keys.size(), [&](size_t i) { keys[i] >>= 32; }, 4096);
+            mOwned.mNameOffsets = g3d::sorted_key_offsets(keys, keys.empty() ? 0 : (size_t)keys.back() + 1);
+
+            mByEntity = ToSpan(byEntity);
+            mEntityOffsets = ToSpan(mOwned.mEntityOffsets);
+            mByName = ToSpan(byName);
+            mNameOffsets = ToSpan(mOwned.mNameOffsets);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*
+    Quantity Takeoff: Area, Volume and Centroid of G3D and VIM Elements
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __QUANTITIES_H__
+#define __QUANTITIES_H__
+
+#include <vector>
+
+#include "geometry.h"
+#include "parallel.h"
+#include "vim.h"
+#include "transforms.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// Surface area, enclosed volume and centroid of a piece of geometry.
+    /// The volume is computed with the divergence theorem, so it is only meaningful for closed, consistently oriented meshes.
+    /// The centroid is the volume centroid when the geometry encloses a volume, and the surface centroid otherwise.
+    struct Quantities
+    {
+        double area = 0;
+        double volume = 0;
+        double centroid[3] = { 0, 0, 0 };
+    };
+
+    /// Running sums of the triangle contributions to the quantities, relative to an origin near the geometry to preserve precision
+    struct QuantitySums
+    {
+        Vector3 origin = { 0, 0, 0 };
+        double area = 0;
+        double volume = 0;
+        double area_moment[3] = { 0, 0, 0 };
+        double volume_moment[3] = { 0, 0, 0 };
+
+        void add(const QuantitySums& o) {
+            area += o.area;
+            volume += o.volume;
+            for (auto i = 0; i < 3; ++i) {
+                area_moment[i] += o.area_moment[i];
+                volume_moment[i] += o.volume_moment[i];
+            }
+        }
+
+        Quantities to_quantities() const {
+            Quantities r;
+            r.area = area;
+            r.volume = volume;
+            // Treat the volume as noise relative to the area for open or flat geometry
+            auto closed = abs(volume) > 1e-6 * pow(area, 1.5);
+            for (auto i = 0; i < 3; ++i)
+                r.centroid[i] = origin[i] + (closed ? volume_moment[i] / volume : area > 0 ? area_moment[i] / area : 0);
+            return r;
+        }
+    };
+
+    /// Accumulates the quantities of the faces [face_begin, face_end). Polygons are split into triangle fans.
+    /// Triangles are gathered into blocks in structure-of-arrays layout so that the per-triangle math is vectorized.
+    /// If a transform is given, the vertices are transformed first. Sums over different ranges can only be added if they have the same origin.
+    inline QuantitySums accumulate_quantities(const MeshView& mesh, size_t face_begin, size_t face_end, const Vector3& origin, const float* transform = nullptr)
+    {
+        const size_t block = 64;
+        float ax[block], ay[block], az[block], bx[block], by[block], bz[block], cx[block], cy[block], cz[block];
+        double area[block], volume[block];
+        QuantitySums r;
+        r.origin = origin;
+        size_t n = 0;
+
+        auto flush = [&]() {
+            for (size_t i = 0; i < n; ++i) {
+                auto ux = bx[i] - ax[i], uy = by[i] - ay[i], uz = bz[i] - az[i];
+                auto vx = cx[i] - ax[i], vy = cy[i] - ay[i], vz = cz[i] - az[i];
+                auto nx = uy * vz - uz * vy, ny = uz * vx - ux * vz, nz = ux * vy - uy * vx;
+                area[i] = 0.5 * sqrt((double)nx * nx + (double)ny * ny + (double)nz * nz);
+                volume[i] = ((double)ax[i] * (by[i] * cz[i] - bz[i] * cy[i])
+                    + (double)ay[i] * (bz[i] * cx[i] - bx[i] * cz[i])
+                    + (double)az[i] * (bx[i] * cy[i] - by[i] * cx[i])) / 6.0;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                double sx = (double)ax[i] + bx[i] + cx[i], sy = (double)ay[i] + by[i] + cy[i], sz = (double)az[i] + bz[i] + cz[i];
+                r.area += area[i];
+                r.volume += volume[i];
+                r.area_moment[0] += area[i] * sx / 3; r.area_moment[1] += area[i] * sy / 3; r.area_moment[2] += area[i] * sz / 3;
+                r.volume_moment[0] += volume[i] * sx / 4; r.volume_moment[1] += volume[i] * sy / 4; r.volume_moment[2] += volume[i] * sz / 4;
+            }
+            n = 0;
+        };
+
+        auto vertex = [&](size_t corner) {
+            auto p = mesh.corner_position(corner);
+            return (transform ? transform_point(transform, p) : p) - origin;
+        };
+
+        const auto fs = (size_t)mesh.face_size;
+        if (fs < 3)
+            return r;
+        for (auto f = face_begin; f < face_end; ++f) {
+            auto a = vertex(f * fs);
+            auto b = vertex(f * fs + 1);
+            for (size_t k = 2; k < fs; ++k) {
+                auto c = vertex(f * fs + k);
+                ax[n] = a.x; ay[n] = a.y; az[n] = a.z;
+                bx[n] = b.x; by[n] = b.y; bz[n] = b.z;
+                cx[n] = c.x; cy[n] = c.y; cz[n] = c.z;
+                if (++n == block)
+                    flush();
+                b = c;
+            }
+        }
+        flush();
+        return r;
+    }
+
+    /// The first vertex of a sub-geometry, used as the origin of its sums
+    inline Vector3 subgeo_origin(const MeshView& mesh, size_t subgeo, const float* transform = nullptr)
+    {
+        if (mesh.vertex_begin(subgeo) >= mesh.vertex_end(subgeo))
+            return { 0, 0, 0 };
+        auto p = mesh.vertices[mesh.vertex_begin(subgeo)];
+        return transform ? transform_point(transform, p) : p;
+    }
+
+    /// Computes the quantities of every sub-geometry in local space. Large sub-geometries are split into chunks of faces, so the work is balanced across threads.
+    inline vector<Quantities> compute_subgeo_quantities(const MeshView& mesh)
+    {
+        const size_t chunk = 16384;
+        vector<pair<size_t, size_t>> work;
+        for (size_t s = 0; s < mesh.num_subgeos; ++s)
+            for (auto f = mesh.face_begin(s); f < mesh.face_end(s); f += chunk)
+                work.push_back({ s, f });
+
+        vector<QuantitySums> partial(work.size());
+        parallel_for(work.size(), [&](size_t i) {
+            auto s = work[i].first;
+            partial[i] = accumulate_quantities(mesh, work[i].second, min(mesh.face_end(s), work[i].second + chunk), subgeo_origin(mesh, s));
+        }, 4);
+
+        vector<QuantitySums> sums(mesh.num_subgeos);
+        for (size_t s = 0; s < sums.size(); ++s)
+            sums[s].origin = subgeo_origin(mesh, s);
+        for (size_t i = 0; i < work.size(); ++i)
+            sums[work[i].first].add(partial[i]);
+        vector<Quantities> r(mesh.num_subgeos);
+        for (size_t s = 0; s < r.size(); ++s)
+            r[s] = sums[s].to_quantities();
+        return r;
+    }
+
+    struct quantity_descriptors
+    {
+        static constexpr const char* SubGeoArea = "g3d:subgeo:area:0:float64:1";
+        static constexpr const char* SubGeoVolume = "g3d:subgeo:volume:0:float64:1";
+        static constexpr const char* SubGeoCentroid = "g3d:subgeo:centroid:0:float64:3";
+    };
+
+    /// Returns the quantities of every sub-geometry. They are read from the sub-geometry area, volume and centroid attributes when present,
+    /// otherwise they are computed and stored as those attributes, so that they are cached in memory and written out with the G3d.
+    inline vector<Quantities> subgeo_quantities(G3d& g)
+    {
+        MeshView mesh(g);
+        auto area = g.find_attribute(quantity_descriptors::SubGeoArea);
+        auto volume = g.find_attribute(quantity_descriptors::SubGeoVolume);
+        auto centroid = g.find_attribute(quantity_descriptors::SubGeoCentroid);
+        vector<Quantities> r(mesh.num_subgeos);
+        if (area && volume && centroid && area->count<double>() == r.size() && volume->count<double>() == r.size() && centroid->count<double>() == r.size() * 3) {
+            for (size_t s = 0; s < r.size(); ++s) {
+                r[s].area = area->data<double>()[s];
+                r[s].volume = volume->data<double>()[s];
+                memcpy(r[s].centroid, centroid->data<double>() + s * 3, sizeof(r[s].centroid));
+            }
+            return r;
+        }
+
+        r = compute_subgeo_quantities(mesh);
+        auto areas = g.add_owned_attribute<double>(quantity_descriptors::SubGeoArea, r.size());
+        auto volumes = g.add_owned_attribute<double>(quantity_descriptors::SubGeoVolume, r.size());
+        auto centroids = g.add_owned_attribute<double>(quantity_descriptors::SubGeoCentroid, r.size() * 3);
+        for (size_t s = 0; s < r.size(); ++s) {
+            areas[s] = r[s].area;
+            volumes[s] = r[s].volume;
+            memcpy(centroids + s * 3, r[s].centroid, sizeof(r[s].centroid));
+        }
+        return r;
+    }
+
+    /// Returns true if the transform only rotates, reflects, uniformly scales and translates, so that areas scale by |det|^(2/3)
+    inline bool is_similarity(const float* m, float tolerance = 1e-4f)
+    {
+        Vector3 rows[3] = { { m[0], m[1], m[2] }, { m[4], m[5], m[6] }, { m[8], m[9], m[10] } };
+        auto l0 = dot(rows[0], rows[0]);
+        for (auto i = 0; i < 3; ++i) {
+            if (abs(dot(rows[i], rows[i]) - l0) > tolerance * l0)
+                return false;
+            if (abs(dot(rows[i], rows[(i + 1) % 3])) > tolerance * l0)
+                return false;
+        }
+        return true;
+    }
+
+    /// Computes the world-space quantities of an instance from the local quantities of its sub-geometry.
+    /// Volume scales with the transform determinant and the centroid is transformed. Area scales with |det|^(2/3) for similarity transforms;
+    /// for other transforms it is recomputed from the transformed triangles.
+    inline Quantities instance_quantities(const MeshView& mesh, int32_t subgeo, const Quantities& local, const float* m)
+    {
+        if (subgeo < 0 || (size_t)subgeo >= mesh.num_subgeos)
+            return Quantities();
+        if (!is_similarity(m))
+            return accumulate_quantities(mesh, mesh.face_begin(subgeo), mesh.face_end(subgeo), subgeo_origin(mesh, subgeo, m), m).to_quantities();
+        Quantities r;
+        double det = determinant3x3(m);
+        r.volume = local.volume * det;
+        r.area = local.area * pow(abs(det), 2.0 / 3.0);
+        for (auto j = 0; j < 3; ++j)
+            r.centroid[j] = local.centroid[0] * m[j] + local.centroid[1] * m[4 + j] + local.centroid[2] * m[8 + j] + m[12 + j];
+        return r;
+    }
+
+    /// Computes the world-space quantities of each instance in parallel, using the cached sub-geometry quantities
+    inline vector<Quantities> compute_instance_quantities(G3d& g, const InstanceView& instances)
+    {
+        auto local = subgeo_quantities(g);
+        MeshView mesh(g);
+        vector<Quantities> r(instances.count);
+        parallel_for(instances.count, [&](size_t i) {
+            auto s = instances.subgeo(i);
+            if (s >= 0 && (size_t)s < local.size())
+                r[i] = instance_quantities(mesh, s, local[s], instances.transform(i));
+        }, 256);
+        return r;
+    }
+
+    inline vector<Quantities> compute_instance_quantities(G3d& g)
+    {
+        return compute_instance_quantities(g, InstanceView::from_g3d(g));
+    }
+}
+
+namespace Vim
+{
+    /// Computes the world-space area, volume and centroid of each scene node. Nodes without geometry have zero quantities.
+    inline std::vector<g3d::Quantities> ComputeNodeQuantities(Scene& scene)
+    {
+        return g3d::compute_instance_quantities(scene.mGeometry, WorldInstances(scene).View());
+    }
+}
+
+#endif
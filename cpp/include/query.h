@@ -0,0 +1,417 @@
+/*
+    Columnar Filters and Projections over VIM Entity Tables
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __QUERY_H__
+#define __QUERY_H__
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <climits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "bits.h"
+#include "parallel.h"
+#include "vim.h"
+#include "vimview.h"
+
+namespace Vim
+{
+    /// The columns of an entity table, viewed without copying, from either an EntityTable or an EntityTableView
+    class TableColumns
+    {
+    public:
+        std::unordered_map<std::string, Span<double>> mNumericColumns;
+        std::unordered_map<std::string, Span<int>> mIndexColumns;
+        std::unordered_map<std::string, Span<int>> mStringColumns;
+        size_t mNumRows = 0;
+
+        TableColumns() = default;
+
+        explicit TableColumns(const EntityTable& table)
+        {
+            for (auto& kv : table.mNumericColumns)
+                mNumericColumns[kv.first] = Span<double>(kv.second.data(), kv.second.data() + kv.second.size());
+            for (auto& kv : table.mIndexColumns)
+                mIndexColumns[kv.first] = Span<int>(kv.second.data(), kv.second.data() + kv.second.size());
+            for (auto& kv : table.mStringColumns)
+                mStringColumns[kv.first] = Span<int>(kv.second.data(), kv.second.data() + kv.second.size());
+            ComputeNumRows();
+        }
+
+        explicit TableColumns(const EntityTableView& table)
+            : mNumericColumns(table.mNumericColumns), mIndexColumns(table.mIndexColumns), mStringColumns(table.mStringColumns)
+        {
+            ComputeNumRows();
+        }
+
+        /// A column found by name. Empty columns may have null data, so the type is kept separately.
+        struct Column
+        {
+            const double* mDoubles = nullptr;
+            const int* mInts = nullptr;
+            bool mNumeric = false;
+        };
+
+        /// Finds a column by its name with its type, such as "numeric:Area" or "index:Rvt.Level:Level", or by its name alone, which is looked up in the numeric, index and string columns in that order
+        Column Find(const std::string& name) const
+        {
+            Column r;
+            auto colon = name.find(':');
+            auto type = name.substr(0, colon);
+            auto rest = colon == std::string::npos ? name : name.substr(colon + 1);
+            if ((type == "numeric" && FindIn(mNumericColumns, rest, r.mDoubles)) || FindIn(mNumericColumns, name, r.mDoubles))
+            {
+                r.mNumeric = true;
+                return r;
+            }
+            if ((type == "index" && FindIn(mIndexColumns, rest, r.mInts)) || (type == "string" && FindIn(mStringColumns, rest, r.mInts))
+                || FindIn(mIndexColumns, name, r.mInts) || FindIn(mStringColumns, name, r.mInts))
+                return r;
+            throw std::runtime_error("No column " + name);
+        }
+
+    private:
+        template<typename T>
+        static bool FindIn(const std::unordered_map<std::string, Span<T>>& columns, const std::string& name, const T*& r)
+        {
+            auto it = columns.find(name);
+            if (it == columns.end())
+                return false;
+            r = it->second.data();
+            return true;
+        }
+
+        void ComputeNumRows()
+        {
+            bool first = true;
+            auto check = [&](size_t n) {
+                if (!first && n != mNumRows)
+                    throw std::runtime_error("The columns of the table have different numbers of rows");
+                mNumRows = n;
+                first = false;
+            };
+            for (auto& kv : mNumericColumns) check(kv.second.size());
+            for (auto& kv : mIndexColumns) check(kv.second.size());
+            for (auto& kv : mStringColumns) check(kv.second.size());
+        }
+    };
+
+    enum class CompareOp { Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual };
+
+    enum class PredicateKind { Compare, In, And, Or, Not };
+
+    /// A condition on the rows of a table: a comparison of a column with a constant, membership of the values of an index or string column in a set, or a combination of conditions
+    class Predicate
+    {
+    public:
+        PredicateKind mKind = PredicateKind::Compare;
+        std::string mColumn;
+        CompareOp mOp = CompareOp::Equal;
+        double mValue = 0;
+        /// The set of values of In, one bit per value, e.g. the indices of the strings that match a pattern
+        std::shared_ptr<const g3d::Bitset> mSet;
+        std::vector<Predicate> mChildren;
+
+        static Predicate Compare(const std::string& column, CompareOp op, double value)
+        {
+            Predicate r;
+            r.mColumn = column;
+            r.mOp = op;
+            r.mValue = value;
+            return r;
+        }
+
+        static Predicate In(const std::string& column, g3d::Bitset values)
+        {
+            Predicate r;
+            r.mKind = PredicateKind::In;
+            r.mColumn = column;
+            r.mSet = std::make_shared<const g3d::Bitset>(std::move(values));
+            return r;
+        }
+
+        static Predicate Combine(PredicateKind kind, std::vector<Predicate> children)
+        {
+            Predicate r;
+            r.mKind = kind;
+            r.mChildren = std::move(children);
+            return r;
+        }
+
+        friend Predicate operator&&(const Predicate& a, const Predicate& b) { return Combine(PredicateKind::And, { a, b }); }
+        friend Predicate operator||(const Predicate& a, const Predicate& b) { return Combine(PredicateKind::Or, { a, b }); }
+        friend Predicate operator!(const Predicate& a) { return Combine(PredicateKind::Not, { a }); }
+    };
+
+    /// Names a column in a predicate, so that predicates can be written as Col("numeric:Area") > 10 && Col("index:Level") == 3
+    struct Col
+    {
+        std::string mName;
+        explicit Col(const std::string& name) : mName(name) { }
+
+        Predicate operator==(double v) const { return Predicate::Compare(mName, CompareOp::Equal, v); }
+        Predicate operator!=(double v) const { return Predicate::Compare(mName, CompareOp::NotEqual, v); }
+        Predicate operator<(double v) const { return Predicate::Compare(mName, CompareOp::Less, v); }
+        Predicate operator<=(double v) const { return Predicate::Compare(mName, CompareOp::LessEqual, v); }
+        Predicate operator>(double v) const { return Predicate::Compare(mName, CompareOp::Greater, v); }
+        Predicate operator>=(double v) const { return Predicate::Compare(mName, CompareOp::GreaterEqual, v); }
+        Predicate In(g3d::Bitset values) const { return Predicate::In(mName, std::move(values)); }
+    };
+
+    /// Evaluates predicates over the columns of a table into selection bitmaps, one bit per row, and projects the selected rows of columns.
+    /// Rows are processed in morsels of MorselSize rows in parallel. Within a morsel, each comparison produces 64 rows of the bitmap at a time,
+    /// with AVX2 comparing four values per instruction when available, and the bitmaps of combined predicates are merged word by word.
+    /// AND skips the rest of its conditions for a morsel once no row is left.
+    class Query
+    {
+    public:
+        static const size_t MorselSize = 1 << 14;
+
+        explicit Query(const TableColumns& columns)
+            : mColumns(columns)
+        { }
+
+        size_t NumRows() const { return mColumns.mNumRows; }
+
+        g3d::Bitset Filter(const Predicate& predicate) const
+        {
+            auto plan = Resolve(predicate);
+            const auto n = NumRows();
+            g3d::Bitset r(n);
+            const auto num_morsels = (n + MorselSize - 1) / MorselSize;
+            g3d::parallel_for(num_morsels, [&](size_t m) {
+                auto begin = m * MorselSize;
+                Evaluate(plan, begin, std::min(n, begin + MorselSize) - begin, r.words.data() + begin / 64);
+            }, 1);
+            return r;
+        }
+
+        /// The indices of the selected rows, in increasing order
+        static std::vector<int> Rows(const g3d::Bitset& selection)
+        {
+            return Gather<int>(selection, [](size_t row) { return (int)row; });
+        }
+
+        /// The values of the selected rows of a column, in row order
+        template<typename T>
+        static std::vector<T> Project(const Span<T>& column, const g3d::Bitset& selection)
+        {
+            if (column.size() < selection.size)
+                throw std::runtime_error("The column has fewer rows than the selection");
+            return Gather<T>(selection, [&](size_t row) { return column[row]; });
+        }
+
+        std::vector<double> ProjectNumeric(const std::string& name, const g3d::Bitset& selection) const
+        {
+            return Project(mColumns.mNumericColumns.at(name), selection);
+        }
+
+        std::vector<int> ProjectIndex(const std::string& name, const g3d::Bitset& selection) const
+        {
+            return Project(mColumns.mIndexColumns.at(name), selection);
+        }
+
+        std::vector<int> ProjectString(const std::string& name, const g3d::Bitset& selection) const
+        {
+            return Project(mColumns.mStringColumns.at(name), selection);
+        }
+
+        /// Collects value(row) for the selected rows in row order. Each morsel counts its rows, then writes them from its offset in parallel.
+        template<typename T, typename F>
+        static std::vector<T> Gather(const g3d::Bitset& selection, F value)
+        {
+            const auto num_morsels = (selection.size + MorselSize - 1) / MorselSize;
+            const auto words_per_morsel = MorselSize / 64;
+            std::vector<size_t> offsets(num_morsels + 1);
+            g3d::parallel_for(num_morsels, [&](size_t m) {
+                size_t count = 0;
+                for (auto w = m * words_per_morsel; w < std::min(selection.words.size(), (m + 1) * words_per_morsel); ++w)
+                    count += g3d::popcount(selection.words[w]);
+                offsets[m + 1] = count;
+            }, 1);
+            for (size_t m = 0; m < num_morsels; ++m)
+                offsets[m + 1] += offsets[m];
+            std::vector<T> r(offsets[num_morsels]);
+            g3d::parallel_for(num_morsels, [&](size_t m) {
+                auto out = offsets[m];
+                for (auto w = m * words_per_morsel; w < std::min(selection.words.size(), (m + 1) * words_per_morsel); ++w)
+                    for (auto bits = selection.words[w]; bits != 0; bits &= bits - 1)
+                        r[out++] = value(w * 64 + g3d::count_trailing_zeros(bits));
+            }, 1);
+            return r;
+        }
+
+    private:
+        const TableColumns& mColumns;
+
+        /// A predicate with its columns looked up
+        struct Plan
+        {
+            PredicateKind mKind;
+            TableColumns::Column mColumn;
+            CompareOp mOp;
+            double mValue;
+            const g3d::Bitset* mSet;
+            std::vector<Plan> mChildren;
+        };
+
+        Plan Resolve(const Predicate& p) const
+        {
+            Plan r = { p.mKind, TableColumns::Column(), p.mOp, p.mValue, p.mSet.get(), {} };
+            if (p.mKind == PredicateKind::Compare || p.mKind == PredicateKind::In)
+            {
+                r.mColumn = mColumns.Find(p.mColumn);
+                if (p.mKind == PredicateKind::In && (r.mColumn.mNumeric || !p.mSet))
+                    throw std::runtime_error("Sets of values apply to index and string columns only");
+            }
+            else if (p.mChildren.empty() || (p.mKind == PredicateKind::Not && p.mChildren.size() != 1))
+                throw std::runtime_error("Invalid predicate");
+            for (auto& c : p.mChildren)
+                r.mChildren.push_back(Resolve(c));
+            return r;
+        }
+
+        /// Evaluates the plan for n rows from begin into bitmap words
+        static void Evaluate(const Plan& p, size_t begin, size_t n, uint64_t* out)
+        {
+            const auto num_words = (n + 63) / 64;
+            switch (p.mKind)
+            {
+            case PredicateKind::Compare:
+                if (p.mColumn.mNumeric)
+                    Compare(p.mColumn.mDoubles + begin, n, p.mOp, p.mValue, out);
+                else
+                    Compare(p.mColumn.mInts + begin, n, p.mOp, p.mValue, out);
+                return;
+            case PredicateKind::In:
+                In(p.mColumn.mInts + begin, n, *p.mSet, out);
+                return;
+            case PredicateKind::Not:
+                Evaluate(p.mChildren[0], begin, n, out);
+                for (size_t w = 0; w < num_words; ++w)
+                    out[w] = ~out[w];
+                if (n % 64 != 0)
+                    out[num_words - 1] &= (1ull << (n % 64)) - 1;
+                return;
+            default:
+            {
+                Evaluate(p.mChildren[0], begin, n, out);
+                std::vector<uint64_t> tmp(num_words);
+                for (size_t i = 1; i < p.mChildren.size(); ++i)
+                {
+                    if (p.mKind == PredicateKind::And && std::all_of(out, out + num_words, [](uint64_t w) { return w == 0; }))
+                        return;
+                    Evaluate(p.mChildren[i], begin, n, tmp.data());
+                    for (size_t w = 0; w < num_words; ++w)
+                        out[w] = p.mKind == PredicateKind::And ? out[w] & tmp[w] : out[w] | tmp[w];
+                }
+                return;
+            }
+            }
+        }
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+        template<int Imm>
+        static uint64_t CompareWord(const double* c, __m256d v)
+        {
+            uint64_t bits = 0;
+            for (int j = 0; j < 64; j += 4)
+                bits |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(c + j), v, Imm)) << j;
+            return bits;
+        }
+
+        template<int Imm>
+        static uint64_t CompareWord(const int* c, __m256d v)
+        {
+            uint64_t bits = 0;
+            for (int j = 0; j < 64; j += 4)
+                bits |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(c + j))), v, Imm)) << j;
+            return bits;
+        }
+#endif
+
+        /// Looks up n values in a set into bitmap words. With AVX2, eight values are looked up at a time by gathering 32-bit words of the set.
+        static void In(const int* c, size_t n, const g3d::Bitset& set, uint64_t* out)
+        {
+            size_t w = 0;
+#if defined(__AVX2__) || defined(__AVX512F__)
+            const auto words = (const int*)set.words.data();
+            const auto none = _mm256_set1_epi32(-1);
+            const auto one = _mm256_set1_epi32(1);
+            const auto low_bits = _mm256_set1_epi32(31);
+            const auto size = _mm256_set1_epi32((int)std::min<size_t>(set.size, INT_MAX));
+            for (; (w + 1) * 64 <= n; ++w)
+            {
+                uint64_t bits = 0;
+                for (int j = 0; j < 64; j += 8)
+                {
+                    auto v = _mm256_loadu_si256((const __m256i*)(c + w * 64 + j));
+                    auto valid = _mm256_and_si256(_mm256_cmpgt_epi32(v, none), _mm256_cmpgt_epi32(size, v));
+                    auto word = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), words, _mm256_srli_epi32(v, 5), valid, 4);
+                    auto bit = _mm256_and_si256(_mm256_srlv_epi32(word, _mm256_and_si256(v, low_bits)), one);
+                    bits |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(bit, one))) << j;
+                }
+                out[w] = bits;
+            }
+#endif
+            for (; w * 64 < n; ++w)
+            {
+                uint64_t bits = 0;
+                const auto m = std::min<size_t>(64, n - w * 64);
+                for (size_t j = 0; j < m; ++j)
+                {
+                    auto v = c[w * 64 + j];
+                    bits |= (uint64_t)(v >= 0 && (size_t)v < set.size && set.get(v)) << j;
+                }
+                out[w] = bits;
+            }
+        }
+
+        /// Compares n values with the constant into bitmap words. Integer columns are compared as doubles, which is exact for 32-bit integers.
+        template<int Imm, typename T, typename Cmp>
+        static void CompareWith(const T* c, size_t n, double value, uint64_t* out, Cmp cmp)
+        {
+            size_t w = 0;
+#if defined(__AVX2__) || defined(__AVX512F__)
+            const auto v = _mm256_set1_pd(value);
+            for (; (w + 1) * 64 <= n; ++w)
+                out[w] = CompareWord<Imm>(c + w * 64, v);
+#endif
+            for (; w * 64 < n; ++w)
+            {
+                uint64_t bits = 0;
+                const auto m = std::min<size_t>(64, n - w * 64);
+                for (size_t j = 0; j < m; ++j)
+                    bits |= (uint64_t)cmp((double)c[w * 64 + j], value) << j;
+                out[w] = bits;
+            }
+        }
+
+        template<typename T>
+        static void Compare(const T* c, size_t n, CompareOp op, double value, uint64_t* out)
+        {
+            // The immediates are the _CMP_*_OQ predicates of AVX, and _CMP_NEQ_UQ for inequality so that NaN differs from everything
+            switch (op)
+            {
+            case CompareOp::Equal: CompareWith<0x00>(c, n, value, out, std::equal_to<double>()); break;
+            case CompareOp::NotEqual: CompareWith<0x04>(c, n, value, out, std::not_equal_to<double>()); break;
+            case CompareOp::Less: CompareWith<0x11>(c, n, value, out, std::less<double>()); break;
+            case CompareOp::LessEqual: CompareWith<0x12>(c, n, value, out, std::less_equal<double>()); break;
+            case CompareOp::Greater: CompareWith<0x1E>(c, n, value, out, std::greater<double>()); break;
+            case CompareOp::GreaterEqual: CompareWith<0x1D>(c, n, value, out, std::greater_equal<double>()); break;
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,288 @@
+/*
+    Relations between VIM Entity Tables
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __RELATIONS_H__
+#define __RELATIONS_H__
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "parallel.h"
+#include "query.h"
+
+namespace Vim
+{
+    /// A foreign key: an index column of one table, named "<target table>:<name>", whose values are rows of the target table, or -1 for none.
+    /// The forward direction is the column itself. The reverse direction lists the rows that refer to each target row, in compressed rows.
+    class Relation
+    {
+    public:
+        std::string mTable;
+        std::string mColumn;
+        std::string mTargetTable;
+        size_t mNumTargetRows = 0;
+        /// The target row of each row, as stored in the column
+        Span<int> mForward;
+        /// The rows that refer to target row t are mSources[mOffsets[t]] to mSources[mOffsets[t + 1]], in ascending order
+        std::vector<uint32_t> mOffsets;
+        std::vector<int> mSources;
+
+        /// The target row of a row, or -1 if it has none or refers past the end of the target table
+        int Target(size_t row) const
+        {
+            auto t = mForward[row];
+            return t >= 0 && (size_t)t < mNumTargetRows ? t : -1;
+        }
+
+        /// The rows that refer to a target row
+        Span<int> Sources(int target) const
+        {
+            if (target < 0 || (size_t)target >= mNumTargetRows)
+                return Span<int>();
+            return Span<int>(mSources.data() + mOffsets[target], mSources.data() + mOffsets[target + 1]);
+        }
+    };
+
+    /// A column of one table seen from the rows of another, through a path of relations. The values are not copied:
+    /// the view keeps the row reached from each source row, shared by all of the columns joined along the same path.
+    template<typename T>
+    class JoinedColumn
+    {
+    public:
+        Span<T> mValues;
+        std::shared_ptr<const std::vector<int>> mRows;
+        /// The value of rows whose path is broken
+        T mDefault = T();
+
+        size_t size() const { return mRows ? mRows->size() : 0; }
+        bool HasValue(size_t i) const { return (*mRows)[i] >= 0; }
+        T operator[](size_t i) const { auto r = (*mRows)[i]; return r < 0 ? mDefault : mValues[r]; }
+
+        /// Gathers the values of all rows in parallel, with AVX2 gathers when available
+        std::vector<T> ToVector() const
+        {
+            std::vector<T> r(size());
+            auto rows = size() == 0 ? nullptr : mRows->data();
+            g3d::parallel_for_chunks(r.size(), 1 << 14, [&](size_t begin, size_t end) {
+                Gather(mValues.data(), rows + begin, end - begin, mDefault, r.data() + begin);
+            });
+            return r;
+        }
+
+    private:
+        static void Gather(const T* values, const int* rows, size_t n, T fallback, T* out)
+        {
+            for (size_t i = 0; i < n; ++i)
+                out[i] = rows[i] < 0 ? fallback : values[rows[i]];
+        }
+    };
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+    template<>
+    inline void JoinedColumn<double>::Gather(const double* values, const int* rows, size_t n, double fallback, double* out)
+    {
+        size_t i = 0;
+        const auto none = _mm_set1_epi32(-1);
+        const auto f = _mm256_set1_pd(fallback);
+        for (; i + 4 <= n; i += 4)
+        {
+            auto idx = _mm_loadu_si128((const __m128i*)(rows + i));
+            auto mask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpgt_epi32(idx, none)));
+            _mm256_storeu_pd(out + i, _mm256_mask_i32gather_pd(f, values, idx, mask, 8));
+        }
+        for (; i < n; ++i)
+            out[i] = rows[i] < 0 ? fallback : values[rows[i]];
+    }
+
+    template<>
+    inline void JoinedColumn<int>::Gather(const int* values, const int* rows, size_t n, int fallback, int* out)
+    {
+        size_t i = 0;
+        const auto none = _mm256_set1_epi32(-1);
+        const auto f = _mm256_set1_epi32(fallback);
+        for (; i + 8 <= n; i += 8)
+        {
+            auto idx = _mm256_loadu_si256((const __m256i*)(rows + i));
+            _mm256_storeu_si256((__m256i*)(out + i), _mm256_mask_i32gather_epi32(f, values, idx, _mm256_cmpgt_epi32(idx, none), 4));
+        }
+        for (; i < n; ++i)
+            out[i] = rows[i] < 0 ? fallback : values[rows[i]];
+    }
+#endif
+
+    /// The rows of a target table reached from each row of a source table by following a path of relations, or -1 where the path is broken
+    class JoinPath
+    {
+    public:
+        std::string mTable;
+        std::string mTargetTable;
+        std::shared_ptr<const std::vector<int>> mRows;
+        const TableColumns* mTarget = nullptr;
+
+        size_t size() const { return mRows ? mRows->size() : 0; }
+
+        JoinedColumn<double> Numeric(const std::string& name, double missing = 0) const
+        {
+            return { mTarget->mNumericColumns.at(name), mRows, missing };
+        }
+
+        JoinedColumn<int> Index(const std::string& name, int missing = -1) const
+        {
+            return { mTarget->mIndexColumns.at(name), mRows, missing };
+        }
+
+        JoinedColumn<int> String(const std::string& name, int missing = -1) const
+        {
+            return { mTarget->mStringColumns.at(name), mRows, missing };
+        }
+    };
+
+    /// The relations between the entity tables of a scene, found from their index columns, with reverse indexes built in parallel.
+    /// Index columns whose target table is not present are left out. The tables must outlive the index.
+    class RelationIndex
+    {
+    public:
+        /// Indexes the tables of a Scene or SceneView, i.e. a map from table name to EntityTable or EntityTableView
+        template<typename Tables>
+        explicit RelationIndex(const Tables& tables)
+        {
+            for (auto& kv : tables)
+                mTables.emplace(kv.first, TableColumns(kv.second));
+            for (auto& kv : mTables)
+                for (auto& column : kv.second.mIndexColumns)
+                {
+                    auto target = mTables.find(column.first.substr(0, column.first.find(':')));
+                    if (target == mTables.end())
+                        continue;
+                    Relation r;
+                    r.mTable = kv.first;
+                    r.mColumn = column.first;
+                    r.mTargetTable = target->first;
+                    r.mNumTargetRows = target->second.mNumRows;
+                    r.mForward = column.second;
+                    mRelations.push_back(std::move(r));
+                }
+            std::sort(mRelations.begin(), mRelations.end(), [](const Relation& a, const Relation& b) {
+                return a.mTable < b.mTable || (a.mTable == b.mTable && a.mColumn < b.mColumn);
+            });
+            for (auto& r : mRelations)
+                BuildReverse(r);
+        }
+
+        RelationIndex(const RelationIndex&) = delete;
+        RelationIndex& operator=(const RelationIndex&) = delete;
+
+        const std::vector<Relation>& Relations() const { return mRelations; }
+
+        const TableColumns& Table(const std::string& name) const
+        {
+            auto it = mTables.find(name);
+            if (it == mTables.end())
+                throw std::runtime_error("No table " + name);
+            return it->second;
+        }
+
+        /// Finds the relation of an index column, such as ("Rvt.Element", "Rvt.Level:Level"), or returns null
+        const Relation* Find(const std::string& table, const std::string& column) const
+        {
+            for (auto& r : mRelations)
+                if (r.mTable == table && r.mColumn == column)
+                    return &r;
+            return nullptr;
+        }
+
+        /// The relations of other tables that refer to a table
+        std::vector<const Relation*> ReferencesTo(const std::string& table) const
+        {
+            std::vector<const Relation*> r;
+            for (auto& rel : mRelations)
+                if (rel.mTargetTable == table)
+                    r.push_back(&rel);
+            return r;
+        }
+
+        /// Follows index columns from a table, one per hop. For example ("Rvt.Room", { "Rvt.Element:Element", "Rvt.Level:Level" }) reaches the level of the element of every room.
+        /// Each hop gathers the next row of all rows at once, in parallel.
+        JoinPath Follow(const std::string& table, const std::vector<std::string>& columns) const
+        {
+            auto rows = std::make_shared<std::vector<int>>(Table(table).mNumRows);
+            std::iota(rows->begin(), rows->end(), 0);
+            auto current = table;
+            for (auto& column : columns)
+            {
+                auto r = Find(current, column);
+                if (!r)
+                    throw std::runtime_error("No relation " + column + " from table " + current);
+                auto& data = *rows;
+                g3d::parallel_for_chunks(data.size(), 1 << 14, [&](size_t begin, size_t end) {
+                    Hop(r->mForward.data(), r->mNumTargetRows, data.data() + begin, end - begin);
+                });
+                current = r->mTargetTable;
+            }
+            JoinPath r;
+            r.mTable = table;
+            r.mTargetTable = current;
+            r.mRows = rows;
+            r.mTarget = &Table(current);
+            return r;
+        }
+
+    private:
+        std::unordered_map<std::string, TableColumns> mTables;
+        std::vector<Relation> mRelations;
+
+        /// Replaces each row with its target through the forward column, keeping -1 for broken paths and for targets out of range
+        static void Hop(const int* forward, size_t num_targets, int* rows, size_t n)
+        {
+            size_t i = 0;
+#if defined(__AVX2__) || defined(__AVX512F__)
+            const auto none = _mm256_set1_epi32(-1);
+            const auto limit = _mm256_set1_epi32((int)std::min<size_t>(num_targets, INT32_MAX));
+            for (; i + 8 <= n; i += 8)
+            {
+                auto idx = _mm256_loadu_si256((const __m256i*)(rows + i));
+                auto next = _mm256_mask_i32gather_epi32(none, forward, idx, _mm256_cmpgt_epi32(idx, none), 4);
+                auto valid = _mm256_and_si256(_mm256_cmpgt_epi32(next, none), _mm256_cmpgt_epi32(limit, next));
+                _mm256_storeu_si256((__m256i*)(rows + i), _mm256_blendv_epi8(none, next, valid));
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                auto next = rows[i] < 0 ? -1 : forward[rows[i]];
+                rows[i] = next >= 0 && (size_t)next < num_targets ? next : -1;
+            }
+        }
+
+        /// Sorts the rows by their target with the parallel radix sort, which is stable so the rows of each target stay ascending
+        static void BuildReverse(Relation& r)
+        {
+            std::vector<uint64_t> keys;
+            r.mSources.clear();
+            for (size_t i = 0; i < r.mForward.size(); ++i)
+            {
+                auto t = r.Target(i);
+                if (t >= 0)
+                {
+                    keys.push_back((uint64_t)t);
+                    r.mSources.push_back((int)i);
+                }
+            }
+            g3d::radix_sort(keys, r.mSources);
+            r.mOffsets = g3d::sorted_key_offsets(keys, r.mNumTargetRows);
+        }
+    };
+}
+
+#endif
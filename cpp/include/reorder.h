@@ -0,0 +1,278 @@
+/*
+    Spatial Reordering of G3D and VIM Geometry
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __REORDER_H__
+#define __REORDER_H__
+
+#include <vector>
+#include <numeric>
+
+#include "geometry.h"
+#include "parallel.h"
+#include "vim.h"
+#include "transforms.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// Which parts of the geometry are reordered
+    struct ReorderOptions
+    {
+        bool vertices = true;   // vertices within each sub-geometry
+        bool subgeos = true;    // sub-geometries across the file
+        bool instances = true;  // instances across the file
+    };
+
+    /// For each sub-geometry and instance, its new index after reordering
+    struct ReorderMapping
+    {
+        vector<int32_t> subgeos;
+        vector<int32_t> instances;
+    };
+
+    /// Returns the order (new to old) that sorts the given keys
+    inline vector<uint32_t> sorted_order(vector<uint64_t> keys)
+    {
+        vector<uint32_t> order(keys.size());
+        iota(order.begin(), order.end(), 0);
+        radix_sort(keys, order);
+        return order;
+    }
+
+    /// Returns the old-to-new mapping of a new-to-old order
+    inline vector<int32_t> inverse_order(const vector<uint32_t>& order)
+    {
+        vector<int32_t> r(order.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            r[order[i]] = (int32_t)i;
+        return r;
+    }
+
+    /// Permutes the elements [begin, begin + order.size()) of an attribute so that new element i is old element begin + order[i]
+    inline void permute_elements(Attribute& attr, size_t begin, const vector<uint32_t>& order)
+    {
+        if (begin + order.size() > attr.num_elements())
+            throw runtime_error("Elements are out of range of the attribute");
+        auto es = attr.data_element_size();
+        auto base = attr._begin + begin * es;
+        vector<uint8_t> tmp(order.size() * es);
+        for (size_t i = 0; i < order.size(); ++i)
+            memcpy(&tmp[i * es], base + order[i] * es, es);
+        memcpy(base, tmp.data(), tmp.size());
+    }
+
+    /// Rearranges contiguous blocks of elements of an attribute. New block i is old block order[i], which starts at element begins[order[i]] and has sizes[order[i]] elements.
+    inline void permute_blocks(Attribute& attr, const vector<size_t>& begins, const vector<size_t>& sizes, const vector<uint32_t>& order)
+    {
+        auto es = attr.data_element_size();
+        vector<size_t> new_begins(order.size() + 1, 0);
+        for (size_t i = 0; i < order.size(); ++i)
+            new_begins[i + 1] = new_begins[i] + sizes[order[i]];
+        if (new_begins.back() > attr.num_elements())
+            throw runtime_error("Blocks are out of range of the attribute");
+        vector<uint8_t> tmp(new_begins.back() * es);
+        parallel_for(order.size(), [&](size_t i) {
+            memcpy(&tmp[new_begins[i] * es], attr._begin + begins[order[i]] * es, sizes[order[i]] * es);
+        }, 64);
+        memcpy(attr._begin, tmp.data(), tmp.size());
+    }
+
+    /// Sorts the vertices of each sub-geometry by the Morton code of their position within the sub-geometry bounds.
+    /// All vertex attributes are permuted and the index buffer is remapped.
+    inline void reorder_vertices(G3d& g, const MeshView& mesh)
+    {
+        parallel_for(mesh.num_subgeos, [&](size_t s) {
+            auto vb = mesh.vertex_begin(s), ve = mesh.vertex_end(s);
+            if (ve - vb < 2) return;
+            auto bounds = mesh.subgeo_bounds(s);
+            vector<uint64_t> keys(ve - vb);
+            for (auto i = vb; i < ve; ++i)
+                keys[i - vb] = morton_code(mesh.vertices[i], bounds);
+            auto order = sorted_order(move(keys));
+            for (auto& attr : g.attributes)
+                if (attr.descriptor.association == assoc_vertex)
+                    permute_elements(attr, vb, order);
+            if (mesh.indices) {
+                auto remap = inverse_order(order);
+                for (auto i = mesh.index_begin(s); i < mesh.index_end(s); ++i)
+                    mesh.indices[i] = (int32_t)vb + remap[mesh.indices[i] - vb];
+            }
+        }, 1);
+    }
+
+    /// Sorts the sub-geometries by the Morton code of their centroid. If a sub-geometry is instanced, the centroid of its first instance is used.
+    /// The vertex, corner, edge, face and sub-geometry attributes are rearranged, the indices and offsets are rebased, and the instance sub-geometry references are remapped.
+    /// Returns the new index of each sub-geometry.
+    inline vector<int32_t> reorder_subgeos(G3d& g, const MeshView& mesh, const InstanceView& instances)
+    {
+        const auto n = mesh.num_subgeos;
+        if (!mesh.subgeo_vertex_offsets || n < 2)
+            return vector<int32_t>(n, 0);
+        if (mesh.vertex_begin(0) != 0 || mesh.index_begin(0) != 0)
+            throw runtime_error("The first sub-geometry must start at the beginning of the vertex and index buffers");
+        for (auto& attr : g.attributes)
+            if (attr.descriptor.association == assoc_group && (attr.descriptor.semantic == "indexoffset" || attr.descriptor.semantic == "vertexoffset"))
+                throw runtime_error("Sub-geometries can not be reordered when groups refer to offsets in the vertex or index buffer");
+
+        vector<Vector3> centroids(n);
+        parallel_for(n, [&](size_t s) { centroids[s] = mesh.subgeo_bounds(s).center(); }, 256);
+        vector<bool> placed(n, false);
+        for (size_t i = 0; i < instances.count; ++i) {
+            auto s = instances.subgeo(i);
+            if (s >= 0 && (size_t)s < n && !placed[s]) {
+                centroids[s] = transform_point(instances.transform(i), centroids[s]);
+                placed[s] = true;
+            }
+        }
+
+        AABox bounds;
+        for (auto& c : centroids)
+            bounds.merge(c);
+        vector<uint64_t> keys(n);
+        parallel_for(n, [&](size_t s) { keys[s] = morton_code(centroids[s], bounds); });
+        auto order = sorted_order(move(keys));
+        auto remap = inverse_order(order);
+
+        vector<size_t> vertex_begins(n), vertex_sizes(n), index_begins(n), index_sizes(n), face_begins(n), face_sizes(n);
+        for (size_t s = 0; s < n; ++s) {
+            vertex_begins[s] = mesh.vertex_begin(s);
+            vertex_sizes[s] = mesh.vertex_end(s) - vertex_begins[s];
+            index_begins[s] = mesh.index_begin(s);
+            index_sizes[s] = mesh.index_end(s) - index_begins[s];
+            face_begins[s] = index_begins[s] / mesh.face_size;
+            face_sizes[s] = index_sizes[s] / mesh.face_size;
+        }
+
+        for (auto& attr : g.attributes)
+        {
+            switch (attr.descriptor.association) {
+                case assoc_vertex: permute_blocks(attr, vertex_begins, vertex_sizes, order); break;
+                case assoc_corner:
+                case assoc_edge: permute_blocks(attr, index_begins, index_sizes, order); break;
+                case assoc_face: permute_blocks(attr, face_begins, face_sizes, order); break;
+                case assoc_subgeo: permute_elements(attr, 0, order); break;
+                default: break;
+            }
+        }
+
+        // Rebuild the offsets and rebase the indices of each moved sub-geometry
+        int32_t vertex_offset = 0, index_offset = 0;
+        for (size_t i = 0; i < n; ++i) {
+            mesh.subgeo_vertex_offsets[i] = vertex_offset;
+            mesh.subgeo_index_offsets[i] = index_offset;
+            vertex_offset += (int32_t)vertex_sizes[order[i]];
+            index_offset += (int32_t)index_sizes[order[i]];
+        }
+        if (mesh.indices)
+            parallel_for(n, [&](size_t i) {
+                auto delta = mesh.subgeo_vertex_offsets[i] - (int32_t)vertex_begins[order[i]];
+                if (delta != 0)
+                    for (auto j = mesh.index_begin(i); j < mesh.index_end(i); ++j)
+                        mesh.indices[j] += delta;
+            }, 64);
+
+        if (auto attr = g.find_attribute(descriptors::InstanceSubGeometries))
+            for (auto p = attr->data<int32_t>(); p < attr->data<int32_t>() + attr->count<int32_t>(); ++p)
+                if (*p >= 0 && (size_t)*p < n)
+                    *p = remap[*p];
+        return remap;
+    }
+
+    /// Sorts the instances of the G3d by the Morton code of the world-space centroid of their sub-geometry.
+    /// All instance attributes are permuted, and instance parent indices are remapped. Returns the new index of each instance.
+    inline vector<int32_t> reorder_instances(G3d& g, const MeshView& mesh)
+    {
+        auto instances = InstanceView::from_g3d(g);
+        const auto n = instances.count;
+        vector<Vector3> centroids(n);
+        parallel_for(n, [&](size_t i) {
+            auto s = instances.subgeo(i);
+            auto local = s >= 0 && (size_t)s < mesh.num_subgeos ? mesh.subgeo_bounds(s).center() : Vector3{ 0, 0, 0 };
+            centroids[i] = transform_point(instances.transform(i), local);
+        }, 256);
+
+        AABox bounds;
+        for (auto& c : centroids)
+            bounds.merge(c);
+        vector<uint64_t> keys(n);
+        parallel_for(n, [&](size_t i) { keys[i] = morton_code(centroids[i], bounds); });
+        auto order = sorted_order(move(keys));
+        auto remap = inverse_order(order);
+
+        for (auto& attr : g.attributes)
+        {
+            if (attr.descriptor.association != assoc_instance)
+                continue;
+            permute_elements(attr, 0, order);
+            if (attr.descriptor.semantic == "parent" && attr.descriptor.data_type == dt_int32 && attr.descriptor.data_arity == 1)
+                for (auto p = attr.data<int32_t>(); p < attr.data<int32_t>() + attr.count<int32_t>(); ++p)
+                    if (*p >= 0 && (size_t)*p < n)
+                        *p = remap[*p];
+        }
+        return remap;
+    }
+
+    /// Reorders a G3d in place so that spatially close geometry is close in memory: vertices within sub-geometries,
+    /// sub-geometries across the buffers, and instances, each sorted by Morton code of their centroid.
+    /// The reference instances are used to place sub-geometries in world space; by default these are the instances of the G3d itself.
+    inline ReorderMapping reorder_spatially(G3d& g, const InstanceView& reference_instances, const ReorderOptions& options = {})
+    {
+        MeshView mesh(g);
+        mesh.validate();
+        // Check every attribute that is permuted against the count it is permuted by, before anything is changed
+        const auto num_instances = InstanceView::from_g3d(g).count;
+        for (auto& attr : g.attributes)
+        {
+            auto a = attr.descriptor.association;
+            if ((a == assoc_vertex && attr.num_elements() < mesh.num_vertices)
+                || (a == assoc_subgeo && attr.num_elements() < mesh.num_subgeos)
+                || (a == assoc_instance && attr.num_elements() < num_instances))
+                throw runtime_error("The attribute " + attr.descriptor.to_string() + " has fewer elements than the geometry it is associated with");
+        }
+
+        ReorderMapping r;
+        if (options.vertices)
+            reorder_vertices(g, mesh);
+        if (options.subgeos)
+            r.subgeos = reorder_subgeos(g, mesh, reference_instances);
+        else {
+            r.subgeos.resize(mesh.num_subgeos);
+            iota(r.subgeos.begin(), r.subgeos.end(), 0);
+        }
+        if (options.instances)
+            r.instances = reorder_instances(g, mesh);
+        else {
+            r.instances.resize(InstanceView::from_g3d(g).count);
+            iota(r.instances.begin(), r.instances.end(), 0);
+        }
+        return r;
+    }
+
+    inline ReorderMapping reorder_spatially(G3d& g, const ReorderOptions& options = {})
+    {
+        return reorder_spatially(g, InstanceView::from_g3d(g), options);
+    }
+}
+
+namespace Vim
+{
+    /// Reorders the scene geometry spatially (see g3d::reorder_spatially), placing sub-geometries by the transforms of the nodes that reference them,
+    /// and remaps SceneNode::mGeometry. Instances are left in node order because entity tables refer to nodes by index.
+    inline g3d::ReorderMapping ReorderSpatially(Scene& scene, g3d::ReorderOptions options = {})
+    {
+        options.instances = false;
+        WorldInstances world(scene);
+        auto& nodes = world.View();
+        auto mapping = g3d::reorder_spatially(scene.mGeometry, nodes, options);
+        for (auto& node : scene.mNodes)
+            if (node.mGeometry >= 0 && (size_t)node.mGeometry < mapping.subgeos.size())
+                node.mGeometry = mapping.subgeos[node.mGeometry];
+        return mapping;
+    }
+}
+
+#endif
@@ -0,0 +1,433 @@
+/*
+    Packed R-Tree over Axis-Aligned Boxes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __RTREE_H__
+#define __RTREE_H__
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "bits.h"
+#include "geometry.h"
+#include "parallel.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    enum RTreePacking
+    {
+        rtree_hilbert,  // leaves are runs of boxes along the Hilbert curve through their centers
+        rtree_str,      // leaves are tiles of boxes sorted into slabs along x, slices along y, then along z (Sort-Tile-Recursive)
+    };
+
+    /// A node of an R-tree: the boxes of up to 8 entries, stored by coordinate so that all of them are tested at once.
+    /// The entries of an internal node are the nodes first to first + count; those of a leaf are the items first to first + count.
+    struct RTreeNode
+    {
+        float min_x[8], min_y[8], min_z[8];
+        float max_x[8], max_y[8], max_z[8];
+        int32_t first;
+        int32_t count;
+
+        AABox box(int i) const { return { { min_x[i], min_y[i], min_z[i] }, { max_x[i], max_y[i], max_z[i] } }; }
+
+        void set_box(int i, const AABox& b) {
+            min_x[i] = b.min.x; min_y[i] = b.min.y; min_z[i] = b.min.z;
+            max_x[i] = b.max.x; max_y[i] = b.max.y; max_z[i] = b.max.z;
+        }
+
+        AABox bounds() const {
+            AABox r;
+            for (auto i = 0; i < count; ++i)
+                r.merge(box(i));
+            return r;
+        }
+    };
+
+    /// A static R-tree, bulk-loaded by sorting the boxes so that every node is full except the last of each level.
+    /// The nodes are stored level by level from the root, so the tree is a flat array that can be saved and reused as is.
+    /// Each node holds the boxes of its 8 entries, so a query tests all of them with a few SIMD comparisons instead of visiting the entries.
+    /// The items of the leaves are the indices of the boxes, and the leaf boxes are the boxes themselves, so query results are exact.
+    struct RTree
+    {
+        static const int fanout = 8;
+
+        vector<RTreeNode> nodes;
+        vector<int32_t> items;
+        /// The nodes from this one on are leaves
+        int32_t first_leaf = 0;
+
+        bool empty() const { return nodes.empty(); }
+        bool is_leaf(int32_t node) const { return node >= first_leaf; }
+        AABox bounds() const { return empty() ? AABox() : nodes[0].bounds(); }
+
+        /// Builds a tree over the given boxes. Empty boxes are left out. The keys, sorts and levels are computed in parallel.
+        static RTree build(const vector<AABox>& boxes, RTreePacking packing = rtree_hilbert)
+        {
+            RTree r;
+            for (size_t i = 0; i < boxes.size(); ++i)
+                if (!boxes[i].is_empty())
+                    r.items.push_back((int32_t)i);
+            if (r.items.empty())
+                return r;
+            if (packing == rtree_str)
+                r.sort_tiles(boxes);
+            else
+                r.sort_hilbert(boxes);
+
+            vector<size_t> sizes, offsets;
+            levels(r.items.size(), sizes, offsets);
+            r.nodes.resize(offsets[0] + sizes[0]);
+            r.first_leaf = (int32_t)offsets[0];
+
+            parallel_for(sizes[0], [&](size_t j) {
+                auto& n = r.nodes[offsets[0] + j];
+                n.first = (int32_t)(j * fanout);
+                n.count = (int32_t)min<size_t>(fanout, r.items.size() - j * fanout);
+                for (auto i = 0; i < fanout; ++i)
+                    n.set_box(i, i < n.count ? boxes[r.items[n.first + i]] : AABox());
+            }, 1024);
+            for (size_t level = 1; level < sizes.size(); ++level) {
+                parallel_for(sizes[level], [&](size_t j) {
+                    auto& n = r.nodes[offsets[level] + j];
+                    n.first = (int32_t)(offsets[level - 1] + j * fanout);
+                    n.count = (int32_t)min<size_t>(fanout, sizes[level - 1] - j * fanout);
+                    for (auto i = 0; i < fanout; ++i)
+                        n.set_box(i, i < n.count ? r.nodes[n.first + i].bounds() : AABox());
+                }, 256);
+            }
+            return r;
+        }
+
+        /// Calls f(item) for each item whose box intersects the given box
+        template<typename F>
+        void intersecting(const AABox& box, F f) const
+        {
+            search([&](const RTreeNode& n) { return intersect_mask(n, box); },
+                [&](const RTreeNode& n) { return intersect_mask(n, box); }, f);
+        }
+
+        /// Calls f(item) for each item whose box is inside the given box
+        template<typename F>
+        void contained_in(const AABox& box, F f) const
+        {
+            search([&](const RTreeNode& n) { return intersect_mask(n, box); },
+                [&](const RTreeNode& n) { return contained_mask(n, box); }, f);
+        }
+
+        /// Calls f(item) for each item whose box contains the given point
+        template<typename F>
+        void containing(const Vector3& p, F f) const
+        {
+            const AABox box = { p, p };
+            search([&](const RTreeNode& n) { return intersect_mask(n, box); },
+                [&](const RTreeNode& n) { return intersect_mask(n, box); }, f);
+        }
+
+        /// Calls f(item) for each item whose box is within the given distance of a point
+        template<typename F>
+        void within_distance(const Vector3& p, float distance, F f) const
+        {
+            const auto d2 = distance * distance;
+            search([&](const RTreeNode& n) { return distance_mask(n, p, d2); },
+                [&](const RTreeNode& n) { return distance_mask(n, p, d2); }, f);
+        }
+
+        /// The items whose boxes intersect the given box, in ascending order
+        vector<int32_t> intersecting(const AABox& box) const { return collect([&](vector<int32_t>& r) { intersecting(box, [&](int32_t i) { r.push_back(i); }); }); }
+        /// The items whose boxes are inside the given box, in ascending order
+        vector<int32_t> contained_in(const AABox& box) const { return collect([&](vector<int32_t>& r) { contained_in(box, [&](int32_t i) { r.push_back(i); }); }); }
+        /// The items whose boxes contain the given point, in ascending order
+        vector<int32_t> containing(const Vector3& p) const { return collect([&](vector<int32_t>& r) { containing(p, [&](int32_t i) { r.push_back(i); }); }); }
+        /// The items whose boxes are within the given distance of a point, in ascending order
+        vector<int32_t> within_distance(const Vector3& p, float distance) const { return collect([&](vector<int32_t>& r) { within_distance(p, distance, [&](int32_t i) { r.push_back(i); }); }); }
+
+        /// The items of at most k boxes nearest to a point and no farther than max_distance, nearest first. Boxes that contain the point are at distance 0.
+        /// Nodes are visited best first, by the distance of their boxes, and the search stops once k items are closer than every node left.
+        vector<int32_t> nearest(const Vector3& p, size_t k, float max_distance = FLT_MAX) const
+        {
+            vector<int32_t> r;
+            if (empty() || k == 0)
+                return r;
+            const auto limit = max_distance >= FLT_MAX ? FLT_MAX : max_distance * max_distance;
+            // Entries are nodes, or items encoded as -1 - item. Nearer entries come first, and items come before nodes at the same distance.
+            typedef pair<float, int64_t> Entry;
+            priority_queue<Entry, vector<Entry>, greater<Entry>> queue;
+            queue.push({ 0.0f, 0 });
+            float d[fanout];
+            while (!queue.empty() && r.size() < k) {
+                auto e = queue.top();
+                queue.pop();
+                if (e.second < 0) {
+                    r.push_back((int32_t)(-1 - e.second));
+                    continue;
+                }
+                auto node = (int32_t)e.second;
+                const auto& n = nodes[node];
+                distances(n, p, d);
+                for (auto i = 0; i < n.count; ++i)
+                    if (d[i] <= limit)
+                        queue.push({ d[i], is_leaf(node) ? -1 - (int64_t)items[n.first + i] : (int64_t)(n.first + i) });
+            }
+            return r;
+        }
+
+        /// Runs a query for each of the given boxes in parallel, and returns the items of each
+        vector<vector<int32_t>> intersecting(const vector<AABox>& boxes) const
+        {
+            vector<vector<int32_t>> r(boxes.size());
+            parallel_for(boxes.size(), [&](size_t i) { r[i] = intersecting(boxes[i]); }, 16);
+            return r;
+        }
+
+        vector<vector<int32_t>> contained_in(const vector<AABox>& boxes) const
+        {
+            vector<vector<int32_t>> r(boxes.size());
+            parallel_for(boxes.size(), [&](size_t i) { r[i] = contained_in(boxes[i]); }, 16);
+            return r;
+        }
+
+        vector<vector<int32_t>> nearest(const vector<Vector3>& points, size_t k, float max_distance = FLT_MAX) const
+        {
+            vector<vector<int32_t>> r(points.size());
+            parallel_for(points.size(), [&](size_t i) { r[i] = nearest(points[i], k, max_distance); }, 16);
+            return r;
+        }
+
+        /// Serializes the nodes and items
+        vector<uint8_t> save() const
+        {
+            const uint64_t header[4] = { magic, nodes.size(), items.size(), (uint64_t)first_leaf };
+            vector<uint8_t> r(sizeof(header) + nodes.size() * sizeof(RTreeNode) + items.size() * sizeof(int32_t));
+            memcpy(r.data(), header, sizeof(header));
+            if (!nodes.empty())
+                memcpy(r.data() + sizeof(header), nodes.data(), nodes.size() * sizeof(RTreeNode));
+            if (!items.empty())
+                memcpy(r.data() + sizeof(header) + nodes.size() * sizeof(RTreeNode), items.data(), items.size() * sizeof(int32_t));
+            return r;
+        }
+
+        /// Reads a tree written by save over the given number of boxes. Returns false, leaving the tree unchanged, if the data is not such a tree:
+        /// the nodes must have the layout that build gives to the number of items, and every item must be a box.
+        bool load(const uint8_t* data, size_t size, size_t num_boxes)
+        {
+            uint64_t header[4];
+            if (size < sizeof(header))
+                return false;
+            memcpy(header, data, sizeof(header));
+            if (header[0] != magic || header[1] > size / sizeof(RTreeNode) || header[2] > size / sizeof(int32_t) || header[3] > header[1]
+                || size != sizeof(header) + header[1] * sizeof(RTreeNode) + header[2] * sizeof(int32_t))
+                return false;
+            vector<RTreeNode> saved_nodes((size_t)header[1]);
+            vector<int32_t> saved_items((size_t)header[2]);
+            if (!saved_nodes.empty())
+                memcpy(saved_nodes.data(), data + sizeof(header), saved_nodes.size() * sizeof(RTreeNode));
+            if (!saved_items.empty())
+                memcpy(saved_items.data(), data + sizeof(header) + saved_nodes.size() * sizeof(RTreeNode), saved_items.size() * sizeof(int32_t));
+
+            for (auto i : saved_items)
+                if (i < 0 || (size_t)i >= num_boxes)
+                    return false;
+            if (saved_items.empty() ? !saved_nodes.empty() || header[3] != 0 : !valid_layout(saved_nodes, saved_items.size(), (size_t)header[3]))
+                return false;
+            nodes.swap(saved_nodes);
+            items.swap(saved_items);
+            first_leaf = (int32_t)header[3];
+            return true;
+        }
+
+    private:
+        static const uint64_t magic = 0x3145455254524733ull;
+
+        /// The number of nodes of each level of a tree over the given number of items, from the leaves up, and the first node of each level
+        static void levels(size_t num_items, vector<size_t>& sizes, vector<size_t>& offsets)
+        {
+            sizes.assign(1, (num_items + fanout - 1) / fanout);
+            while (sizes.back() > 1)
+                sizes.push_back((sizes.back() + fanout - 1) / fanout);
+            offsets.assign(sizes.size(), 0);
+            for (auto level = sizes.size() - 1; level-- > 0;)
+                offsets[level] = offsets[level + 1] + sizes[level + 1];
+        }
+
+        /// Checks that the nodes have the entries that build gives them for the number of items, so that every entry is in range and the tree is as deep as expected
+        static bool valid_layout(const vector<RTreeNode>& nodes, size_t num_items, size_t first_leaf)
+        {
+            vector<size_t> sizes, offsets;
+            levels(num_items, sizes, offsets);
+            if (nodes.size() != offsets[0] + sizes[0] || first_leaf != offsets[0])
+                return false;
+            for (size_t level = 0; level < sizes.size(); ++level) {
+                const auto num_entries = level == 0 ? num_items : sizes[level - 1];
+                const auto first_entry = level == 0 ? 0 : offsets[level - 1];
+                for (size_t j = 0; j < sizes[level]; ++j) {
+                    auto& n = nodes[offsets[level] + j];
+                    if (n.first != (int32_t)(first_entry + j * fanout) || n.count != (int32_t)min<size_t>(fanout, num_entries - j * fanout))
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        /// Walks the tree from the root. node_mask(n) and leaf_mask(n) return a bit for each entry of the node to descend into or to report.
+        template<typename NodeMask, typename LeafMask, typename F>
+        void search(NodeMask node_mask, LeafMask leaf_mask, F f) const
+        {
+            if (empty())
+                return;
+            // The tree has at most 11 levels for 2^31 items, each of which leaves at most 7 siblings on the stack
+            int32_t stack[fanout * 12];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0) {
+                auto node = stack[--top];
+                const auto& n = nodes[node];
+                const auto valid = (1u << n.count) - 1;
+                if (is_leaf(node)) {
+                    for (auto m = leaf_mask(n) & valid; m != 0; m &= m - 1)
+                        f(items[n.first + count_trailing_zeros(m)]);
+                    continue;
+                }
+                for (auto m = node_mask(n) & valid; m != 0; m &= m - 1)
+                    stack[top++] = n.first + count_trailing_zeros(m);
+            }
+        }
+
+        template<typename Query>
+        static vector<int32_t> collect(Query query)
+        {
+            vector<int32_t> r;
+            query(r);
+            sort(r.begin(), r.end());
+            return r;
+        }
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+        static uint32_t intersect_mask(const RTreeNode& n, const AABox& b)
+        {
+            auto m = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(n.min_x), _mm256_set1_ps(b.max.x), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_set1_ps(b.min.x), _mm256_loadu_ps(n.max_x), _CMP_LE_OQ));
+            m = _mm256_and_ps(m, _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(n.min_y), _mm256_set1_ps(b.max.y), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_set1_ps(b.min.y), _mm256_loadu_ps(n.max_y), _CMP_LE_OQ)));
+            m = _mm256_and_ps(m, _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(n.min_z), _mm256_set1_ps(b.max.z), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_set1_ps(b.min.z), _mm256_loadu_ps(n.max_z), _CMP_LE_OQ)));
+            return (uint32_t)_mm256_movemask_ps(m);
+        }
+
+        static uint32_t contained_mask(const RTreeNode& n, const AABox& b)
+        {
+            auto m = _mm256_and_ps(_mm256_cmp_ps(_mm256_set1_ps(b.min.x), _mm256_loadu_ps(n.min_x), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_loadu_ps(n.max_x), _mm256_set1_ps(b.max.x), _CMP_LE_OQ));
+            m = _mm256_and_ps(m, _mm256_and_ps(_mm256_cmp_ps(_mm256_set1_ps(b.min.y), _mm256_loadu_ps(n.min_y), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_loadu_ps(n.max_y), _mm256_set1_ps(b.max.y), _CMP_LE_OQ)));
+            m = _mm256_and_ps(m, _mm256_and_ps(_mm256_cmp_ps(_mm256_set1_ps(b.min.z), _mm256_loadu_ps(n.min_z), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_loadu_ps(n.max_z), _mm256_set1_ps(b.max.z), _CMP_LE_OQ)));
+            return (uint32_t)_mm256_movemask_ps(m);
+        }
+
+        static __m256 axis_distance(const float* lo, const float* hi, float p)
+        {
+            auto v = _mm256_set1_ps(p);
+            auto d = _mm256_max_ps(_mm256_setzero_ps(), _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(lo), v), _mm256_sub_ps(v, _mm256_loadu_ps(hi))));
+            return _mm256_mul_ps(d, d);
+        }
+
+        static void distances(const RTreeNode& n, const Vector3& p, float* d)
+        {
+            auto r = _mm256_add_ps(axis_distance(n.min_x, n.max_x, p.x), _mm256_add_ps(axis_distance(n.min_y, n.max_y, p.y), axis_distance(n.min_z, n.max_z, p.z)));
+            _mm256_storeu_ps(d, r);
+        }
+
+        static uint32_t distance_mask(const RTreeNode& n, const Vector3& p, float d2)
+        {
+            float d[fanout];
+            distances(n, p, d);
+            return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(d), _mm256_set1_ps(d2), _CMP_LE_OQ));
+        }
+#else
+        static uint32_t intersect_mask(const RTreeNode& n, const AABox& b)
+        {
+            uint32_t r = 0;
+            for (auto i = 0; i < fanout; ++i)
+                if (b.intersects(n.box(i)))
+                    r |= 1u << i;
+            return r;
+        }
+
+        static uint32_t contained_mask(const RTreeNode& n, const AABox& b)
+        {
+            uint32_t r = 0;
+            for (auto i = 0; i < fanout; ++i)
+                if (b.contains(n.box(i)))
+                    r |= 1u << i;
+            return r;
+        }
+
+        static void distances(const RTreeNode& n, const Vector3& p, float* d)
+        {
+            for (auto i = 0; i < fanout; ++i)
+                d[i] = n.box(i).distance_squared(p);
+        }
+
+        static uint32_t distance_mask(const RTreeNode& n, const Vector3& p, float d2)
+        {
+            uint32_t r = 0;
+            for (auto i = 0; i < fanout; ++i)
+                if (n.box(i).distance_squared(p) <= d2)
+                    r |= 1u << i;
+            return r;
+        }
+#endif
+
+        /// Orders the items by the Hilbert code of their centers
+        void sort_hilbert(const vector<AABox>& boxes)
+        {
+            AABox centers;
+            for (auto i : items)
+                centers.merge(boxes[i].center());
+            vector<uint64_t> keys(items.size());
+            parallel_for(items.size(), [&](size_t i) { keys[i] = hilbert_code(boxes[items[i]].center(), centers); }, 4096);
+            radix_sort(keys, items);
+        }
+
+        /// Maps a float to an unsigned integer with the same order
+        static uint64_t float_key(float f)
+        {
+            uint32_t u;
+            memcpy(&u, &f, sizeof(u));
+            return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+        }
+
+        /// Sorts the items along x, cuts them into slabs of whole leaves, then sorts each slab along y and cuts it into slices, then sorts each slice along z.
+        /// With s slabs and slices, the leaves form an s by s by s grid of tiles.
+        void sort_tiles(const vector<AABox>& boxes)
+        {
+            const auto n = items.size();
+            const auto leaves = (n + fanout - 1) / fanout;
+            const auto s = max<size_t>(1, (size_t)ceil(cbrt((double)leaves)));
+            const auto slab = ((leaves + s - 1) / s) * fanout;
+            const auto slice = ((slab / fanout + s - 1) / s) * fanout;
+            vector<uint64_t> keys(n);
+            parallel_for(n, [&](size_t i) { keys[i] = float_key(boxes[items[i]].center().x); }, 4096);
+            radix_sort(keys, items);
+            auto by_axis = [&](int axis) {
+                return [&boxes, axis](int32_t a, int32_t b) { return boxes[a].center()[axis] < boxes[b].center()[axis]; };
+            };
+            parallel_for((n + slab - 1) / slab, [&](size_t i) {
+                auto begin = items.begin() + i * slab;
+                auto end = items.begin() + min(n, (i + 1) * slab);
+                sort(begin, end, by_axis(1));
+                for (auto b = begin; b < end; b += min<ptrdiff_t>(slice, end - b))
+                    sort(b, b + min<ptrdiff_t>(slice, end - b), by_axis(2));
+            }, 1);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,352 @@
+/*
+    Section Plane Cutting of G3D Instances and VIM Scene Nodes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __SECTION_H__
+#define __SECTION_H__
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+
+#include "geometry.h"
+#include "parallel.h"
+#include "bvh.h"
+#include "vim.h"
+#include "transforms.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    struct section_descriptors
+    {
+        static constexpr const char* SubGeoInstance = "g3d:subgeo:instance:0:int32:1";
+        static constexpr const char* SubGeoPlane = "g3d:subgeo:plane:0:int32:1";
+        static constexpr const char* SubGeoClosed = "g3d:subgeo:closed:0:int32:1";
+    };
+
+    /// The section loops of one instance, before they are gathered into a G3d
+    struct SectionLoops
+    {
+        vector<Vector3> points;
+        vector<int32_t> sizes;
+        vector<int32_t> planes;
+        vector<int32_t> closed;
+    };
+
+    /// Cuts the sub-geometries of a set of instances with a set of parallel planes: the points p with dot(normal, p) == offsets[k] in world space.
+    /// The offsets must be sorted in increasing order. A vertex on a plane is counted as above it, so every crossing triangle yields exactly one segment.
+    class SectionCutter
+    {
+    public:
+        SectionCutter(const G3d& g, const InstanceView& instances, const Vector3& normal, const vector<float>& offsets)
+            : mesh(g), instances(instances), normal(normal), offsets(offsets)
+        {
+            if (!is_sorted(offsets.begin(), offsets.end()))
+                throw runtime_error("Section plane offsets must be sorted");
+        }
+
+        /// Cuts every instance in parallel and returns the loops as a line G3d (face size 2) that owns its data.
+        /// Each loop is a sub-geometry, with the index of its instance and plane and whether it is closed as sub-geometry attributes.
+        G3d cut()
+        {
+            // Triangle BVHs for the sub-geometries of the instances that reach any of the planes
+            vector<uint8_t> needed(mesh.num_subgeos, 0);
+            vector<uint8_t> reached(instances.count, 0);
+            parallel_for(instances.count, [&](size_t i) {
+                auto s = instances.subgeo(i);
+                if (s < 0 || (size_t)s >= mesh.num_subgeos) return;
+                auto box = transform_box(instances.transform(i), mesh.subgeo_bounds(s));
+                float lo, hi;
+                project(box, normal, lo, hi);
+                auto k = first_plane_above(lo);
+                reached[i] = k < offsets.size() && offsets[k] <= hi;
+            }, 256);
+            for (size_t i = 0; i < instances.count; ++i)
+                if (reached[i])
+                    needed[instances.subgeo(i)] = 1;
+            bvhs.assign(mesh.num_subgeos, Bvh());
+            welds.assign(mesh.num_subgeos, vector<int32_t>());
+            parallel_for(mesh.num_subgeos, [&](size_t s) {
+                if (!needed[s]) return;
+                bvhs[s] = build_triangle_bvh(mesh, s);
+                welds[s] = mesh.weld_vertices(s);
+            }, 1);
+
+            vector<SectionLoops> loops(instances.count);
+            parallel_for_chunks(instances.count, 16, [&](size_t begin, size_t end) {
+                Scratch scratch;
+                for (auto i = begin; i < end; ++i)
+                    if (reached[i])
+                        cut_instance(i, scratch, loops[i]);
+            });
+            return to_g3d(loops);
+        }
+
+    private:
+        struct Segment
+        {
+            int32_t plane;
+            uint64_t keys[2];
+        };
+
+        // Buffers reused across the instances processed by a thread, so that segments are not allocated one by one
+        struct Scratch
+        {
+            vector<int32_t> triangles;
+            vector<Segment> segments;
+            vector<int32_t> plane_counts;
+            vector<Segment> sorted;
+            unordered_map<uint64_t, pair<int32_t, int32_t>> ends;
+            vector<uint8_t> used;
+            vector<uint64_t> chain;
+        };
+
+        MeshView mesh;
+        InstanceView instances;
+        Vector3 normal;
+        vector<float> offsets;
+        vector<Bvh> bvhs;
+        vector<vector<int32_t>> welds;
+
+        static void project(const AABox& box, const Vector3& n, float& lo, float& hi)
+        {
+            lo = hi = 0;
+            for (auto i = 0; i < 3; ++i) {
+                auto a = n[i] * box.min[i], b = n[i] * box.max[i];
+                lo += min(a, b);
+                hi += max(a, b);
+            }
+        }
+
+        /// The index of the first plane whose offset is greater than x
+        size_t first_plane_above(float x) const
+        {
+            return upper_bound(offsets.begin(), offsets.end(), x) - offsets.begin();
+        }
+
+        /// An edge is identified by its welded end vertices, smallest first
+        static uint64_t edge_key(int32_t a, int32_t b)
+        {
+            if (a > b) swap(a, b);
+            return (uint64_t)(uint32_t)a << 32 | (uint32_t)b;
+        }
+
+        void cut_instance(size_t instance, Scratch& scratch, SectionLoops& out)
+        {
+            auto s = instances.subgeo(instance);
+            auto m = instances.transform(instance);
+            const auto& weld = welds[s];
+            const auto vb = mesh.vertex_begin(s);
+
+            // Planes in local space: dot(local_normal, p) == offsets[k] - shift
+            Vector3 local_normal = {
+                m[0] * normal.x + m[1] * normal.y + m[2] * normal.z,
+                m[4] * normal.x + m[5] * normal.y + m[6] * normal.z,
+                m[8] * normal.x + m[9] * normal.y + m[10] * normal.z };
+            auto shift = m[12] * normal.x + m[13] * normal.y + m[14] * normal.z;
+
+            scratch.triangles.clear();
+            auto collect = [&](int32_t t) { scratch.triangles.push_back(t); };
+            bvhs[s].traverse([&](const AABox& box) {
+                float lo, hi;
+                project(box, local_normal, lo, hi);
+                auto k = first_plane_above(lo + shift);
+                return k < offsets.size() && offsets[k] <= hi + shift ? 1 : 0;
+            }, collect, collect);
+
+            // Intersect the triangles with the planes in blocks, in structure-of-arrays layout so that the projections are vectorized
+            const size_t block = 64;
+            int32_t v[3][block];
+            float d[3][block], lo[block], hi[block];
+            scratch.segments.clear();
+            for (size_t begin = 0; begin < scratch.triangles.size(); begin += block) {
+                auto n = min(block, scratch.triangles.size() - begin);
+                for (size_t l = 0; l < n; ++l) {
+                    size_t c[3];
+                    mesh.triangle_corners(s, scratch.triangles[begin + l], c);
+                    for (auto k = 0; k < 3; ++k)
+                        v[k][l] = weld[mesh.index(c[k]) - vb];
+                }
+                for (auto k = 0; k < 3; ++k)
+                    for (size_t l = 0; l < n; ++l) {
+                        const auto& p = mesh.vertices[v[k][l]];
+                        d[k][l] = local_normal.x * p.x + local_normal.y * p.y + local_normal.z * p.z + shift;
+                    }
+                for (size_t l = 0; l < n; ++l) {
+                    lo[l] = min(d[0][l], min(d[1][l], d[2][l]));
+                    hi[l] = max(d[0][l], max(d[1][l], d[2][l]));
+                }
+                for (size_t l = 0; l < n; ++l) {
+                    for (auto k = first_plane_above(lo[l]); k < offsets.size() && offsets[k] <= hi[l]; ++k) {
+                        Segment seg;
+                        seg.plane = (int32_t)k;
+                        auto e = 0;
+                        for (auto j = 0; j < 3; ++j) {
+                            auto next = (j + 1) % 3;
+                            if ((d[j][l] >= offsets[k]) != (d[next][l] >= offsets[k]))
+                                seg.keys[e++] = edge_key(v[j][l], v[next][l]);
+                        }
+                        if (e == 2 && seg.keys[0] != seg.keys[1])
+                            scratch.segments.push_back(seg);
+                    }
+                }
+            }
+
+            // Group the segments by plane with a counting sort
+            scratch.plane_counts.assign(offsets.size() + 1, 0);
+            for (auto& seg : scratch.segments)
+                scratch.plane_counts[seg.plane + 1]++;
+            partial_sum(scratch.plane_counts.begin(), scratch.plane_counts.end(), scratch.plane_counts.begin());
+            scratch.sorted.resize(scratch.segments.size());
+            {
+                auto next = scratch.plane_counts;
+                for (auto& seg : scratch.segments)
+                    scratch.sorted[next[seg.plane]++] = seg;
+            }
+
+            for (size_t k = 0; k < offsets.size(); ++k) {
+                auto first = scratch.plane_counts[k], last = scratch.plane_counts[k + 1];
+                if (first < last)
+                    stitch(scratch, first, last, (int32_t)k, m, local_normal, offsets[k] - shift, out);
+            }
+        }
+
+        /// Joins the segments [first, last) of one plane into chains through their shared edge keys. Open chains are walked from their ends first.
+        /// Where more than two segments meet at an edge (non-manifold geometry), only two of them are joined.
+        void stitch(Scratch& scratch, int32_t first, int32_t last, int32_t plane, const float* m, const Vector3& local_normal, float local_offset, SectionLoops& out)
+        {
+            auto& ends = scratch.ends;
+            ends.clear();
+            for (auto i = first; i < last; ++i)
+                for (auto key : scratch.sorted[i].keys) {
+                    auto it = ends.emplace(key, make_pair(i, -1)).first;
+                    if (it->second.first != i && it->second.second < 0)
+                        it->second.second = i;
+                }
+            scratch.used.assign(last - first, 0);
+
+            auto other_segment = [&](uint64_t key, int32_t seg) {
+                auto& e = ends[key];
+                auto r = e.first == seg ? e.second : e.first;
+                return r >= 0 && !scratch.used[r - first] ? r : -1;
+            };
+
+            auto walk = [&](int32_t seg, uint64_t start) {
+                scratch.chain.clear();
+                scratch.chain.push_back(start);
+                auto key = start;
+                auto closed = false;
+                while (seg >= 0) {
+                    scratch.used[seg - first] = 1;
+                    const auto& keys = scratch.sorted[seg].keys;
+                    key = keys[0] == key ? keys[1] : keys[0];
+                    if (key == start) {
+                        closed = true;
+                        break;
+                    }
+                    scratch.chain.push_back(key);
+                    seg = other_segment(key, seg);
+                }
+                for (auto k : scratch.chain)
+                    out.points.push_back(edge_point(k, m, local_normal, local_offset));
+                out.sizes.push_back((int32_t)scratch.chain.size());
+                out.planes.push_back(plane);
+                out.closed.push_back(closed ? 1 : 0);
+            };
+
+            for (auto i = first; i < last; ++i)
+                for (auto key : scratch.sorted[i].keys)
+                    if (!scratch.used[i - first] && ends[key].second < 0)
+                        walk(i, key);
+            for (auto i = first; i < last; ++i)
+                if (!scratch.used[i - first])
+                    walk(i, scratch.sorted[i].keys[0]);
+        }
+
+        /// The world-space point where the edge crosses the plane. It only depends on the edge, so segments that share an edge share the point exactly.
+        Vector3 edge_point(uint64_t key, const float* m, const Vector3& local_normal, float local_offset) const
+        {
+            const auto& a = mesh.vertices[key >> 32];
+            const auto& b = mesh.vertices[key & 0xFFFFFFFF];
+            auto da = dot(local_normal, a), db = dot(local_normal, b);
+            auto t = da != db ? (local_offset - da) / (db - da) : 0.0f;
+            return transform_point(m, a + (b - a) * std::min(std::max(t, 0.0f), 1.0f));
+        }
+
+        G3d to_g3d(const vector<SectionLoops>& loops) const
+        {
+            size_t num_points = 0, num_indices = 0, num_loops = 0;
+            for (auto& l : loops) {
+                num_points += l.points.size();
+                num_loops += l.sizes.size();
+                for (size_t j = 0; j < l.sizes.size(); ++j)
+                    num_indices += 2 * (l.closed[j] ? l.sizes[j] : l.sizes[j] - 1);
+            }
+
+            G3d g;
+            auto points = g.add_owned_attribute<Vector3>(descriptors::Position, num_points);
+            auto indices = g.add_owned_attribute<int32_t>(descriptors::Index, num_indices);
+            *g.add_owned_attribute<int32_t>(descriptors::ObjectFaceSize, 1) = 2;
+            auto vertex_offsets = g.add_owned_attribute<int32_t>(descriptors::SubGeoVertexOffset, num_loops);
+            auto index_offsets = g.add_owned_attribute<int32_t>(descriptors::SubGeoIndexOffset, num_loops);
+            auto loop_instances = g.add_owned_attribute<int32_t>(section_descriptors::SubGeoInstance, num_loops);
+            auto loop_planes = g.add_owned_attribute<int32_t>(section_descriptors::SubGeoPlane, num_loops);
+            auto loop_closed = g.add_owned_attribute<int32_t>(section_descriptors::SubGeoClosed, num_loops);
+
+            size_t p = 0, x = 0, n = 0;
+            for (size_t i = 0; i < loops.size(); ++i) {
+                const auto& l = loops[i];
+                copy(l.points.begin(), l.points.end(), points + p);
+                auto base = p;
+                for (size_t j = 0; j < l.sizes.size(); ++j, ++n) {
+                    vertex_offsets[n] = (int32_t)p;
+                    index_offsets[n] = (int32_t)x;
+                    loop_instances[n] = (int32_t)i;
+                    loop_planes[n] = l.planes[j];
+                    loop_closed[n] = l.closed[j];
+                    auto size = l.sizes[j];
+                    for (auto k = 0; k + 1 < size; ++k) {
+                        indices[x++] = (int32_t)(p + k);
+                        indices[x++] = (int32_t)(p + k + 1);
+                    }
+                    if (l.closed[j]) {
+                        indices[x++] = (int32_t)(p + size - 1);
+                        indices[x++] = (int32_t)p;
+                    }
+                    p += size;
+                }
+                if (p != base + l.points.size())
+                    throw runtime_error("Section loop sizes don't match the number of points");
+            }
+            return g;
+        }
+    };
+
+    /// Cuts the instances with parallel planes in one pass (see SectionCutter)
+    inline G3d section(const G3d& g, const InstanceView& instances, const Vector3& normal, const vector<float>& offsets)
+    {
+        return SectionCutter(g, instances, normal, offsets).cut();
+    }
+
+    /// Cuts a G3d with parallel planes. Its instances are cut if it has any, otherwise each sub-geometry is cut in place.
+    inline G3d section(const G3d& g, const Vector3& normal, const vector<float>& offsets)
+    {
+        return section(g, InstanceView::from_g3d_or_subgeos(g), normal, offsets);
+    }
+}
+
+namespace Vim
+{
+    /// Cuts the scene with parallel planes (see g3d::SectionCutter). The instance of each loop is the index of its scene node.
+    inline g3d::G3d SectionScene(const Scene& scene, const g3d::Vector3& normal, const std::vector<float>& offsets)
+    {
+        return g3d::section(scene.mGeometry, WorldInstances(scene).View(), normal, offsets);
+    }
+}
+
+#endif
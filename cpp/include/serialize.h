@@ -0,0 +1,55 @@
+/*
+    Serialization Helpers of Derived VIM Indexes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __SERIALIZE_H__
+#define __SERIALIZE_H__
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include "bfast.h"
+
+namespace Vim
+{
+    /// Appends raw bytes to serialized data
+    inline void AppendBytes(std::vector<uint8_t>& r, const void* data, size_t size)
+    {
+        r.insert(r.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+    }
+
+    /// Copies raw bytes out of serialized data, and returns the position after them
+    inline const bfast::byte* ExtractBytes(const bfast::byte* p, void* data, size_t size)
+    {
+        if (size > 0)
+            memcpy(data, p, size);
+        return p + size;
+    }
+
+    /// Writes serialized data to a file, replacing it
+    inline void SaveBytesFile(const std::string& path, const std::vector<uint8_t>& data)
+    {
+        std::ofstream f(path, std::ios_base::out | std::ios_base::binary);
+        if (!f.write((const char*)data.data(), data.size()))
+            throw std::runtime_error("Couldn't write file " + path);
+    }
+
+    /// Reads a whole file. Returns false if it can't be opened.
+    inline bool LoadBytesFile(const std::string& path, std::vector<uint8_t>& data)
+    {
+        std::ifstream f(path, std::ios_base::in | std::ios_base::binary);
+        if (!f.is_open())
+            return false;
+        data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,424 @@
+/*
+    Sidecar Files of Derived VIM Indexes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __SIDECAR_H__
+#define __SIDECAR_H__
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <unordered_map>
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <utility>
+
+#include "bfast.h"
+#include "mapped.h"
+#include "parallel.h"
+#include "geometry.h"
+#include "bvh.h"
+#include "rtree.h"
+#include "vim.h"
+#include "vimview.h"
+#include "stringtable.h"
+#include "textindex.h"
+#include "properties.h"
+#include "transforms.h"
+
+namespace Vim
+{
+    /// Identifies the contents of a VIM file: its size and modification time, which are checked first, and a fingerprint of each of its buffers,
+    /// which are checked when the modification time differs, so that a copied or touched file keeps its sidecar.
+    struct SidecarKey
+    {
+        static const uint64_t Magic = 0x5241434544495356ull;
+        static const uint64_t Version = 3;
+
+        uint64_t mFileSize = 0;
+        int64_t mModifiedTime = 0;
+        std::vector<uint64_t> mChecksums;
+
+        /// The size and modification time of a file, without checksums
+        static SidecarKey Stat(const std::string& path)
+        {
+            SidecarKey r;
+            r.mFileSize = (uint64_t)std::filesystem::file_size(path);
+            r.mModifiedTime = (int64_t)std::filesystem::last_write_time(path).time_since_epoch().count();
+            return r;
+        }
+
+        /// The fingerprints of the buffers of a BFAST, computed in parallel
+        static std::vector<uint64_t> Checksums(const bfast::ByteRange& data)
+        {
+            auto b = bfast::Bfast::unpack(data);
+            std::vector<uint64_t> r(b.buffers.size());
+            g3d::parallel_for(r.size(), [&](size_t i) { r[i] = Fingerprint(b.buffers[i].data.begin(), b.buffers[i].data.size()); }, 1);
+            return r;
+        }
+
+        std::vector<uint8_t> Save() const
+        {
+            std::vector<uint64_t> words = { Magic, Version, mFileSize, (uint64_t)mModifiedTime, (uint64_t)mChecksums.size() };
+            words.insert(words.end(), mChecksums.begin(), mChecksums.end());
+            std::vector<uint8_t> r(words.size() * sizeof(uint64_t));
+            memcpy(r.data(), words.data(), r.size());
+            return r;
+        }
+
+        /// Reads a saved key. Returns false if the data isn't a key of this version.
+        bool Load(const bfast::ByteRange& data)
+        {
+            auto words = Span<uint64_t>::FromBytes(data);
+            if (words.size() < 5 || words[0] != Magic || words[1] != Version || words.size() != 5 + words[4])
+                return false;
+            mFileSize = words[2];
+            mModifiedTime = (int64_t)words[3];
+            mChecksums.assign(words.begin() + 5, words.end());
+            return true;
+        }
+    };
+
+    /// A BFAST next to a VIM file that stores indexes derived from it, so that they are mapped instead of rebuilt when the file is opened again.
+    /// The "key" buffer identifies the VIM file it was built from; the other buffers are named by the indexes that read them.
+    class Sidecar
+    {
+    public:
+        /// The default location of the sidecar of a VIM file
+        static std::string PathOf(const std::string& vimPath)
+        {
+            return vimPath + ".sidecar";
+        }
+
+        /// Maps a sidecar and returns true if it was built from the VIM file as it is now. Otherwise, or if there is no readable sidecar, returns false and stays closed.
+        bool Open(const std::string& vimPath, const std::string& sidecarPath)
+        {
+            Close();
+            try
+            {
+                if (!std::filesystem::exists(sidecarPath))
+                    return false;
+                mFile.open(sidecarPath);
+                mBfast = bfast::Bfast::unpack(mFile.range());
+                SidecarKey key;
+                if (!key.Load(Find("key")) || !Matches(key, vimPath))
+                {
+                    Close();
+                    return false;
+                }
+                return true;
+            }
+            catch (const std::exception&)
+            {
+                Close();
+                return false;
+            }
+        }
+
+        void Close()
+        {
+            mBfast = bfast::Bfast();
+            mFile.close();
+        }
+
+        bool IsOpen() const { return mFile.is_open(); }
+
+        /// The bytes of a buffer, or an empty range if there is no such buffer
+        bfast::ByteRange Find(const std::string& name) const
+        {
+            for (auto& b : mBfast.buffers)
+                if (b.name == name)
+                    return b.data;
+            return bfast::ByteRange{ nullptr, nullptr };
+        }
+
+        /// Writes a sidecar. It is written to a temporary file that then replaces the sidecar, so readers never see a partial file.
+        static void Write(const std::string& sidecarPath, const SidecarKey& key, const std::vector<std::pair<std::string, std::vector<uint8_t>>>& buffers)
+        {
+            auto keyData = key.Save();
+            bfast::Bfast b;
+            b.add("key", keyData.data(), keyData.data() + keyData.size());
+            for (auto& kv : buffers)
+            {
+                auto data = const_cast<uint8_t*>(kv.second.data());
+                b.add(kv.first, data, data + kv.second.size());
+            }
+            auto bytes = b.pack();
+            auto tmp = sidecarPath + ".tmp";
+            {
+                std::ofstream f(tmp, std::ios_base::out | std::ios_base::binary);
+                if (!f.write((const char*)bytes.data(), bytes.size()))
+                    throw std::runtime_error("Couldn't write file " + tmp);
+            }
+            std::filesystem::rename(tmp, sidecarPath);
+        }
+
+    private:
+        bfast::MappedFile mFile;
+        bfast::Bfast mBfast;
+
+        static bool Matches(const SidecarKey& key, const std::string& vimPath)
+        {
+            auto current = SidecarKey::Stat(vimPath);
+            if (current.mFileSize != key.mFileSize)
+                return false;
+            if (current.mModifiedTime == key.mModifiedTime)
+                return true;
+            bfast::MappedFile vim(vimPath);
+            return SidecarKey::Checksums(vim.range()) == key.mChecksums;
+        }
+    };
+
+    /// The indexes derived from a scene: the string hash index, the trigram text index, the property index of each entity table,
+    /// the world transforms of the nodes, the world-space bounds of the nodes and a BVH and an R-tree over them. Each one is made on first use: viewed in place in the sidecar of the VIM file
+    /// when the sidecar is valid (the BVH, R-tree, text index and world transforms are copied out of it), or built otherwise. Opening with a valid sidecar only maps it.
+    /// When the sidecar is missing or stale, a background thread builds all of the indexes and writes a new one, so the next open is warm.
+    /// The scene must outlive the index.
+    class SceneIndex
+    {
+    public:
+        /// Works with a Scene or a SceneView read from vimPath
+        template<typename SceneT>
+        SceneIndex(const SceneT& scene, const std::string& vimPath, bool rebuildSidecar = true)
+            : SceneIndex(vimPath, Sidecar::PathOf(vimPath))
+        {
+            SetStrings(scene);
+            mNodes = Span<SceneNode>(scene.mNodes.data(), scene.mNodes.data() + scene.mNodes.size());
+            mGeometry = &scene.mGeometry;
+            for (auto& kv : scene.mEntityTables)
+            {
+                auto& p = mProperties[kv.first];
+                p.reset(new LazyProperties());
+                p->mSource = Span<SerializableProperty>(kv.second.mProperties.data(), kv.second.mProperties.data() + kv.second.mProperties.size());
+            }
+            if (!mWarm && rebuildSidecar)
+                mRebuild = std::thread([this]() {
+                    try { Rebuild(); }
+                    catch (...) { mRebuildError = std::current_exception(); }
+                });
+        }
+
+        SceneIndex(const SceneIndex&) = delete;
+        SceneIndex& operator=(const SceneIndex&) = delete;
+
+        ~SceneIndex()
+        {
+            if (mRebuild.joinable())
+                mRebuild.join();
+        }
+
+        /// True if the indexes come from a valid sidecar
+        bool IsWarm() const { return mWarm; }
+
+        const std::string& SidecarPath() const { return mSidecarPath; }
+
+        /// Waits for the background rebuild of the sidecar, if there is one, and rethrows its error
+        void WaitForRebuild()
+        {
+            if (mRebuild.joinable())
+                mRebuild.join();
+            if (mRebuildError)
+                std::rethrow_exception(std::exchange(mRebuildError, nullptr));
+        }
+
+        /// The string table, with its hash index
+        const StringTable& Strings() const
+        {
+            std::call_once(mStringsOnce, [&]() {
+                mStrings.reset(new StringTable(mStringBegin, mStringEnd));
+                if (!mWarm || !mStrings->ViewIndex(mSidecar.Find("strings:index")))
+                    mStrings->BuildIndex();
+            });
+            return *mStrings;
+        }
+
+        const TextIndex& Text() const
+        {
+            std::call_once(mTextOnce, [&]() {
+                mText.reset(new TextIndex(Strings()));
+                if (!mWarm || !mText->LoadIndex(mSidecar.Find("strings:text")))
+                    mText->BuildIndex();
+            });
+            return *mText;
+        }
+
+        /// The property index of an entity table
+        const PropertyIndex& Properties(const std::string& table) const
+        {
+            auto it = mProperties.find(table);
+            if (it == mProperties.end())
+                throw std::runtime_error("No entity table " + table);
+            auto& p = *it->second;
+            std::call_once(p.mOnce, [&]() {
+                if (!mWarm || !p.mIndex.View(mSidecar.Find("properties:" + table)))
+                    p.mIndex = PropertyIndex(p.mSource);
+            });
+            return p.mIndex;
+        }
+
+        /// The world transform of each node, from the local transforms of the node and of its ancestors
+        const WorldTransforms& World() const
+        {
+            std::call_once(mWorldOnce, [&]() {
+                if (!mWarm || !mWorld.Load(mNodes.data(), mNodes.size(), mSidecar.Find("nodes:world")))
+                    mWorld = WorldTransforms(mNodes.data(), mNodes.size());
+            });
+            return mWorld;
+        }
+
+        /// The world-space box of each node, which is empty for nodes without geometry
+        Span<g3d::AABox> NodeBounds() const
+        {
+            std::call_once(mBoundsOnce, [&]() {
+                auto saved = Span<g3d::AABox>::FromBytes(mSidecar.Find("nodes:bounds"));
+                if (mWarm && saved.size() == mNodes.size())
+                {
+                    mBounds = saved;
+                    return;
+                }
+                g3d::MeshView mesh(*mGeometry);
+                auto& world = World();
+                std::vector<g3d::AABox> local(mesh.num_subgeos);
+                g3d::parallel_for(local.size(), [&](size_t s) { local[s] = mesh.subgeo_bounds(s); }, 256);
+                mOwnedBounds.resize(mNodes.size());
+                g3d::parallel_for(mNodes.size(), [&](size_t i) {
+                    auto g = mNodes[i].mGeometry;
+                    float m[16];
+                    if (g >= 0 && (size_t)g < local.size())
+                    {
+                        world.GetMatrix(i, m);
+                        mOwnedBounds[i] = g3d::transform_box(m, local[g]);
+                    }
+                }, 1024);
+                mBounds = Span<g3d::AABox>(mOwnedBounds.data(), mOwnedBounds.data() + mOwnedBounds.size());
+            });
+            return mBounds;
+        }
+
+        /// A BVH over the node bounds, whose items are node indices
+        const g3d::Bvh& NodeBvh() const
+        {
+            std::call_once(mBvhOnce, [&]() {
+                auto nodes = Span<g3d::BvhNode>::FromBytes(mSidecar.Find("nodes:bvh:nodes"));
+                auto items = Span<int32_t>::FromBytes(mSidecar.Find("nodes:bvh:items"));
+                if (mWarm && !nodes.empty())
+                {
+                    mBvh.nodes = nodes.ToVector();
+                    mBvh.items = items.ToVector();
+                    return;
+                }
+                auto bounds = NodeBounds();
+                mBvh = g3d::Bvh::build(bounds.ToVector());
+            });
+            return mBvh;
+        }
+
+        /// A packed R-tree over the node bounds, whose items are node indices
+        const g3d::RTree& NodeRTree() const
+        {
+            std::call_once(mRTreeOnce, [&]() {
+                auto saved = mSidecar.Find("nodes:rtree");
+                if (!mWarm || !mRTree.load(saved.begin(), saved.size(), mNodes.size()))
+                    mRTree = g3d::RTree::build(NodeBounds().ToVector());
+            });
+            return mRTree;
+        }
+
+        /// Builds every index, and returns their data named as they are stored in the sidecar
+        std::vector<std::pair<std::string, std::vector<uint8_t>>> SaveAll() const
+        {
+            std::vector<std::pair<std::string, std::vector<uint8_t>>> r;
+            r.emplace_back("strings:index", Strings().SaveIndex());
+            r.emplace_back("strings:text", Text().SaveIndex());
+            for (auto& kv : mProperties)
+                r.emplace_back("properties:" + kv.first, Properties(kv.first).Save());
+            r.emplace_back("nodes:world", World().Save());
+            r.emplace_back("nodes:bounds", Bytes(NodeBounds().data(), NodeBounds().size()));
+            r.emplace_back("nodes:bvh:nodes", Bytes(NodeBvh().nodes.data(), NodeBvh().nodes.size()));
+            r.emplace_back("nodes:bvh:items", Bytes(NodeBvh().items.data(), NodeBvh().items.size()));
+            r.emplace_back("nodes:rtree", NodeRTree().save());
+            return r;
+        }
+
+    private:
+        struct LazyProperties
+        {
+            Span<SerializableProperty> mSource;
+            PropertyIndex mIndex;
+            std::once_flag mOnce;
+        };
+
+        std::string mVimPath;
+        std::string mSidecarPath;
+        Sidecar mSidecar;
+        bool mWarm = false;
+        std::thread mRebuild;
+        std::exception_ptr mRebuildError;
+
+        const char* mStringBegin = nullptr;
+        const char* mStringEnd = nullptr;
+        Span<SceneNode> mNodes;
+        const g3d::G3d* mGeometry = nullptr;
+
+        mutable std::unique_ptr<StringTable> mStrings;
+        mutable std::once_flag mStringsOnce;
+        mutable std::unique_ptr<TextIndex> mText;
+        mutable std::once_flag mTextOnce;
+        std::unordered_map<std::string, std::unique_ptr<LazyProperties>> mProperties;
+        mutable WorldTransforms mWorld;
+        mutable std::once_flag mWorldOnce;
+        mutable std::vector<g3d::AABox> mOwnedBounds;
+        mutable Span<g3d::AABox> mBounds;
+        mutable std::once_flag mBoundsOnce;
+        mutable g3d::Bvh mBvh;
+        mutable std::once_flag mBvhOnce;
+        mutable g3d::RTree mRTree;
+        mutable std::once_flag mRTreeOnce;
+
+        SceneIndex(const std::string& vimPath, const std::string& sidecarPath)
+            : mVimPath(vimPath), mSidecarPath(sidecarPath)
+        {
+            mWarm = mSidecar.Open(mVimPath, mSidecarPath);
+        }
+
+        void SetStrings(const Scene& scene)
+        {
+            // Scene adds a null after the strings of the file
+            if (scene.mStringData.empty())
+                return;
+            mStringBegin = (const char*)scene.mStringData.data();
+            mStringEnd = mStringBegin + scene.mStringData.size() - 1;
+        }
+
+        void SetStrings(const SceneView& scene)
+        {
+            mStringBegin = scene.mStringData.begin();
+            mStringEnd = scene.mStringData.end();
+        }
+
+        template<typename T>
+        static std::vector<uint8_t> Bytes(const T* data, size_t count)
+        {
+            return std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)(data + count));
+        }
+
+        /// Builds all of the indexes, then writes them with the key of the VIM file as it was before they were built
+        void Rebuild()
+        {
+            auto key = SidecarKey::Stat(mVimPath);
+            {
+                bfast::MappedFile vim(mVimPath);
+                key.mChecksums = SidecarKey::Checksums(vim.range());
+            }
+            Sidecar::Write(mSidecarPath, key, SaveAll());
+        }
+    };
+}
+
+#endif
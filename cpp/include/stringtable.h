@@ -0,0 +1,313 @@
+/*
+    Indexed String Table of a VIM
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __STRINGTABLE_H__
+#define __STRINGTABLE_H__
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <regex>
+
+#include "bits.h"
+#include "parallel.h"
+#include "vim.h"
+#include "vimview.h"
+#include "serialize.h"
+
+namespace Vim
+{
+    /// A 64-bit hash of a byte range (FNV-1a over 8-byte words), used to recognize data that an index was built from
+    inline uint64_t Fingerprint(const void* data, size_t size)
+    {
+        auto p = (const uint8_t*)data;
+        uint64_t h = 0xCBF29CE484222325ull ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            h = (h ^ w) * 0x100000001B3ull;
+            h ^= h >> 29;
+        }
+        for (; i < size; ++i)
+            h = (h ^ p[i]) * 0x100000001B3ull;
+        return h;
+    }
+
+    /// The strings of a VIM with their offsets and lengths, and a hash index from string to string index.
+    /// The strings are viewed in place: the string data must outlive the table.
+    /// Offsets are found with one pass of memchr (which is vectorized by the C library) over chunks of the data in parallel.
+    /// The hash index is built on the first lookup, in parallel, and can be saved so that later loads don't rebuild it.
+    class StringTable
+    {
+    public:
+        StringTable() = default;
+
+        StringTable(const char* begin, const char* end)
+            : mData(begin), mSize(end - begin)
+        {
+            ComputeOffsets();
+        }
+
+        explicit StringTable(const Scene& scene)
+            : StringTable(scene.mStringData.empty() ? nullptr : (const char*)scene.mStringData.data(),
+                scene.mStringData.empty() ? nullptr : (const char*)scene.mStringData.data() + scene.mStringData.size() - 1)
+        { }
+
+        explicit StringTable(const SceneView& scene)
+            : StringTable(scene.mStringData.begin(), scene.mStringData.end())
+        { }
+
+        StringTable(const StringTable&) = delete;
+        StringTable& operator=(const StringTable&) = delete;
+
+        size_t Size() const { return mOffsets.empty() ? 0 : mOffsets.size() - 1; }
+
+        std::string_view Get(size_t i) const
+        {
+            return std::string_view(mData + mOffsets[i], (size_t)(mOffsets[i + 1] - mOffsets[i] - 1));
+        }
+
+        std::string_view operator[](size_t i) const { return Get(i); }
+
+        size_t Length(size_t i) const { return (size_t)(mOffsets[i + 1] - mOffsets[i] - 1); }
+
+        /// The string data the table views, and its size in bytes
+        const char* Data() const { return mData; }
+        size_t DataSize() const { return mSize; }
+
+        /// Returns the index of the first string equal to s, or -1 if there is none. The first call builds the hash index.
+        int Find(std::string_view s) const
+        {
+            BuildIndex();
+            if (mSlotView.empty())
+                return -1;
+            const auto mask = mSlotView.size() - 1;
+            for (auto h = Hash(s) & mask;; h = (h + 1) & mask)
+            {
+                auto slot = mSlotView[h];
+                if (slot == 0)
+                    return -1;
+                if (Get(slot - 1) == s)
+                    return (int)(slot - 1);
+            }
+        }
+
+        /// Builds the hash index if it hasn't been built or loaded yet. Safe to call from several threads.
+        void BuildIndex() const
+        {
+            std::call_once(*mIndexOnce, [&]() {
+                if (mSlotView.empty())
+                {
+                    mSlots = ComputeIndex();
+                    mSlotView = Span<uint32_t>(mSlots.data(), mSlots.data() + mSlots.size());
+                }
+            });
+        }
+
+        /// Serializes the hash index, with a fingerprint of the strings it was built from
+        std::vector<uint8_t> SaveIndex() const
+        {
+            BuildIndex();
+            IndexHeader h = { IndexMagic, (uint64_t)Size(), (uint64_t)mSize, Fingerprint(mData, mSize), (uint64_t)mSlotView.size() };
+            std::vector<uint8_t> r(sizeof(h) + mSlotView.size() * sizeof(uint32_t));
+            memcpy(r.data(), &h, sizeof(h));
+            if (!mSlotView.empty())
+                memcpy(r.data() + sizeof(h), mSlotView.data(), mSlotView.size() * sizeof(uint32_t));
+            return r;
+        }
+
+        /// Uses a hash index saved by SaveIndex, if it was built from the same strings. Returns false, and leaves the index to be built, otherwise.
+        bool LoadIndex(const bfast::ByteRange& data)
+        {
+            return ReadIndex(data, true);
+        }
+
+        /// Uses a hash index saved by SaveIndex in place, without copying it, so the data must outlive the table.
+        /// The fingerprint of the strings is not checked: use it when the source of the strings is known to be unchanged, such as with a valid sidecar.
+        bool ViewIndex(const bfast::ByteRange& data)
+        {
+            return ReadIndex(data, false);
+        }
+
+        void SaveIndexFile(const std::string& path) const
+        {
+            SaveBytesFile(path, SaveIndex());
+        }
+
+        bool LoadIndexFile(const std::string& path)
+        {
+            std::vector<uint8_t> data;
+            return LoadBytesFile(path, data) && LoadIndex(bfast::ByteRange{ data.data(), data.data() + data.size() });
+        }
+
+        /// The set of the indices of the strings for which f(string_view) is true, tested in parallel.
+        /// Use it with Predicate::In to filter a string column by the matching indices, e.g. Col("string:Name").In(strings.Contains("Wall")).
+        template<typename F>
+        g3d::Bitset Where(F f) const
+        {
+            g3d::Bitset r(Size());
+            g3d::parallel_for(r.words.size(), [&](size_t w) {
+                uint64_t bits = 0;
+                for (size_t i = w * 64; i < std::min(Size(), w * 64 + 64); ++i)
+                    bits |= (uint64_t)(f(Get(i)) ? 1 : 0) << (i - w * 64);
+                r.words[w] = bits;
+            }, 16);
+            return r;
+        }
+
+        g3d::Bitset Equals(std::string_view s) const
+        {
+            return Where([&](std::string_view x) { return x == s; });
+        }
+
+        g3d::Bitset StartsWith(std::string_view s) const
+        {
+            return Where([&](std::string_view x) { return x.substr(0, s.size()) == s; });
+        }
+
+        g3d::Bitset Contains(std::string_view s) const
+        {
+            return Where([&](std::string_view x) { return x.find(s) != std::string_view::npos; });
+        }
+
+        /// The strings in which the regular expression matches, anywhere
+        g3d::Bitset Matches(const std::regex& re) const
+        {
+            return Where([&](std::string_view x) { return std::regex_search(x.begin(), x.end(), re); });
+        }
+
+        static uint64_t Hash(std::string_view s)
+        {
+            return Fingerprint(s.data(), s.size()) * 0x9E3779B97F4A7C15ull >> 16;
+        }
+
+    private:
+        struct IndexHeader
+        {
+            uint64_t mMagic;
+            uint64_t mCount;
+            uint64_t mDataSize;
+            uint64_t mFingerprint;
+            uint64_t mCapacity;
+        };
+
+        static const uint64_t IndexMagic = 0x5854444E49525453ull;
+
+        const char* mData = nullptr;
+        size_t mSize = 0;
+        // The offset of every string, and one past the end; the string lengths are the differences minus one, for the terminating null
+        std::vector<uint64_t> mOffsets;
+        // Open addressing hash table of string indices plus one, where zero is empty, either owned or viewed in saved data
+        mutable std::vector<uint32_t> mSlots;
+        mutable Span<uint32_t> mSlotView;
+        mutable std::unique_ptr<std::once_flag> mIndexOnce{ new std::once_flag() };
+
+        bool ReadIndex(const bfast::ByteRange& data, bool copy)
+        {
+            IndexHeader h;
+            if (data.size() < sizeof(h))
+                return false;
+            memcpy(&h, data.begin(), sizeof(h));
+            if (h.mMagic != IndexMagic || h.mCount != Size() || h.mDataSize != mSize
+                || h.mCapacity & (h.mCapacity - 1) || data.size() != sizeof(h) + h.mCapacity * sizeof(uint32_t)
+                || (copy && h.mFingerprint != Fingerprint(mData, mSize)))
+                return false;
+            auto slots = Span<uint32_t>::FromBytes(bfast::ByteRange{ data.begin() + sizeof(h), data.end() });
+            if (copy)
+            {
+                mSlots.assign(slots.begin(), slots.end());
+                slots = Span<uint32_t>(mSlots.data(), mSlots.data() + mSlots.size());
+            }
+            else
+            {
+                mSlots.clear();
+            }
+            mSlotView = slots;
+            mIndexOnce.reset(new std::once_flag());
+            return true;
+        }
+
+        void ComputeOffsets()
+        {
+            mOffsets.clear();
+            if (mSize == 0)
+            {
+                mOffsets.push_back(0);
+                return;
+            }
+            // Each chunk collects the starts of the strings that follow its nulls; the first string starts at zero
+            const size_t grain = 1 << 20;
+            const auto num_chunks = (mSize + grain - 1) / grain;
+            std::vector<std::vector<uint64_t>> starts(num_chunks);
+            g3d::parallel_for(num_chunks, [&](size_t k) {
+                auto begin = mData + k * grain;
+                auto end = mData + std::min(mSize, (k + 1) * grain);
+                auto& r = starts[k];
+                for (auto p = begin; p < end;)
+                {
+                    auto z = (const char*)memchr(p, 0, end - p);
+                    if (!z)
+                        break;
+                    r.push_back((uint64_t)(z - mData) + 1);
+                    p = z + 1;
+                }
+            }, 1);
+
+            std::vector<size_t> positions(num_chunks + 1, 1);
+            for (size_t k = 0; k < num_chunks; ++k)
+                positions[k + 1] = positions[k] + starts[k].size();
+            mOffsets.resize(positions[num_chunks]);
+            mOffsets[0] = 0;
+            g3d::parallel_for(num_chunks, [&](size_t k) {
+                std::copy(starts[k].begin(), starts[k].end(), mOffsets.begin() + positions[k]);
+            }, 1);
+            // The last string may not be terminated, in which case the end of the data ends it
+            if (mOffsets.back() != mSize)
+                mOffsets.push_back(mSize + 1);
+        }
+
+        /// Inserts the strings in parallel, keeping the lowest index of equal strings in their slot
+        std::vector<uint32_t> ComputeIndex() const
+        {
+            const auto n = Size();
+            if (n == 0)
+                return {};
+            size_t capacity = 16;
+            while (capacity < n * 2)
+                capacity *= 2;
+            const auto mask = capacity - 1;
+            std::vector<std::atomic<uint32_t>> slots(capacity);
+            g3d::parallel_for(capacity, [&](size_t i) { slots[i].store(0, std::memory_order_relaxed); }, 1 << 16);
+            g3d::parallel_for(n, [&](size_t i) {
+                const auto value = (uint32_t)i + 1;
+                const auto s = Get(i);
+                for (auto h = Hash(s) & mask;; h = (h + 1) & mask)
+                {
+                    auto cur = slots[h].load();
+                    if (cur == 0 && slots[h].compare_exchange_strong(cur, value))
+                        return;
+                    if (cur != 0 && Get(cur - 1) == s)
+                    {
+                        while (value < cur && !slots[h].compare_exchange_weak(cur, value)) {}
+                        return;
+                    }
+                }
+            }, 4096);
+            std::vector<uint32_t> r(capacity);
+            for (size_t i = 0; i < capacity; ++i)
+                r[i] = slots[i].load(std::memory_order_relaxed);
+            return r;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,483 @@
+/*
+    Catmull-Clark Subdivision of G3D Polygon Meshes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __SUBDIVIDE_H__
+#define __SUBDIVIDE_H__
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "geometry.h"
+#include "parallel.h"
+#include "vim.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// A sparse matrix in compressed rows: each refined value is the weighted sum of the coarse values listed in its row
+    struct StencilTable
+    {
+        vector<uint32_t> offsets;
+        vector<uint32_t> sources;
+        vector<float> weights;
+
+        size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+        /// Computes the refined values of arity floats each from the coarse ones
+        void apply(const float* src, float* dst, size_t arity) const
+        {
+            parallel_for_chunks(size(), 1024, [&](size_t begin, size_t end) {
+                for (auto i = begin; i < end; ++i) {
+                    auto d = dst + i * arity;
+                    fill(d, d + arity, 0.0f);
+                    for (auto j = offsets[i]; j < offsets[i + 1]; ++j) {
+                        const auto w = weights[j];
+                        const auto s = src + (size_t)sources[j] * arity;
+                        for (size_t a = 0; a < arity; ++a)
+                            d[a] += w * s[a];
+                    }
+                }
+            });
+        }
+
+        /// Copies the value of the first source of each row, for data that can't be interpolated such as ids
+        void apply_first(const uint8_t* src, uint8_t* dst, size_t element_size) const
+        {
+            parallel_for(size(), [&](size_t i) {
+                if (offsets[i] < offsets[i + 1])
+                    memcpy(dst + i * element_size, src + (size_t)sources[offsets[i]] * element_size, element_size);
+                else
+                    memset(dst + i * element_size, 0, element_size);
+            }, 4096);
+        }
+    };
+
+    /// The connectivity of one level of a polygon mesh whose faces all have the same size
+    struct SubdivisionTopology
+    {
+        size_t face_size = 4;
+        size_t num_vertices = 0;
+        vector<int32_t> indices;
+        vector<int32_t> vertex_offsets;
+        vector<int32_t> index_offsets;
+
+        size_t num_faces() const { return indices.size() / face_size; }
+        size_t num_subgeos() const { return vertex_offsets.size(); }
+        size_t vertex_end(size_t s) const { return s + 1 < num_subgeos() ? vertex_offsets[s + 1] : num_vertices; }
+        size_t face_begin(size_t s) const { return index_offsets[s] / face_size; }
+        size_t face_end(size_t s) const { return s + 1 < num_subgeos() ? face_begin(s + 1) : num_faces(); }
+    };
+
+    /// The stencils that compute one level of refinement from the previous one
+    struct SubdivisionLevel
+    {
+        // The size of the faces being refined: every one of them becomes that many quads
+        size_t face_size = 4;
+        StencilTable vertices;
+        StencilTable corners;
+    };
+
+    /// Catmull-Clark subdivision of the sub-geometries of a G3d.
+    /// The connectivity of each level is built from the index buffer: the sides of all faces are keyed by their end vertices and sorted with the parallel radix sort to find the edges.
+    /// Each level is captured in a stencil table that expresses every refined vertex as a weighted sum of the vertices of the level before,
+    /// which is then applied in parallel to every vertex attribute. Boundary and non-manifold edges are kept as creases.
+    /// Corner attributes, such as texture coordinates split along seams, are interpolated bilinearly within each face, and face attributes are inherited by the child faces.
+    /// Vertices stay grouped by sub-geometry, so instances still refer to the same sub-geometries.
+    class CatmullClark
+    {
+    public:
+        CatmullClark(const G3d& g, int num_levels)
+            : g(g)
+        {
+            MeshView mesh(g);
+            mesh.validate();
+            if (mesh.face_size < 3)
+                throw runtime_error("Catmull-Clark subdivision requires polygons");
+            if (num_levels < 0)
+                throw runtime_error("The number of subdivision levels can't be negative");
+
+            if (mesh.num_subgeos > 0 && (mesh.vertex_begin(0) != 0 || mesh.index_begin(0) != 0))
+                throw runtime_error("Sub-geometry offsets must start at zero");
+
+            num_vertices = mesh.num_vertices;
+            num_corners = mesh.num_corners();
+            topology.face_size = mesh.face_size;
+            topology.num_vertices = mesh.num_vertices;
+            topology.indices.resize(mesh.num_corners());
+            for (size_t c = 0; c < topology.indices.size(); ++c)
+                topology.indices[c] = mesh.index(c);
+            for (size_t s = 0; s < mesh.num_subgeos; ++s) {
+                if (mesh.index_begin(s) % mesh.face_size != 0)
+                    throw runtime_error("Sub-geometry index offsets must be at face boundaries");
+                topology.vertex_offsets.push_back((int32_t)mesh.vertex_begin(s));
+                topology.index_offsets.push_back((int32_t)mesh.index_begin(s));
+            }
+
+            levels.resize(num_levels);
+            for (auto& level : levels)
+                topology = refine(topology, level);
+        }
+
+        /// The stencils of every level
+        const vector<SubdivisionLevel>& stencils() const { return levels; }
+
+        /// The connectivity of the refined mesh
+        const SubdivisionTopology& refined() const { return topology; }
+
+        /// Creates a G3d with the attributes of the refined mesh allocated at their final sizes, for refine() to fill in.
+        /// Edge attributes can't be carried over, and are left out.
+        G3d allocate() const
+        {
+            G3d r;
+            const auto nv = topology.num_vertices, nc = topology.indices.size(), nf = topology.num_faces();
+            for (auto& attr : g.attributes) {
+                const auto desc = attr.descriptor.to_string();
+                const auto size = attr.data_element_size();
+                switch (attr.descriptor.association) {
+                    case assoc_vertex: r.add_owned_attribute<uint8_t>(desc, nv * size); break;
+                    case assoc_corner: r.add_owned_attribute<uint8_t>(desc, nc * size); break;
+                    case assoc_face: r.add_owned_attribute<uint8_t>(desc, nf * size); break;
+                    case assoc_edge: break;
+                    default: r.add_owned_attribute<uint8_t>(desc, attr.byte_size()); break;
+                }
+            }
+            r.add_owned_attribute<int32_t>(descriptors::Index, nc);
+            r.add_owned_attribute<int32_t>(descriptors::ObjectFaceSize, 1);
+            if (g.find_attribute(descriptors::SubGeoVertexOffset) && g.find_attribute(descriptors::SubGeoIndexOffset)) {
+                r.add_owned_attribute<int32_t>(descriptors::SubGeoVertexOffset, topology.num_subgeos());
+                r.add_owned_attribute<int32_t>(descriptors::SubGeoIndexOffset, topology.num_subgeos());
+            }
+            return r;
+        }
+
+        /// Writes the refined mesh into a G3d created by allocate(). The last level is computed directly into its buffers.
+        void refine(G3d& out) const
+        {
+            vector<uint8_t> scratch[2];
+            for (auto& attr : g.attributes) {
+                const auto desc = attr.descriptor.to_string();
+                if (desc == descriptors::Index || desc == descriptors::ObjectFaceSize
+                    || desc == descriptors::SubGeoVertexOffset || desc == descriptors::SubGeoIndexOffset
+                    || attr.descriptor.association == assoc_edge)
+                    continue;
+                auto dst = out.find_attribute(desc);
+                if (!dst)
+                    throw runtime_error("The output was not allocated for " + desc);
+                switch (attr.descriptor.association) {
+                    case assoc_vertex: refine_attribute(attr, *dst, scratch, false); break;
+                    case assoc_corner: refine_attribute(attr, *dst, scratch, true); break;
+                    case assoc_face: inherit_faces(attr, *dst); break;
+                    default: copy_attribute(attr, *dst); break;
+                }
+            }
+
+            auto indices = out.find_attribute(descriptors::Index);
+            auto face_size = out.find_attribute(descriptors::ObjectFaceSize);
+            if (!indices || !face_size || indices->count<int32_t>() != topology.indices.size())
+                throw runtime_error("The output was not allocated for the refined mesh");
+            copy(topology.indices.begin(), topology.indices.end(), indices->data<int32_t>());
+            face_size->data<int32_t>()[0] = (int32_t)topology.face_size;
+            auto vertex_offsets = out.find_attribute(descriptors::SubGeoVertexOffset);
+            auto index_offsets = out.find_attribute(descriptors::SubGeoIndexOffset);
+            if (vertex_offsets && index_offsets) {
+                copy(topology.vertex_offsets.begin(), topology.vertex_offsets.end(), vertex_offsets->data<int32_t>());
+                copy(topology.index_offsets.begin(), topology.index_offsets.end(), index_offsets->data<int32_t>());
+            }
+        }
+
+        G3d subdivide() const
+        {
+            auto r = allocate();
+            refine(r);
+            return r;
+        }
+
+        /// Refines the connectivity of one level, and computes the stencils of the vertices and corners of the refined level.
+        /// Refined vertices are numbered per sub-geometry: the vertices of the level before, then one per edge, then one per face.
+        static SubdivisionTopology refine(const SubdivisionTopology& in, SubdivisionLevel& level)
+        {
+            const auto n = in.face_size;
+            const auto nf = in.num_faces();
+            const auto nc = in.indices.size();
+            const auto nv = in.num_vertices;
+            const auto ns = in.num_subgeos();
+            const auto& idx = in.indices;
+            level.face_size = n;
+
+            // Edges are the runs of sorted polygon sides
+            vector<uint64_t> keys(nc);
+            vector<uint32_t> sides(nc);
+            parallel_for(nc, [&](size_t c) {
+                uint32_t a = idx[c], b = idx[c - c % n + (c % n + 1) % n];
+                if (a > b) swap(a, b);
+                keys[c] = (uint64_t)a << 32 | b;
+                sides[c] = (uint32_t)c;
+            }, 4096);
+            radix_sort(keys, sides);
+            vector<uint32_t> edge_starts;
+            for (size_t i = 0; i < nc; ++i)
+                if (i == 0 || keys[i] != keys[i - 1])
+                    edge_starts.push_back((uint32_t)i);
+            const auto ne = edge_starts.size();
+            edge_starts.push_back((uint32_t)nc);
+            vector<uint32_t> corner_edge(nc);
+            parallel_for(ne, [&](size_t e) {
+                for (auto j = edge_starts[e]; j < edge_starts[e + 1]; ++j)
+                    corner_edge[sides[j]] = (uint32_t)e;
+            }, 4096);
+            auto edge_a = [&](size_t e) { return (uint32_t)(keys[edge_starts[e]] >> 32); };
+            auto edge_b = [&](size_t e) { return (uint32_t)(keys[edge_starts[e]] & 0xFFFFFFFF); };
+            auto edge_faces = [&](size_t e) { return edge_starts[e + 1] - edge_starts[e]; };
+            auto smooth_edge = [&](size_t e) { return edge_faces(e) == 2 && edge_a(e) != edge_b(e); };
+
+            // The edges and corners around each vertex
+            vector<uint32_t> vertex_edge_offsets(nv + 1), vertex_edges(ne * 2);
+            vector<uint32_t> vertex_corner_offsets(nv + 1), vertex_corners(nc);
+            for (size_t e = 0; e < ne; ++e) {
+                ++vertex_edge_offsets[edge_a(e) + 1];
+                ++vertex_edge_offsets[edge_b(e) + 1];
+            }
+            for (size_t c = 0; c < nc; ++c)
+                ++vertex_corner_offsets[idx[c] + 1];
+            for (size_t v = 0; v < nv; ++v) {
+                vertex_edge_offsets[v + 1] += vertex_edge_offsets[v];
+                vertex_corner_offsets[v + 1] += vertex_corner_offsets[v];
+            }
+            {
+                auto edge_cursor = vertex_edge_offsets;
+                for (size_t e = 0; e < ne; ++e) {
+                    vertex_edges[edge_cursor[edge_a(e)]++] = (uint32_t)e;
+                    vertex_edges[edge_cursor[edge_b(e)]++] = (uint32_t)e;
+                }
+                auto corner_cursor = vertex_corner_offsets;
+                for (size_t c = 0; c < nc; ++c)
+                    vertex_corners[corner_cursor[idx[c]]++] = (uint32_t)c;
+            }
+
+            // Refined vertex numbers. Edges are sorted by their lower vertex, so they are grouped by sub-geometry like the vertices.
+            vector<size_t> edge_begin(ns + 1, ne), base(ns);
+            for (size_t s = 0; s < ns; ++s) {
+                size_t lo = 0, hi = ne;
+                while (lo < hi) {
+                    auto mid = (lo + hi) / 2;
+                    if (edge_a(mid) < (uint32_t)in.vertex_offsets[s]) lo = mid + 1; else hi = mid;
+                }
+                edge_begin[s] = lo;
+            }
+            vector<uint32_t> vertex_map(nv), edge_map(ne), face_map(nf);
+            parallel_for(ns, [&](size_t s) {
+                const size_t vb = in.vertex_offsets[s], fb = in.face_begin(s), eb = edge_begin[s];
+                const auto num_v = in.vertex_end(s) - vb, num_e = edge_begin[s + 1] - eb;
+                const auto b = vb + eb + fb;
+                for (auto v = vb; v < in.vertex_end(s); ++v)
+                    vertex_map[v] = (uint32_t)(b + v - vb);
+                for (auto e = eb; e < edge_begin[s + 1]; ++e)
+                    edge_map[e] = (uint32_t)(b + num_v + e - eb);
+                for (auto f = fb; f < in.face_end(s); ++f)
+                    face_map[f] = (uint32_t)(b + num_v + num_e + f - fb);
+            }, 1);
+
+            // Vertices on exactly two crease edges follow the curve rule, other vertices on creases are corners and stay in place
+            auto vertex_creases = [&](size_t v) {
+                uint32_t r = 0;
+                for (auto j = vertex_edge_offsets[v]; j < vertex_edge_offsets[v + 1]; ++j)
+                    r += !smooth_edge(vertex_edges[j]);
+                return r;
+            };
+            auto vertex_smooth = [&](size_t v) {
+                auto k = vertex_edge_offsets[v + 1] - vertex_edge_offsets[v];
+                return k > 0 && vertex_creases(v) == 0 && vertex_corner_offsets[v + 1] - vertex_corner_offsets[v] == k;
+            };
+
+            // Stencil sizes, then stencils
+            const auto num_refined = nv + ne + nf;
+            auto& t = level.vertices;
+            t.offsets.assign(num_refined + 1, 0);
+            parallel_for(nv, [&](size_t v) {
+                auto k = vertex_edge_offsets[v + 1] - vertex_edge_offsets[v];
+                t.offsets[vertex_map[v] + 1] = vertex_smooth(v) ? (uint32_t)(1 + k * n + 2 * k) : vertex_creases(v) == 2 ? 3 : 1;
+            }, 4096);
+            parallel_for(ne, [&](size_t e) {
+                t.offsets[edge_map[e] + 1] = smooth_edge(e) ? (uint32_t)(2 + 2 * n) : 2;
+            }, 4096);
+            parallel_for(nf, [&](size_t f) { t.offsets[face_map[f] + 1] = (uint32_t)n; }, 4096);
+            for (size_t i = 0; i < num_refined; ++i)
+                t.offsets[i + 1] += t.offsets[i];
+            t.sources.resize(t.offsets.back());
+            t.weights.resize(t.offsets.back());
+
+            auto add_face = [&](size_t f, float w, uint32_t& j) {
+                for (size_t k = 0; k < n; ++k) {
+                    t.sources[j] = idx[f * n + k];
+                    t.weights[j++] = w / n;
+                }
+            };
+
+            parallel_for(nf, [&](size_t f) {
+                auto j = t.offsets[face_map[f]];
+                add_face(f, 1.0f, j);
+            }, 4096);
+
+            parallel_for(ne, [&](size_t e) {
+                auto j = t.offsets[edge_map[e]];
+                const auto w = smooth_edge(e) ? 0.25f : 0.5f;
+                t.sources[j] = edge_a(e); t.weights[j++] = w;
+                t.sources[j] = edge_b(e); t.weights[j++] = w;
+                if (smooth_edge(e)) {
+                    add_face(sides[edge_starts[e]] / n, 0.25f, j);
+                    add_face(sides[edge_starts[e] + 1] / n, 0.25f, j);
+                }
+            }, 4096);
+
+            parallel_for(nv, [&](size_t v) {
+                auto j = t.offsets[vertex_map[v]];
+                const auto k = vertex_edge_offsets[v + 1] - vertex_edge_offsets[v];
+                if (vertex_smooth(v)) {
+                    // (F + 2R + (k - 3) V) / k, where F is the average of the face points and R the average of the edge midpoints
+                    const auto kk = (float)k * k;
+                    t.sources[j] = (uint32_t)v; t.weights[j++] = (k - 3.0f) / k;
+                    for (auto i = vertex_corner_offsets[v]; i < vertex_corner_offsets[v + 1]; ++i)
+                        add_face(vertex_corners[i] / n, 1.0f / kk, j);
+                    for (auto i = vertex_edge_offsets[v]; i < vertex_edge_offsets[v + 1]; ++i) {
+                        auto e = vertex_edges[i];
+                        t.sources[j] = edge_a(e); t.weights[j++] = 1.0f / kk;
+                        t.sources[j] = edge_b(e); t.weights[j++] = 1.0f / kk;
+                    }
+                }
+                else if (vertex_creases(v) == 2) {
+                    t.sources[j] = (uint32_t)v; t.weights[j++] = 0.75f;
+                    for (auto i = vertex_edge_offsets[v]; i < vertex_edge_offsets[v + 1]; ++i) {
+                        auto e = vertex_edges[i];
+                        if (smooth_edge(e)) continue;
+                        t.sources[j] = edge_a(e) == v ? edge_b(e) : edge_a(e);
+                        t.weights[j++] = 0.125f;
+                    }
+                }
+                else {
+                    t.sources[j] = (uint32_t)v; t.weights[j++] = 1.0f;
+                }
+            }, 1024);
+
+            // Corners of the child quads: the parent corner, the middle of the next side, the middle of the face, the middle of the previous side
+            auto& cs = level.corners;
+            const auto row = 5 + n;
+            cs.offsets.resize(nc * 4 + 1);
+            cs.sources.resize(nc * row);
+            cs.weights.resize(nc * row);
+            parallel_for(nc, [&](size_t c) {
+                const auto f = c / n, k = c % n;
+                const auto next = f * n + (k + 1) % n, prev = f * n + (k + n - 1) % n;
+                auto j = c * row;
+                cs.offsets[c * 4] = (uint32_t)j;
+                cs.sources[j] = (uint32_t)c; cs.weights[j++] = 1.0f;
+                cs.offsets[c * 4 + 1] = (uint32_t)j;
+                cs.sources[j] = (uint32_t)c; cs.weights[j++] = 0.5f;
+                cs.sources[j] = (uint32_t)next; cs.weights[j++] = 0.5f;
+                cs.offsets[c * 4 + 2] = (uint32_t)j;
+                for (size_t i = 0; i < n; ++i) {
+                    cs.sources[j] = (uint32_t)(f * n + (k + i) % n);
+                    cs.weights[j++] = 1.0f / n;
+                }
+                cs.offsets[c * 4 + 3] = (uint32_t)j;
+                cs.sources[j] = (uint32_t)c; cs.weights[j++] = 0.5f;
+                cs.sources[j] = (uint32_t)prev; cs.weights[j++] = 0.5f;
+            }, 4096);
+            cs.offsets[nc * 4] = (uint32_t)(nc * row);
+
+            SubdivisionTopology out;
+            out.face_size = 4;
+            out.num_vertices = num_refined;
+            out.indices.resize(nc * 4);
+            parallel_for(nc, [&](size_t c) {
+                const auto f = c / n, k = c % n;
+                auto q = &out.indices[c * 4];
+                q[0] = (int32_t)vertex_map[idx[c]];
+                q[1] = (int32_t)edge_map[corner_edge[c]];
+                q[2] = (int32_t)face_map[f];
+                q[3] = (int32_t)edge_map[corner_edge[f * n + (k + n - 1) % n]];
+            }, 4096);
+            for (size_t s = 0; s < ns; ++s) {
+                out.vertex_offsets.push_back((int32_t)(in.vertex_offsets[s] + edge_begin[s] + in.face_begin(s)));
+                out.index_offsets.push_back(in.index_offsets[s] * 4);
+            }
+            return out;
+        }
+
+    private:
+        const G3d& g;
+        size_t num_vertices = 0;
+        size_t num_corners = 0;
+        SubdivisionTopology topology;
+        vector<SubdivisionLevel> levels;
+
+        /// Applies the stencils of every level, alternating between two scratch buffers, with the last level written to the output
+        void refine_attribute(const Attribute& src, Attribute& dst, vector<uint8_t>* scratch, bool corners) const
+        {
+            const auto size = src.data_element_size();
+            const auto interpolate = src.descriptor.data_type == dt_float32;
+            const auto expected = corners ? num_corners : num_vertices;
+            if (src.num_elements() != expected)
+                throw runtime_error("Attribute " + src.descriptor.to_string() + " doesn't have an element per " + (corners ? "corner" : "vertex"));
+            const uint8_t* cur = src._begin;
+            for (size_t i = 0; i < levels.size(); ++i) {
+                const auto& t = corners ? levels[i].corners : levels[i].vertices;
+                uint8_t* out = dst._begin;
+                if (i + 1 < levels.size()) {
+                    scratch[i % 2].resize(t.size() * size);
+                    out = scratch[i % 2].data();
+                }
+                if (interpolate)
+                    t.apply((const float*)cur, (float*)out, src.descriptor.data_arity);
+                else
+                    t.apply_first(cur, out, size);
+                cur = out;
+            }
+            if (levels.empty())
+                copy_attribute(src, dst);
+        }
+
+        /// Child faces take the value of the face they were split from
+        void inherit_faces(const Attribute& src, Attribute& dst) const
+        {
+            const auto size = src.data_element_size();
+            size_t children = 1;
+            for (auto& level : levels)
+                children *= level.face_size;
+            const auto n = dst.num_elements();
+            if (src.num_elements() * children != n)
+                throw runtime_error("Attribute " + src.descriptor.to_string() + " doesn't have an element per face");
+            parallel_for(n, [&](size_t f) {
+                memcpy(dst._begin + f * size, src._begin + f / children * size, size);
+            }, 4096);
+        }
+
+        static void copy_attribute(const Attribute& src, Attribute& dst)
+        {
+            if (src.byte_size() != dst.byte_size())
+                throw runtime_error("Attribute " + src.descriptor.to_string() + " doesn't have the expected size");
+            copy(src._begin, src._end, dst._begin);
+        }
+    };
+
+    /// Refines the polygons of a G3d with the given number of levels of Catmull-Clark subdivision (see CatmullClark)
+    inline G3d subdivide(const G3d& g, int levels)
+    {
+        return CatmullClark(g, levels).subdivide();
+    }
+}
+
+namespace Vim
+{
+    /// Replaces the geometry of the scene with its Catmull-Clark subdivision. Sub-geometries keep their indices, so nodes still refer to them.
+    inline void SubdivideGeometry(Scene& scene, int levels)
+    {
+        scene.mGeometry = g3d::subdivide(scene.mGeometry, levels);
+    }
+}
+
+#endif
@@ -0,0 +1,314 @@
+/*
+    Trigram Text Index of the VIM String Table
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __TEXTINDEX_H__
+#define __TEXTINDEX_H__
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+
+#include "bits.h"
+#include "parallel.h"
+#include "stringtable.h"
+#include "serialize.h"
+
+namespace Vim
+{
+    /// An inverted index from every three consecutive characters (trigram) to the strings that contain them, for substring search.
+    /// Trigrams are taken from the strings with ASCII letters lowercased, so searches are case-insensitive unless requested otherwise.
+    /// The strings of each trigram are stored in ascending order as variable length deltas.
+    /// A search intersects the lists of the trigrams of the query, starting with the shortest, then checks the remaining candidates.
+    /// The index is built on the first search, in parallel, and can be saved so that later loads don't rebuild it.
+    class TextIndex
+    {
+    public:
+        /// Indexes a string table, which must outlive the index
+        explicit TextIndex(const StringTable& strings)
+            : mStrings(strings)
+        { }
+
+        TextIndex(const TextIndex&) = delete;
+        TextIndex& operator=(const TextIndex&) = delete;
+
+        /// The indices of the strings that contain the text, in ascending order
+        std::vector<int> Search(std::string_view text, bool caseSensitive = false) const
+        {
+            return SearchSet(text, caseSensitive).to_indices();
+        }
+
+        /// The set of the strings that contain the text, for filtering string columns with Predicate::In
+        g3d::Bitset SearchSet(std::string_view text, bool caseSensitive = false) const
+        {
+            auto lower = Lower(text);
+            auto matches = [&](std::string_view s) {
+                return caseSensitive ? s.find(text) != std::string_view::npos : Lower(s).find(lower) != std::string::npos;
+            };
+            if (text.size() < 3)
+                return mStrings.Where(matches);
+
+            BuildIndex();
+            auto trigrams = Trigrams(lower);
+            std::vector<size_t> lists;
+            for (auto t : trigrams)
+            {
+                auto it = std::lower_bound(mTrigrams.begin(), mTrigrams.end(), t);
+                if (it == mTrigrams.end() || *it != t)
+                    return g3d::Bitset(mStrings.Size());
+                lists.push_back(it - mTrigrams.begin());
+            }
+            std::sort(lists.begin(), lists.end(), [&](size_t a, size_t b) { return mCounts[a] < mCounts[b]; });
+            auto candidates = Decode(lists[0]);
+            std::vector<uint32_t> scratch;
+            for (size_t i = 1; i < lists.size() && !candidates.empty(); ++i)
+            {
+                auto next = Decode(lists[i]);
+                scratch.clear();
+                std::set_intersection(candidates.begin(), candidates.end(), next.begin(), next.end(), std::back_inserter(scratch));
+                candidates.swap(scratch);
+            }
+            g3d::Bitset r(mStrings.Size());
+            std::vector<uint8_t> found(candidates.size());
+            g3d::parallel_for(candidates.size(), [&](size_t i) { found[i] = matches(mStrings.Get(candidates[i])); }, 256);
+            for (size_t i = 0; i < candidates.size(); ++i)
+                if (found[i])
+                    r.set(candidates[i]);
+            return r;
+        }
+
+        /// The entities that have a property whose value is one of the strings, in ascending order
+        template<typename Properties>
+        static std::vector<int> EntitiesWithValues(const Properties& properties, const g3d::Bitset& strings)
+        {
+            std::vector<int> r;
+            for (auto& p : properties)
+                if (p.mEntityId >= 0 && p.mValue >= 0 && (size_t)p.mValue < strings.size && strings.get(p.mValue))
+                    r.push_back(p.mEntityId);
+            std::sort(r.begin(), r.end());
+            r.erase(std::unique(r.begin(), r.end()), r.end());
+            return r;
+        }
+
+        size_t NumTrigrams() const { BuildIndex(); return mTrigrams.size(); }
+
+        /// The size in bytes of the compressed lists of strings
+        size_t PostingsSize() const { BuildIndex(); return mPostings.size(); }
+
+        /// Builds the index if it hasn't been built or loaded yet. Safe to call from several threads.
+        void BuildIndex() const
+        {
+            std::call_once(*mIndexOnce, [&]() {
+                if (!mLoaded)
+                    Build();
+            });
+        }
+
+        /// Serializes the index, with a fingerprint of the strings it was built from
+        std::vector<uint8_t> SaveIndex() const
+        {
+            BuildIndex();
+            IndexHeader h = { IndexMagic, (uint64_t)mStrings.Size(), (uint64_t)mStrings.DataSize(),
+                Fingerprint(mStrings.Data(), mStrings.DataSize()), (uint64_t)mTrigrams.size(), (uint64_t)mPostings.size() };
+            std::vector<uint8_t> r;
+            AppendBytes(r, &h, sizeof(h));
+            AppendBytes(r, mTrigrams.data(), mTrigrams.size() * sizeof(uint32_t));
+            AppendBytes(r, mCounts.data(), mCounts.size() * sizeof(uint32_t));
+            AppendBytes(r, mOffsets.data(), mOffsets.size() * sizeof(uint64_t));
+            AppendBytes(r, mPostings.data(), mPostings.size());
+            return r;
+        }
+
+        /// Uses an index saved by SaveIndex, if it was built from the same strings. Returns false, and leaves the index to be built, otherwise.
+        bool LoadIndex(const bfast::ByteRange& data)
+        {
+            IndexHeader h;
+            if (data.size() < sizeof(h))
+                return false;
+            memcpy(&h, data.begin(), sizeof(h));
+            if (h.mMagic != IndexMagic || h.mCount != mStrings.Size() || h.mDataSize != mStrings.DataSize()
+                || data.size() != sizeof(h) + h.mNumTrigrams * (2 * sizeof(uint32_t) + sizeof(uint64_t)) + sizeof(uint64_t) + h.mPostingsSize
+                || h.mFingerprint != Fingerprint(mStrings.Data(), mStrings.DataSize()))
+                return false;
+            auto p = data.begin() + sizeof(h);
+            mTrigrams.resize((size_t)h.mNumTrigrams);
+            mCounts.resize((size_t)h.mNumTrigrams);
+            mOffsets.resize((size_t)h.mNumTrigrams + 1);
+            mPostings.resize((size_t)h.mPostingsSize);
+            p = ExtractBytes(p, mTrigrams.data(), mTrigrams.size() * sizeof(uint32_t));
+            p = ExtractBytes(p, mCounts.data(), mCounts.size() * sizeof(uint32_t));
+            p = ExtractBytes(p, mOffsets.data(), mOffsets.size() * sizeof(uint64_t));
+            ExtractBytes(p, mPostings.data(), mPostings.size());
+            mLoaded = true;
+            mIndexOnce.reset(new std::once_flag());
+            return true;
+        }
+
+        void SaveIndexFile(const std::string& path) const
+        {
+            SaveBytesFile(path, SaveIndex());
+        }
+
+        bool LoadIndexFile(const std::string& path)
+        {
+            std::vector<uint8_t> data;
+            return LoadBytesFile(path, data) && LoadIndex(bfast::ByteRange{ data.data(), data.data() + data.size() });
+        }
+
+        /// Lowercases the ASCII letters of a string. Other bytes, including those of multi-byte UTF-8 characters, are kept.
+        static std::string Lower(std::string_view s)
+        {
+            std::string r(s);
+            for (auto& c : r)
+                if (c >= 'A' && c <= 'Z')
+                    c = (char)(c - 'A' + 'a');
+            return r;
+        }
+
+        /// The distinct trigrams of a lowercased string, as 24-bit numbers, in ascending order
+        static std::vector<uint32_t> Trigrams(std::string_view s)
+        {
+            std::vector<uint32_t> r;
+            for (size_t i = 0; i + 3 <= s.size(); ++i)
+                r.push_back((uint32_t)(uint8_t)s[i] << 16 | (uint32_t)(uint8_t)s[i + 1] << 8 | (uint8_t)s[i + 2]);
+            std::sort(r.begin(), r.end());
+            r.erase(std::unique(r.begin(), r.end()), r.end());
+            return r;
+        }
+
+    private:
+        struct IndexHeader
+        {
+            uint64_t mMagic;
+            uint64_t mCount;
+            uint64_t mDataSize;
+            uint64_t mFingerprint;
+            uint64_t mNumTrigrams;
+            uint64_t mPostingsSize;
+        };
+
+        static const uint64_t IndexMagic = 0x58444E4954584554ull;
+
+        const StringTable& mStrings;
+        // The distinct trigrams in ascending order, with the number of strings that contain each one,
+        // and the offset of its list in the postings (with one more offset for the end)
+        mutable std::vector<uint32_t> mTrigrams;
+        mutable std::vector<uint32_t> mCounts;
+        mutable std::vector<uint64_t> mOffsets;
+        // The lists of strings, each as the first string index then the differences, in LEB128 variable length encoding
+        mutable std::vector<uint8_t> mPostings;
+        bool mLoaded = false;
+        mutable std::unique_ptr<std::once_flag> mIndexOnce{ new std::once_flag() };
+
+        std::vector<uint32_t> Decode(size_t list) const
+        {
+            std::vector<uint32_t> r(mCounts[list]);
+            auto p = mPostings.data() + mOffsets[list];
+            uint32_t value = 0;
+            for (auto& x : r)
+            {
+                uint32_t delta = 0;
+                for (int shift = 0;; shift += 7)
+                {
+                    auto b = *p++;
+                    delta |= (uint32_t)(b & 0x7F) << shift;
+                    if (!(b & 0x80))
+                        break;
+                }
+                value += delta;
+                x = value;
+            }
+            return r;
+        }
+
+        static size_t EncodedSize(uint32_t v)
+        {
+            size_t r = 1;
+            while (v >= 0x80)
+            {
+                v >>= 7;
+                ++r;
+            }
+            return r;
+        }
+
+        static uint8_t* Encode(uint32_t v, uint8_t* p)
+        {
+            while (v >= 0x80)
+            {
+                *p++ = (uint8_t)(v | 0x80);
+                v >>= 7;
+            }
+            *p++ = (uint8_t)v;
+            return p;
+        }
+
+        void Build() const
+        {
+            // Each part of the strings lists its (trigram, string) pairs in string order, so the stable sort by trigram keeps the strings of each trigram ascending
+            const auto n = mStrings.Size();
+            const auto max_parts = g3d::thread_count() * 4;
+            std::vector<std::vector<uint64_t>> part_keys(max_parts);
+            std::vector<std::vector<uint32_t>> part_strings(max_parts);
+            auto num_parts = g3d::parallel_partition(n, max_parts, [&](size_t part, size_t begin, size_t end) {
+                for (auto i = begin; i < end; ++i)
+                    for (auto t : Trigrams(Lower(mStrings.Get(i))))
+                    {
+                        part_keys[part].push_back(t);
+                        part_strings[part].push_back((uint32_t)i);
+                    }
+            });
+            std::vector<size_t> positions(num_parts + 1, 0);
+            for (size_t p = 0; p < num_parts; ++p)
+                positions[p + 1] = positions[p] + part_keys[p].size();
+            std::vector<uint64_t> keys(positions[num_parts]);
+            std::vector<uint32_t> strings(keys.size());
+            g3d::parallel_for(num_parts, [&](size_t p) {
+                std::copy(part_keys[p].begin(), part_keys[p].end(), keys.begin() + positions[p]);
+                std::copy(part_strings[p].begin(), part_strings[p].end(), strings.begin() + positions[p]);
+            }, 1);
+            part_keys.clear();
+            part_strings.clear();
+            g3d::radix_sort(keys, strings);
+
+            std::vector<size_t> starts;
+            mTrigrams.clear();
+            for (size_t i = 0; i < keys.size(); ++i)
+                if (i == 0 || keys[i] != keys[i - 1])
+                {
+                    starts.push_back(i);
+                    mTrigrams.push_back((uint32_t)keys[i]);
+                }
+            starts.push_back(keys.size());
+            const auto num_trigrams = mTrigrams.size();
+
+            // Encode the lists in parallel: first their sizes, then the bytes at their offsets
+            mCounts.resize(num_trigrams);
+            mOffsets.assign(num_trigrams + 1, 0);
+            g3d::parallel_for(num_trigrams, [&](size_t t) {
+                size_t size = 0;
+                for (auto i = starts[t]; i < starts[t + 1]; ++i)
+                    size += EncodedSize(i == starts[t] ? strings[i] : strings[i] - strings[i - 1]);
+                mCounts[t] = (uint32_t)(starts[t + 1] - starts[t]);
+                mOffsets[t + 1] = size;
+            }, 1024);
+            for (size_t t = 0; t < num_trigrams; ++t)
+                mOffsets[t + 1] += mOffsets[t];
+            mPostings.resize((size_t)mOffsets[num_trigrams]);
+            g3d::parallel_for(num_trigrams, [&](size_t t) {
+                auto p = mPostings.data() + mOffsets[t];
+                for (auto i = starts[t]; i < starts[t + 1]; ++i)
+                    p = Encode(i == starts[t] ? strings[i] : strings[i] - strings[i - 1], p);
+            }, 1024);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,373 @@
+/*
+    World Transforms of VIM Scene Node Hierarchies
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __TRANSFORMS_H__
+#define __TRANSFORMS_H__
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <climits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "parallel.h"
+#include "geometry.h"
+#include "derived.h"
+#include "vim.h"
+#include "vimview.h"
+#include "serialize.h"
+
+namespace Vim
+{
+    /// The world transform of every node of a scene, where a node's mTransform is relative to its parent: world = local * parent world.
+    /// Nodes whose parent is negative or out of range are roots. The children of each node are kept in compressed rows, and the nodes are
+    /// ordered level by level from the roots, so that each level is computed in parallel once the level above it is done.
+    /// The matrices are stored as 16 arrays of floats (structure of arrays), one per matrix element, aligned to 64 bytes and in level order,
+    /// so a level is computed with contiguous stores. With AVX2, 8 nodes are multiplied at a time, gathering the local and parent elements.
+    /// The nodes must outlive the transforms. After changing the local transform of a node, call Update to recompute its subtree.
+    class WorldTransforms
+    {
+    public:
+        WorldTransforms() = default;
+
+        WorldTransforms(const SceneNode* nodes, size_t count)
+            : mNodes(nodes), mCount(count)
+        {
+            BuildHierarchy();
+            mStride = (mCount + 15) / 16 * 16;
+            mData.allocate<float>(mStride * 16);
+            for (size_t level = 0; level + 1 < mLevelOffsets.size(); ++level)
+                ComputeLevel(level);
+        }
+
+        WorldTransforms(const WorldTransforms&) = delete;
+        WorldTransforms& operator=(const WorldTransforms&) = delete;
+        WorldTransforms(WorldTransforms&&) = default;
+        WorldTransforms& operator=(WorldTransforms&&) = default;
+
+        size_t Size() const { return mCount; }
+        size_t NumLevels() const { return mLevelOffsets.empty() ? 0 : mLevelOffsets.size() - 1; }
+
+        /// The array of one matrix element of all nodes in level order, aligned to 64 bytes. Use Slot to find a node in it.
+        const float* Element(size_t element) const { return mData.data<float>() + element * mStride; }
+
+        /// The position of a node in the element arrays
+        size_t Slot(size_t node) const { return (size_t)mSlots[node]; }
+
+        /// The nodes in level order: the roots, then their children, and so on
+        const std::vector<int>& Order() const { return mOrder; }
+
+        /// The nodes of a level are Order()[LevelBegin(level)] to Order()[LevelBegin(level + 1)]
+        size_t LevelBegin(size_t level) const { return mLevelOffsets[level]; }
+
+        /// The children of a node
+        Span<int> Children(size_t node) const
+        {
+            return Span<int>(mChildren.data() + mChildOffsets[node], mChildren.data() + mChildOffsets[node + 1]);
+        }
+
+        /// Copies the world matrix of a node
+        void GetMatrix(size_t node, float* m) const
+        {
+            auto s = Slot(node);
+            for (auto e = 0; e < 16; ++e)
+                m[e] = Element(e)[s];
+        }
+
+        /// The world matrices of all nodes in node order, 16 floats each
+        std::vector<float> ToMatrices() const
+        {
+            std::vector<float> r(mCount * 16);
+            g3d::parallel_for(mCount, [&](size_t i) { GetMatrix(i, r.data() + i * 16); }, 4096);
+            return r;
+        }
+
+        /// Recomputes the world transforms of a node and of its descendants, after the local transform of the node has changed
+        void Update(int node)
+        {
+            std::vector<int> level = { node }, next;
+            while (!level.empty())
+            {
+                g3d::parallel_for(level.size(), [&](size_t i) { ComputeNode(level[i]); }, 1024);
+                next.clear();
+                for (auto n : level)
+                    for (auto c : Children(n))
+                        next.push_back(c);
+                level.swap(next);
+            }
+        }
+
+        /// Serializes the hierarchy and the matrices
+        std::vector<uint8_t> Save() const
+        {
+            Header h = { Magic, (uint64_t)mCount, (uint64_t)NumLevels(), (uint64_t)mStride };
+            std::vector<uint8_t> r;
+            AppendBytes(r, &h, sizeof(h));
+            AppendBytes(r, mOrder.data(), mOrder.size() * sizeof(int));
+            AppendBytes(r, mLevelOffsets.data(), mLevelOffsets.size() * sizeof(uint32_t));
+            AppendBytes(r, mChildOffsets.data(), mChildOffsets.size() * sizeof(uint32_t));
+            AppendBytes(r, mChildren.data(), mChildren.size() * sizeof(int));
+            AppendBytes(r, mData.data<float>(), mStride * 16 * sizeof(float));
+            return r;
+        }
+
+        /// Reads transforms saved by Save for the same nodes. Returns false, leaving the transforms unchanged, if the data doesn't match the nodes.
+        bool Load(const SceneNode* nodes, size_t count, const bfast::ByteRange& data)
+        {
+            Header h;
+            if (data.size() < sizeof(h))
+                return false;
+            memcpy(&h, data.begin(), sizeof(h));
+            if (h.mMagic != Magic || h.mCount != count || h.mStride != (count + 15) / 16 * 16 || h.mNumLevels > count)
+                return false;
+            const auto fixed = sizeof(h) + count * sizeof(int) + (h.mNumLevels + 1) * sizeof(uint32_t) + (count + 1) * sizeof(uint32_t) + h.mStride * 16 * sizeof(float);
+            if (data.size() < fixed || (data.size() - fixed) % sizeof(int) != 0)
+                return false;
+            // Read into locals, and only replace the transforms once everything is known to be consistent with the nodes
+            auto p = data.begin() + sizeof(h);
+            std::vector<int> order(count), children((data.size() - fixed) / sizeof(int));
+            std::vector<uint32_t> levelOffsets((size_t)h.mNumLevels + 1), childOffsets(count + 1);
+            g3d::AlignedBuffer matrices;
+            p = ExtractBytes(p, order.data(), order.size() * sizeof(int));
+            p = ExtractBytes(p, levelOffsets.data(), levelOffsets.size() * sizeof(uint32_t));
+            p = ExtractBytes(p, childOffsets.data(), childOffsets.size() * sizeof(uint32_t));
+            p = ExtractBytes(p, children.data(), children.size() * sizeof(int));
+            ExtractBytes(p, matrices.allocate<float>((size_t)h.mStride * 16), (size_t)h.mStride * 16 * sizeof(float));
+            if (!ValidHierarchy(nodes, count, order, levelOffsets, childOffsets, children))
+                return false;
+            mNodes = nodes;
+            mCount = count;
+            mStride = (size_t)h.mStride;
+            mOrder = std::move(order);
+            mLevelOffsets = std::move(levelOffsets);
+            mChildOffsets = std::move(childOffsets);
+            mChildren = std::move(children);
+            mData = std::move(matrices);
+            ComputeSlots();
+            return true;
+        }
+
+    private:
+        struct Header
+        {
+            uint64_t mMagic;
+            uint64_t mCount;
+            uint64_t mNumLevels;
+            uint64_t mStride;
+        };
+
+        static const uint64_t Magic = 0x444C524F57444F4Eull;
+
+        const SceneNode* mNodes = nullptr;
+        size_t mCount = 0;
+        size_t mStride = 0;
+        std::vector<uint32_t> mChildOffsets;
+        std::vector<int> mChildren;
+        std::vector<int> mOrder;
+        std::vector<uint32_t> mLevelOffsets;
+        // The slot of each node, and the slot of the parent of each slot (or -1 for roots)
+        std::vector<int> mSlots;
+        std::vector<int> mParentSlots;
+        g3d::AlignedBuffer mData;
+
+        /// Checks a saved hierarchy against the nodes: the offsets ascend to the end of what they index, every node is once in the order,
+        /// the children of a node have it as their parent, and the nodes of each level below the roots have their parent in a level above
+        static bool ValidHierarchy(const SceneNode* nodes, size_t count, const std::vector<int>& order, const std::vector<uint32_t>& levelOffsets,
+            const std::vector<uint32_t>& childOffsets, const std::vector<int>& children)
+        {
+            auto ascending = [](const std::vector<uint32_t>& offsets, size_t end) {
+                for (size_t i = 1; i < offsets.size(); ++i)
+                    if (offsets[i] < offsets[i - 1])
+                        return false;
+                return offsets.front() == 0 && offsets.back() == end;
+            };
+            auto parent = [&](size_t node) {
+                auto p = nodes[node].mParent;
+                return p >= 0 && (size_t)p < count ? p : -1;
+            };
+            if (!ascending(levelOffsets, count) || !ascending(childOffsets, children.size()))
+                return false;
+            std::vector<int> slots(count, -1);
+            for (size_t s = 0; s < count; ++s)
+            {
+                auto n = order[s];
+                if (n < 0 || (size_t)n >= count || slots[n] >= 0)
+                    return false;
+                slots[n] = (int)s;
+            }
+            for (size_t n = 0; n < count; ++n)
+                for (auto i = childOffsets[n]; i < childOffsets[n + 1]; ++i)
+                    if (children[i] < 0 || (size_t)children[i] >= count || parent(children[i]) != (int)n)
+                        return false;
+            for (size_t level = 0; level + 1 < levelOffsets.size(); ++level)
+                for (auto s = levelOffsets[level]; s < levelOffsets[level + 1]; ++s)
+                {
+                    auto p = parent(order[s]);
+                    if (level == 0 ? p >= 0 : p < 0 || (uint32_t)slots[p] >= levelOffsets[level])
+                        return false;
+                }
+            return true;
+        }
+
+        int Parent(size_t node) const
+        {
+            auto p = mNodes[node].mParent;
+            return p >= 0 && (size_t)p < mCount ? p : -1;
+        }
+
+        void BuildHierarchy()
+        {
+            // Children in compressed rows, by counting sort on the parent; the children of each node stay in ascending order
+            mChildOffsets.assign(mCount + 1, 0);
+            for (size_t i = 0; i < mCount; ++i)
+                if (Parent(i) >= 0)
+                    mChildOffsets[Parent(i) + 1]++;
+            for (size_t i = 0; i < mCount; ++i)
+                mChildOffsets[i + 1] += mChildOffsets[i];
+            mChildren.resize(mChildOffsets[mCount]);
+            {
+                auto next = mChildOffsets;
+                for (size_t i = 0; i < mCount; ++i)
+                    if (Parent(i) >= 0)
+                        mChildren[next[Parent(i)]++] = (int)i;
+            }
+
+            // Levels from the roots: each level lists the children of the level above, written in parallel at their prefix sum offsets
+            mOrder.clear();
+            for (size_t i = 0; i < mCount; ++i)
+                if (Parent(i) < 0)
+                    mOrder.push_back((int)i);
+            mLevelOffsets.assign(1, 0);
+            std::vector<uint32_t> positions;
+            for (size_t begin = 0; begin < mOrder.size();)
+            {
+                const auto end = mOrder.size();
+                mLevelOffsets.push_back((uint32_t)end);
+                positions.assign(end - begin + 1, (uint32_t)end);
+                for (auto i = begin; i < end; ++i)
+                    positions[i - begin + 1] = positions[i - begin] + (uint32_t)Children(mOrder[i]).size();
+                mOrder.resize(positions.back());
+                g3d::parallel_for(end - begin, [&](size_t i) {
+                    auto c = Children(mOrder[begin + i]);
+                    std::copy(c.begin(), c.end(), mOrder.begin() + positions[i]);
+                }, 1024);
+                begin = end;
+            }
+            if (mOrder.size() != mCount)
+                throw std::runtime_error("The node hierarchy has a cycle");
+            ComputeSlots();
+        }
+
+        void ComputeSlots()
+        {
+            mSlots.resize(mCount);
+            g3d::parallel_for(mCount, [&](size_t s) { mSlots[mOrder[s]] = (int)s; }, 4096);
+            mParentSlots.resize(mCount);
+            g3d::parallel_for(mCount, [&](size_t s) {
+                auto p = Parent(mOrder[s]);
+                mParentSlots[s] = p < 0 ? -1 : mSlots[p];
+            }, 4096);
+        }
+
+        /// Computes the world matrix of one node from its parent's
+        void ComputeNode(int node)
+        {
+            auto s = (size_t)mSlots[node];
+            auto ps = mParentSlots[s];
+            float parent[16], world[16];
+            const float* m = mNodes[node].mTransform;
+            if (ps >= 0)
+            {
+                for (auto e = 0; e < 16; ++e)
+                    parent[e] = Element(e)[ps];
+                g3d::multiply(mNodes[node].mTransform, parent, world);
+                m = world;
+            }
+            auto data = mData.data<float>();
+            for (auto e = 0; e < 16; ++e)
+                data[e * mStride + s] = m[e];
+        }
+
+        void ComputeLevel(size_t level)
+        {
+            const auto begin = (size_t)mLevelOffsets[level];
+            const auto end = (size_t)mLevelOffsets[level + 1];
+            g3d::parallel_for_chunks(end - begin, 1024, [&](size_t b, size_t e) {
+                auto s = begin + b;
+#if defined(__AVX2__) || defined(__AVX512F__)
+                if (level > 0 && mCount <= (size_t)INT_MAX / NodeFloats)
+                    for (; s + 8 <= begin + e; s += 8)
+                        ComputeEight(s);
+#endif
+                for (; s < begin + e; ++s)
+                    ComputeNode(mOrder[s]);
+            });
+        }
+
+        static const size_t NodeFloats = sizeof(SceneNode) / sizeof(float);
+        static_assert(sizeof(SceneNode) % sizeof(float) == 0, "SceneNode must be a whole number of floats");
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+        /// Computes the world matrices of the 8 nodes at slots [s, s + 8), which all have parents: out(i, j) = sum over k of local(i, k) * parent(k, j)
+        void ComputeEight(size_t s)
+        {
+            const auto base = (const float*)mNodes + offsetof(SceneNode, mTransform) / sizeof(float);
+            const auto nodes = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(mOrder.data() + s)), _mm256_set1_epi32((int)NodeFloats));
+            const auto parents = _mm256_loadu_si256((const __m256i*)(mParentSlots.data() + s));
+            __m256 local[16], parent[16];
+            for (auto e = 0; e < 16; ++e)
+            {
+                local[e] = _mm256_i32gather_ps(base + e, nodes, 4);
+                parent[e] = _mm256_i32gather_ps(Element(e), parents, 4);
+            }
+            auto data = mData.data<float>();
+            for (auto i = 0; i < 4; ++i)
+                for (auto j = 0; j < 4; ++j)
+                {
+                    auto r = _mm256_mul_ps(local[i * 4], parent[j]);
+                    for (auto k = 1; k < 4; ++k)
+                        r = _mm256_add_ps(r, _mm256_mul_ps(local[i * 4 + k], parent[k * 4 + j]));
+                    _mm256_storeu_ps(data + (i * 4 + j) * mStride + s, r);
+                }
+        }
+#endif
+    };
+
+    /// The nodes of a scene as instances at their world transforms, for the functions that take a g3d::InstanceView.
+    /// The world matrices are copied in node order; the sub-geometries are read from the nodes, which must outlive the view.
+    class WorldInstances
+    {
+    public:
+        WorldInstances(const SceneNode* nodes, size_t count)
+            : mMatrices(WorldTransforms(nodes, count).ToMatrices())
+        {
+            mView = g3d::InstanceView::from_nodes(nodes, count);
+            if (count == 0)
+                return;
+            mView.transforms = (const uint8_t*)mMatrices.data();
+            mView.transform_stride = 16 * sizeof(float);
+        }
+
+        explicit WorldInstances(const Scene& scene)
+            : WorldInstances(scene.mNodes.data(), scene.mNodes.size())
+        { }
+
+        WorldInstances(const WorldInstances&) = delete;
+        WorldInstances& operator=(const WorldInstances&) = delete;
+
+        const g3d::InstanceView& View() const { return mView; }
+
+    private:
+        std::vector<float> mMatrices;
+        g3d::InstanceView mView;
+    };
+}
+
+#endif
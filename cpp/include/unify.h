@@ -0,0 +1,276 @@
+/*
+    Unification of Multi-Indexed G3D Attributes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __UNIFY_H__
+#define __UNIFY_H__
+
+#include <vector>
+#include <atomic>
+#include <cstring>
+
+#include "geometry.h"
+#include "parallel.h"
+#include "vim.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// An attribute with its own index buffer, such as a 3ds Max map channel or an FBX normal layer: the data values are looked up per corner through the index
+    struct IndexedChannel
+    {
+        // The values, e.g. "g3d:none:map_channel_data:1:float32:3"
+        string data;
+        // One index into the values per corner, e.g. "g3d:corner:map_channel_index:1:int32:1"
+        string index;
+        // The vertex attribute to write the values to, e.g. "g3d:vertex:map_channel:1:float32:3"
+        string output;
+    };
+
+    /// Returns the map channels written by the exporter builder (map_channel_data and map_channel_index pairs), which become "g3d:vertex:map_channel:<id>" attributes
+    inline vector<IndexedChannel> map_channels(const G3d& g)
+    {
+        vector<IndexedChannel> r;
+        for (auto& attr : g.attributes) {
+            const auto& d = attr.descriptor;
+            if (d.association != assoc_none || d.semantic != "map_channel_data")
+                continue;
+            auto id = std::to_string(d.index);
+            auto data = d.to_string();
+            auto index = "g3d:corner:map_channel_index:" + id + ":int32:1";
+            if (!g.find_attribute(index))
+                continue;
+            auto output = AttributeDescriptor::from_string(data);
+            output.association = assoc_vertex;
+            output.semantic = "map_channel";
+            r.push_back({ data, index, output.to_string() });
+        }
+        return r;
+    }
+
+    /// Converts a mesh whose channels each have their own index buffer into one with a single index buffer, as renderers need.
+    /// Every corner is keyed by the tuple of its position index and its channel indices, and each distinct tuple becomes one vertex.
+    /// Vertex attributes are gathered from the position index of the tuple, and each channel is written out as a vertex attribute.
+    /// The tuples are deduplicated in parallel with a lock-free open addressing table: each slot keeps the lowest corner with its tuple,
+    /// and vertices are numbered in the order of those corners, so the result does not depend on the thread count
+    /// and the vertices of each sub-geometry stay contiguous. Vertices that no corner refers to are dropped.
+    class AttributeUnifier
+    {
+    public:
+        AttributeUnifier(const G3d& g, const vector<IndexedChannel>& channels)
+            : g(g), mesh(g)
+        {
+            mesh.validate();
+            num_corners = mesh.num_corners();
+            for (auto& c : channels) {
+                auto data = g.find_attribute(c.data);
+                auto index = g.find_attribute(c.index);
+                if (!data || !index)
+                    throw runtime_error("Missing attribute of indexed channel " + c.data);
+                if (index->count<int32_t>() != num_corners)
+                    throw runtime_error("The channel index " + c.index + " does not have one value per corner");
+                auto values = data->num_elements();
+                auto idx = index->data<int32_t>();
+                for (size_t i = 0; i < num_corners; ++i)
+                    if (idx[i] < 0 || (size_t)idx[i] >= values)
+                        throw runtime_error("Channel index out of range in " + c.index);
+                channel_indices.push_back(idx);
+                channel_data.push_back(data);
+            }
+            this->channels = channels;
+        }
+
+        G3d unify()
+        {
+            vector<uint32_t> first = find_first_corners();
+
+            // scan[c] is the number of distinct tuples first seen before corner c, which is the new vertex of corner c when it is the first
+            const size_t grain = 1 << 16;
+            const auto num_chunks = (num_corners + grain - 1) / grain;
+            vector<uint32_t> scan(num_corners + 1), chunk_offsets(num_chunks + 1);
+            parallel_for(num_chunks, [&](size_t k) {
+                uint32_t n = 0;
+                for (auto c = k * grain; c < min(num_corners, (k + 1) * grain); ++c)
+                    n += first[c] == c;
+                chunk_offsets[k + 1] = n;
+            }, 1);
+            for (size_t k = 0; k < num_chunks; ++k)
+                chunk_offsets[k + 1] += chunk_offsets[k];
+            parallel_for(num_chunks, [&](size_t k) {
+                auto n = chunk_offsets[k];
+                for (auto c = k * grain; c < min(num_corners, (k + 1) * grain); ++c) {
+                    scan[c] = n;
+                    n += first[c] == c;
+                }
+            }, 1);
+            scan[num_corners] = chunk_offsets[num_chunks];
+            const size_t num_vertices = scan[num_corners];
+
+            // The corner each new vertex is gathered from
+            vector<uint32_t> sources(num_vertices);
+            G3d r;
+            auto indices = r.add_owned_attribute<int32_t>(descriptors::Index, num_corners);
+            parallel_for(num_corners, [&](size_t c) {
+                indices[c] = (int32_t)scan[first[c]];
+                if (first[c] == c)
+                    sources[scan[c]] = (uint32_t)c;
+            }, 4096);
+
+            for (auto& attr : g.attributes) {
+                const auto desc = attr.descriptor.to_string();
+                if (desc == descriptors::Index || desc == descriptors::SubGeoVertexOffset || is_channel(desc))
+                    continue;
+                if (attr.descriptor.association == assoc_vertex)
+                    gather(r, desc, attr, sources, [&](uint32_t c) { return (size_t)mesh.index(c); });
+                else
+                    copy_attribute(r, desc, attr);
+            }
+            for (size_t i = 0; i < channels.size(); ++i) {
+                auto idx = channel_indices[i];
+                gather(r, channels[i].output, *channel_data[i], sources, [&](uint32_t c) { return (size_t)idx[c]; });
+            }
+            if (g.find_attribute(descriptors::SubGeoVertexOffset)) {
+                auto offsets = r.add_owned_attribute<int32_t>(descriptors::SubGeoVertexOffset, mesh.num_subgeos);
+                for (size_t s = 0; s < mesh.num_subgeos; ++s)
+                    offsets[s] = (int32_t)scan[mesh.index_begin(s)];
+            }
+            return r;
+        }
+
+    private:
+        const G3d& g;
+        MeshView mesh;
+        size_t num_corners = 0;
+        vector<IndexedChannel> channels;
+        vector<const int32_t*> channel_indices;
+        vector<const Attribute*> channel_data;
+
+        bool is_channel(const string& desc) const {
+            for (auto& c : channels)
+                if (c.data == desc || c.index == desc || c.output == desc)
+                    return true;
+            return false;
+        }
+
+        uint64_t hash(size_t c) const {
+            uint64_t h = (uint64_t)(uint32_t)mesh.index(c) * 0x9E3779B97F4A7C15ull;
+            for (auto idx : channel_indices)
+                h = (h ^ (uint32_t)idx[c]) * 0xFF51AFD7ED558CCDull;
+            return h ^ (h >> 29);
+        }
+
+        bool equal(size_t a, size_t b) const {
+            if (mesh.index(a) != mesh.index(b))
+                return false;
+            for (auto idx : channel_indices)
+                if (idx[a] != idx[b])
+                    return false;
+            return true;
+        }
+
+        /// Returns, for every corner, the lowest corner with the same tuple
+        vector<uint32_t> find_first_corners()
+        {
+            size_t capacity = 16;
+            while (capacity < num_corners * 2)
+                capacity *= 2;
+            const auto mask = capacity - 1;
+            // Each slot holds a corner plus one, zero is empty
+            vector<atomic<uint32_t>> slots(capacity);
+            parallel_for(capacity, [&](size_t i) { slots[i].store(0, memory_order_relaxed); }, 1 << 16);
+
+            parallel_for(num_corners, [&](size_t c) {
+                const auto value = (uint32_t)c + 1;
+                for (auto h = hash(c) & mask;; h = (h + 1) & mask) {
+                    auto cur = slots[h].load();
+                    if (cur == 0 && slots[h].compare_exchange_strong(cur, value))
+                        return;
+                    // Another thread may have just claimed the slot, in which case cur now holds its corner
+                    if (cur != 0 && equal(cur - 1, c)) {
+                        while (value < cur && !slots[h].compare_exchange_weak(cur, value)) {}
+                        return;
+                    }
+                }
+            }, 4096);
+
+            vector<uint32_t> first(num_corners);
+            parallel_for(num_corners, [&](size_t c) {
+                for (auto h = hash(c) & mask;; h = (h + 1) & mask) {
+                    auto cur = slots[h].load(memory_order_relaxed);
+                    if (equal(cur - 1, c)) {
+                        first[c] = cur - 1;
+                        return;
+                    }
+                }
+            }, 4096);
+            return first;
+        }
+
+        template<typename Source>
+        static void gather(G3d& r, const string& desc, const Attribute& attr, const vector<uint32_t>& sources, Source source)
+        {
+            const auto size = attr.data_element_size();
+            const auto n = attr.num_elements();
+            auto dst = r.add_owned_attribute<uint8_t>(desc, sources.size() * size);
+            auto src = attr.data<uint8_t>();
+            parallel_for(sources.size(), [&](size_t v) {
+                auto i = source(sources[v]);
+                if (i >= n)
+                    throw runtime_error("Index out of range of " + desc);
+                memcpy(dst + v * size, src + i * size, size);
+            }, 4096);
+        }
+
+        static void copy_attribute(G3d& r, const string& desc, const Attribute& attr)
+        {
+            auto dst = r.add_owned_attribute<uint8_t>(desc, attr.byte_size());
+            copy(attr._begin, attr._end, dst);
+        }
+    };
+
+    /// Unifies the given indexed channels of a G3d into a single index buffer (see AttributeUnifier)
+    inline G3d unify_attributes(const G3d& g, const vector<IndexedChannel>& channels)
+    {
+        return AttributeUnifier(g, channels).unify();
+    }
+
+    /// Unifies the map channels of a G3d into a single index buffer
+    inline G3d unify_attributes(const G3d& g)
+    {
+        return unify_attributes(g, map_channels(g));
+    }
+
+    /// Reads a G3d file, unifying its map channels when it has any
+    inline G3d read_unified(const string& path)
+    {
+        G3d g;
+        g.read_file(path);
+        auto channels = map_channels(g);
+        if (channels.empty())
+            return g;
+        return unify_attributes(g, channels);
+    }
+}
+
+namespace Vim
+{
+    /// Replaces the geometry of the scene with one where its map channels share the position index (see g3d::AttributeUnifier)
+    inline void UnifyGeometry(Scene& scene)
+    {
+        auto channels = g3d::map_channels(scene.mGeometry);
+        if (!channels.empty())
+            scene.mGeometry = g3d::unify_attributes(scene.mGeometry, channels);
+    }
+
+    /// Reads a VIM file and unifies the map channels of its geometry
+    inline void ReadFileUnified(Scene& scene, const std::string& fileName)
+    {
+        scene.ReadFile(fileName);
+        UnifyGeometry(scene);
+    }
+}
+
+#endif
@@ -11,8 +11,12 @@
 #include <sstream>
 #include <unordered_map>
 #include <tuple>
+#include <type_traits>
+#include <fstream>
+#include <cstring>
 
 #include "g3d.h"
+#include "parallel.h"
 
 namespace Vim
 {
@@ -23,43 +27,11 @@ namespace Vim
         int mGeometry = -1;
         int mInstance = -1;
         float mTransform[16] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
-
-    public:
-        SceneNode() = default;
-
-        SceneNode(const SceneNode& Other)
-        {
-            mParent = Other.mParent;
-            mGeometry = Other.mGeometry;
-            mInstance = Other.mInstance;
-            memcpy(mTransform, Other.mTransform, sizeof(mTransform));
-        }
-
-        SceneNode(SceneNode&& Other) noexcept
-        {
-            mParent = Other.mParent;
-            mGeometry = Other.mGeometry;
-            mInstance = Other.mInstance;
-            memcpy(mTransform, Other.mTransform, sizeof(mTransform));
-        }
-
-        void operator =(SceneNode&& Other) noexcept
-        {
-            mParent = Other.mParent;
-            mGeometry = Other.mGeometry;
-            mInstance = Other.mInstance;
-            memcpy(mTransform, Other.mTransform, sizeof(mTransform));
-        }
-
-        void operator =(const SceneNode& Other)
-        {
-            mParent = Other.mParent;
-            mGeometry = Other.mGeometry;
-            mInstance = Other.mInstance;
-            memcpy(mTransform, Other.mTransform, sizeof(mTransform));
-        }
     };
 
+    // Nodes are read straight from the "nodes" buffer, so copies of them must be plain byte copies
+    static_assert(std::is_trivially_copyable<SceneNode>::value, "SceneNode must be trivially copyable");
+
     class SerializableProperty
     {
     public:
@@ -114,110 +86,365 @@ namespace Vim
         return tokens;
     }
 
+    /// Returns true if the text matches the pattern, where '*' matches any sequence of characters and '?' any single character
+    inline bool WildcardMatch(const std::string& pattern, const std::string& text)
+    {
+        size_t p = 0, t = 0, star = std::string::npos, retry = 0;
+        while (t < text.size())
+        {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t]))
+            {
+                ++p;
+                ++t;
+            }
+            else if (p < pattern.size() && pattern[p] == '*')
+            {
+                star = p++;
+                retry = t;
+            }
+            else if (star != std::string::npos)
+            {
+                p = star + 1;
+                t = ++retry;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        while (p < pattern.size() && pattern[p] == '*')
+            ++p;
+        return p == pattern.size();
+    }
+
+    /// Options for reading a VIM file, including which parts of it to read. Parts that are not selected are never read from the file.
+    struct ReadOptions
+    {
+        /// The most memory, in bytes, that reading a file may allocate, or zero for no limit
+        size_t mMemoryBudget = 0;
+
+        /// Patterns of the names of the entity tables to read (see WildcardMatch), or empty to read all of them
+        std::vector<std::string> mTables;
+
+        /// Patterns of the columns to read, matched against either the column name (e.g. "Name") or the name with its type (e.g. "string:Name", "index:*"), or empty to read all of them
+        std::vector<std::string> mColumns;
+
+        bool mProperties = true;
+        bool mNodes = true;
+        bool mGeometry = true;
+        bool mAssets = true;
+        bool mStrings = true;
+
+        /// Reads only the given columns of the given tables, and nothing else
+        static ReadOptions Columns(const std::vector<std::string>& tables, const std::vector<std::string>& columns)
+        {
+            ReadOptions r;
+            r.mTables = tables;
+            r.mColumns = columns;
+            r.mProperties = r.mNodes = r.mGeometry = r.mAssets = r.mStrings = false;
+            return r;
+        }
+
+        bool IncludesBuffer(const std::string& name) const
+        {
+            if (name == "nodes") return mNodes;
+            if (name == "geometry") return mGeometry;
+            if (name == "assets") return mAssets;
+            if (name == "strings") return mStrings;
+            return true;
+        }
+
+        bool IncludesTable(const std::string& name) const
+        {
+            return mTables.empty() || Matches(mTables, name);
+        }
+
+        bool IncludesColumn(const std::string& bufferName, const std::string& name) const
+        {
+            return mColumns.empty() || Matches(mColumns, bufferName) || Matches(mColumns, name);
+        }
+
+    private:
+        static bool Matches(const std::vector<std::string>& patterns, const std::string& text)
+        {
+            for (auto& p : patterns)
+                if (WildcardMatch(p, text))
+                    return true;
+            return false;
+        }
+    };
+
+    /// Counts the memory allocated while reading, and fails as soon as it would exceed the budget. It can be shared by the threads that read.
+    class MemoryBudget
+    {
+    public:
+        explicit MemoryBudget(size_t limit = 0)
+            : mLimit(limit)
+        { }
+
+        void Allocate(size_t bytes, const std::string& what)
+        {
+#if !defined(_M_CEE)
+            std::lock_guard<std::mutex> lock(mMutex);
+#endif
+            if (mLimit > 0 && mUsed + bytes > mLimit)
+                throw std::runtime_error("Reading " + what + " exceeds the memory budget");
+            mUsed += bytes;
+        }
+
+        size_t mLimit = 0;
+        size_t mUsed = 0;
+
+    private:
+#if !defined(_M_CEE)
+        std::mutex mMutex;
+#endif
+    };
+
+    /// A named buffer of a BFAST in a file, located by absolute file offsets
+    struct FileBuffer
+    {
+        std::string mName;
+        uint64_t mBegin = 0;
+        uint64_t mEnd = 0;
+
+        size_t Size() const { return (size_t)(mEnd - mBegin); }
+    };
+
+    /// Reads the buffers of a BFAST file, and of the BFASTs nested in it, one at a time, without loading the whole file
+    class BfastFileReader
+    {
+    public:
+        explicit BfastFileReader(const std::string& fileName)
+            : mStream(fileName, std::ios_base::in | std::ios_base::binary)
+        {
+            if (!mStream.is_open())
+                throw std::runtime_error("Couldn't read file");
+            mStream.seekg(0, std::ios_base::end);
+            mSize = (uint64_t)mStream.tellg();
+        }
+
+        uint64_t Size() const { return mSize; }
+
+        void Read(uint64_t offset, void* dst, size_t size)
+        {
+            if (size == 0)
+                return;
+            if (offset + size > mSize)
+                throw std::runtime_error("Read past the end of the file");
+            mStream.seekg((std::streamoff)offset, std::ios_base::beg);
+            mStream.read((char*)dst, (std::streamsize)size);
+            if (!mStream)
+                throw std::runtime_error("Couldn't read file");
+        }
+
+        /// Reads the contents of a buffer as an array of T
+        template<typename T>
+        void Read(const FileBuffer& buffer, std::vector<T>& r)
+        {
+            r.resize(buffer.Size() / sizeof(T));
+            Read(buffer.mBegin, r.data(), r.size() * sizeof(T));
+        }
+
+        /// Reads the table of buffers of the BFAST stored in the given range of the file. The buffers are in file order.
+        std::vector<FileBuffer> ReadBuffers(uint64_t begin, uint64_t end)
+        {
+            bfast::Header h;
+            if (end < begin || end - begin < sizeof(h))
+                throw std::runtime_error("The BFAST is too small");
+            Read(begin, &h, sizeof(h));
+            if (h.magic != bfast::MAGIC)
+                throw std::runtime_error("invalid magic number, either not a BFast, or was created on a machine with different endianess");
+            if (h.num_arrays == 0)
+                return {};
+            if (h.num_arrays > (end - begin - bfast::array_offsets_start) / sizeof(bfast::ArrayOffset))
+                throw std::runtime_error("The BFAST array offsets are past its end");
+
+            std::vector<bfast::ArrayOffset> offsets(h.num_arrays);
+            Read(begin + bfast::array_offsets_start, offsets.data(), offsets.size() * sizeof(bfast::ArrayOffset));
+            for (size_t i = 0; i < offsets.size(); ++i)
+            {
+                if (offsets[i]._begin > offsets[i]._end)
+                    throw std::runtime_error("Offset begin is after the offset end");
+                if (offsets[i]._end > end - begin)
+                    throw std::runtime_error("Offset end is after the end of the data");
+                if (i > 0 && offsets[i]._begin < offsets[i - 1]._end)
+                    throw std::runtime_error("Offset begin is before the end of the previous offset");
+            }
+
+            std::vector<bfast::byte> nameData(offsets[0]._end - offsets[0]._begin + 1, 0);
+            Read(begin + offsets[0]._begin, nameData.data(), nameData.size() - 1);
+            auto names = bfast::Bfast::split_names(bfast::ByteRange{ nameData.data(), nameData.data() + nameData.size() - 1 });
+            if (names.size() != offsets.size() - 1)
+                throw std::runtime_error("The number of names does not match the raw data size");
+
+            std::vector<FileBuffer> r(names.size());
+            for (size_t i = 0; i < names.size(); ++i)
+                r[i] = FileBuffer{ names[i], begin + offsets[i + 1]._begin, begin + offsets[i + 1]._end };
+            return r;
+        }
+
+    private:
+        std::ifstream mStream;
+        uint64_t mSize = 0;
+    };
+
     class Scene
     {
     public:
+        // Not filled in by ReadFile, which streams the file buffer by buffer instead of loading it whole
         bfast::Bfast mBfast;
         bfast::Bfast mGeometryBFast;
         bfast::Bfast mAssetsBFast;
+        // Not filled in by ReadFile: the entity tables are read column by column
         bfast::Bfast mEntitiesBFast;
         std::vector<SceneNode> mNodes;
         std::vector<const bfast::byte*> mStrings;
+        // The bytes of the strings, which mStrings point into
+        std::vector<bfast::byte> mStringData;
         g3d::G3d mGeometry;
         std::unordered_map<std::string, EntityTable> mEntityTables;
         std::unordered_map<std::string, std::string> mHeader;
+        /// The bytes allocated by the last ReadFile for the parts it read
+        size_t mMemoryUsed = 0;
 
-        void ReadFile(std::string fileName)
+        /// Reads the buffers of the file, each straight into its final place, so that no more than the final size of the scene is ever allocated.
+        /// Nodes and entity columns are read directly into their arrays, and the geometry, assets and strings are read into the buffers they are used from.
+        /// The entity tables are independent, so each is decoded as a separate task, concurrently with the geometry, strings and other buffers.
+        /// Tasks are claimed by the threads as they become free, and every task reads the file through its own stream.
+        /// Only the parts selected by the options are read, and the tables and columns that are not selected don't appear in mEntityTables.
+        /// Throws if the scene would need more memory than the budget of the options.
+        void ReadFile(std::string fileName, const ReadOptions& options = ReadOptions())
         {
-            mBfast = bfast::Bfast::read_file(fileName);
-            for (auto i = 0; i < mBfast.buffers.size(); ++i)
+            *this = Scene();
+            MemoryBudget budget(options.mMemoryBudget);
+            BfastFileReader reader(fileName);
+            std::vector<FileBuffer> buffers, tables;
+            for (auto& b : reader.ReadBuffers(0, reader.Size()))
             {
-                auto& b = mBfast.buffers[i];
-                if (b.name == "header")
+                if (b.mName == "entities")
                 {
-                    std::string header = (const char*)b.data.begin();
-                    std::vector<std::string> tokens = split(header, ":");
+                    for (auto& t : reader.ReadBuffers(b.mBegin, b.mEnd))
+                        if (options.IncludesTable(t.mName))
+                            tables.push_back(t);
+                }
+                else if (options.IncludesBuffer(b.mName))
+                {
+                    buffers.push_back(b);
+                }
+            }
+
+            std::vector<EntityTable> entityTables(tables.size());
+            g3d::parallel_for(buffers.size() + tables.size(), [&](size_t i) {
+                BfastFileReader taskReader(fileName);
+                if (i < buffers.size())
+                    ReadBuffer(taskReader, buffers[i], budget);
+                else
+                    ReadEntityTable(taskReader, tables[i - buffers.size()], entityTables[i - buffers.size()], budget, options);
+            }, 1);
+
+            mEntityTables.reserve(entityTables.size());
+            for (auto& entityTable : entityTables)
+            {
+                auto name = entityTable.mName;
+                mEntityTables[name] = std::move(entityTable);
+            }
+            mMemoryUsed = budget.mUsed;
+        }
 
-                    for (size_t i = 0; i < tokens.size(); i += 2)
-                    {
-                        mHeader[tokens[i]] = tokens[i + 1];
-                    }
+    private:
+        /// Reads a top-level buffer other than the entities
+        void ReadBuffer(BfastFileReader& reader, const FileBuffer& b, MemoryBudget& budget)
+        {
+            if (b.mName == "header")
+            {
+                std::string header(b.Size(), '\0');
+                reader.Read(b.mBegin, &header[0], header.size());
+                header.resize(strlen(header.c_str()));
+                std::vector<std::string> tokens = split(header, ":");
+
+                for (size_t i = 0; i + 1 < tokens.size(); i += 2)
+                {
+                    mHeader[tokens[i]] = tokens[i + 1];
                 }
-                else if (b.name == "nodes")
+            }
+            else if (b.mName == "nodes")
+            {
+                budget.Allocate(b.Size(), b.mName);
+                reader.Read(b, mNodes);
+            }
+            else if (b.mName == "geometry")
+            {
+                mGeometryBFast = ReadBfast(reader, b, budget);
+                mGeometry = g3d::G3d(mGeometryBFast);
+            }
+            else if (b.mName == "assets")
+            {
+                mAssetsBFast = ReadBfast(reader, b, budget);
+            }
+            else if (b.mName == "strings")
+            {
+                // One extra null terminates the last string
+                budget.Allocate(b.Size() + 1, b.mName);
+                mStringData.assign(b.Size() + 1, 0);
+                reader.Read(b.mBegin, mStringData.data(), b.Size());
+                const bfast::byte* data = mStringData.data();
+                const bfast::byte* end = data + b.Size();
+                while (data < end)
+                {
+                    mStrings.push_back(data);
+                    data += strlen((const char*)data) + 1;
+                }
+            }
+        }
+
+        /// Reads the columns and properties of an entity table
+        static void ReadEntityTable(BfastFileReader& reader, const FileBuffer& entityBuffer, EntityTable& entityTable, MemoryBudget& budget, const ReadOptions& options)
+        {
+            entityTable.mName = entityBuffer.mName;
+            for (auto& tableBuffer : reader.ReadBuffers(entityBuffer.mBegin, entityBuffer.mEnd))
+            {
+                size_t index = tableBuffer.mName.find_first_of(':');
+                std::string type = tableBuffer.mName.substr(0, index);
+                std::string name = tableBuffer.mName.substr(index + 1);
+
+                if (tableBuffer.mName == "properties" ? !options.mProperties : !options.IncludesColumn(tableBuffer.mName, name))
                 {
-                    mNodes = std::move(std::vector<SceneNode>((SceneNode*)b.data.begin(), (SceneNode*)b.data.end()));
+                    continue;
                 }
-                else if (b.name == "geometry")
+                else if (tableBuffer.mName == "properties")
                 {
-                    mGeometryBFast = bfast::Bfast::unpack(b.data);
-                    mGeometry = std::move(g3d::G3d(mGeometryBFast));
+                    budget.Allocate(tableBuffer.Size(), entityBuffer.mName + " " + tableBuffer.mName);
+                    reader.Read(tableBuffer, entityTable.mProperties);
                 }
-                else if (b.name == "assets")
+                else if (type == "numeric")
                 {
-                    mAssetsBFast = bfast::Bfast::unpack(b.data);
+                    budget.Allocate(tableBuffer.Size(), entityBuffer.mName + " " + tableBuffer.mName);
+                    reader.Read(tableBuffer, entityTable.mNumericColumns[name]);
                 }
-                else if (b.name == "strings")
+                else if (type == "index")
                 {
-                    const bfast::byte* data = b.data.begin();
-                    size_t count = 0;
-                    while (data < b.data.end())
-                    {
-                        count++;
-                        data += strlen((const char*)data) + 1;
-                    }
-
-                    mStrings.resize(count);
-                    count = 0;
-                    data = b.data.begin();
-                    while (data < b.data.end())
-                    {
-                        mStrings[count++] = data;
-                        data += strlen((const char*)data) + 1;
-                    }
+                    budget.Allocate(tableBuffer.Size(), entityBuffer.mName + " " + tableBuffer.mName);
+                    reader.Read(tableBuffer, entityTable.mIndexColumns[name]);
                 }
-                else if (b.name == "entities")
+                else if (type == "string")
                 {
-                    mEntitiesBFast = bfast::Bfast::unpack(b.data);
-                    for (auto j = 0; j < mEntitiesBFast.buffers.size(); ++j)
-                    {
-                        auto& entityBuffer = mEntitiesBFast.buffers[j];
-                        EntityTable entityTable = { entityBuffer.name };
-                        bfast::Bfast tableBFast = bfast::Bfast::unpack(entityBuffer.data);
-
-                        for (auto k = 0; k < tableBFast.buffers.size(); ++k)
-                        {
-                            auto& tableBuffer = tableBFast.buffers[k];
-                        
-                            if (tableBuffer.name == "properties")
-                            {
-                                entityTable.mProperties = std::vector<SerializableProperty>((SerializableProperty*)tableBuffer.data.begin(), (SerializableProperty*)tableBuffer.data.end());
-                            }
-                            else 
-                            {
-                                size_t index = tableBuffer.name.find_first_of(':');
-                                std::string type = tableBuffer.name.substr(0, index);
-                                std::string name = tableBuffer.name.substr(index + 1);
-
-                                if (type == "numeric")
-                                {
-                                    entityTable.mNumericColumns[name] = std::vector<double>((double*)tableBuffer.data.begin(), (double*)tableBuffer.data.end());
-                                }
-                                else if (type == "index")
-                                {
-                                    entityTable.mIndexColumns[name] = std::vector<int>((int*)tableBuffer.data.begin(), (int*)tableBuffer.data.end());
-                                }
-                                else if (type == "string")
-                                {
-                                    entityTable.mStringColumns[name] = std::vector<int>((int*)tableBuffer.data.begin(), (int*)tableBuffer.data.end());
-                                }
-                            }
-                        }
-
-                        mEntityTables[entityTable.mName] = entityTable;
-                    }
+                    budget.Allocate(tableBuffer.Size(), entityBuffer.mName + " " + tableBuffer.mName);
+                    reader.Read(tableBuffer, entityTable.mStringColumns[name]);
                 }
             }
         }
+
+        /// Reads a nested BFAST into memory it owns
+        static bfast::Bfast ReadBfast(BfastFileReader& reader, const FileBuffer& buffer, MemoryBudget& budget)
+        {
+            if (buffer.Size() == 0)
+                return bfast::Bfast();
+            budget.Allocate(buffer.Size(), buffer.mName);
+            std::vector<bfast::byte> data(buffer.Size());
+            reader.Read(buffer.mBegin, data.data(), data.size());
+            return bfast::Bfast::unpack(std::move(data));
+        }
     };
 
 }
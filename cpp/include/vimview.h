@@ -0,0 +1,170 @@
+/*
+    Zero-Copy View of a VIM File
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __VIMVIEW_H__
+#define __VIMVIEW_H__
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+
+#include "vim.h"
+#include "mapped.h"
+
+namespace Vim
+{
+    /// A typed, read-only range of elements stored elsewhere
+    template<typename T>
+    class Span
+    {
+    public:
+        Span() = default;
+        Span(const T* begin, const T* end) : mBegin(begin), mEnd(end) { }
+
+        /// Views the whole elements of a byte range
+        static Span FromBytes(const bfast::ByteRange& range) {
+            auto begin = (const T*)range.begin();
+            return Span(begin, begin + range.size() / sizeof(T));
+        }
+
+        const T* begin() const { return mBegin; }
+        const T* end() const { return mEnd; }
+        const T* data() const { return mBegin; }
+        size_t size() const { return mEnd - mBegin; }
+        bool empty() const { return mBegin == mEnd; }
+        const T& operator[](size_t i) const { return mBegin[i]; }
+
+        std::vector<T> ToVector() const { return std::vector<T>(mBegin, mEnd); }
+
+    private:
+        const T* mBegin = nullptr;
+        const T* mEnd = nullptr;
+    };
+
+    /// An entity table whose columns and properties are views of the source bytes
+    class EntityTableView
+    {
+    public:
+        std::string mName;
+
+        std::unordered_map<std::string, Span<int>> mIndexColumns;
+        std::unordered_map<std::string, Span<int>> mStringColumns;
+        std::unordered_map<std::string, Span<double>> mNumericColumns;
+        Span<SerializableProperty> mProperties;
+    };
+
+    /// A VIM scene that refers to its source bytes instead of copying them. When it is read from a file, the file is memory mapped,
+    /// so opening takes the time to parse the buffer tables only, and memory is used only for the parts that are accessed.
+    /// Nodes, columns, properties, strings and geometry attributes all point into the mapping, which lives as long as the view.
+    class SceneView
+    {
+    public:
+        bfast::MappedFile mFile;
+        bfast::Bfast mBfast;
+        bfast::Bfast mGeometryBFast;
+        bfast::Bfast mAssetsBFast;
+        bfast::Bfast mEntitiesBFast;
+        Span<SceneNode> mNodes;
+        /// The null-terminated strings, one after the other
+        Span<char> mStringData;
+        g3d::G3d mGeometry;
+        std::unordered_map<std::string, EntityTableView> mEntityTables;
+        std::unordered_map<std::string, std::string> mHeader;
+
+        SceneView() = default;
+        SceneView(const SceneView&) = delete;
+        SceneView& operator=(const SceneView&) = delete;
+        SceneView(SceneView&&) = default;
+        SceneView& operator=(SceneView&&) = default;
+
+        /// Maps the file and views its contents
+        void ReadFile(const std::string& fileName)
+        {
+            mFile.open(fileName);
+            Read(mFile.range());
+        }
+
+        /// Views a VIM in memory, which must outlive the view. Anything viewed before is dropped.
+        void Read(const bfast::ByteRange& data)
+        {
+            // Everything but the file mapping may point into data that is no longer mapped, so it is reset
+            auto file = std::move(mFile);
+            *this = SceneView();
+            mFile = std::move(file);
+            mBfast = bfast::Bfast::unpack(data);
+            for (auto& b : mBfast.buffers)
+            {
+                if (b.name == "header")
+                {
+                    std::string header(b.data.begin(), std::find(b.data.begin(), b.data.end(), 0));
+                    auto tokens = split(header, ":");
+                    for (size_t i = 0; i + 1 < tokens.size(); i += 2)
+                        mHeader[tokens[i]] = tokens[i + 1];
+                }
+                else if (b.name == "nodes")
+                {
+                    mNodes = Span<SceneNode>::FromBytes(b.data);
+                }
+                else if (b.name == "geometry")
+                {
+                    mGeometryBFast = bfast::Bfast::unpack(b.data);
+                    mGeometry = g3d::G3d(mGeometryBFast);
+                }
+                else if (b.name == "assets")
+                {
+                    mAssetsBFast = bfast::Bfast::unpack(b.data);
+                }
+                else if (b.name == "strings")
+                {
+                    mStringData = Span<char>::FromBytes(b.data);
+                }
+                else if (b.name == "entities")
+                {
+                    mEntitiesBFast = bfast::Bfast::unpack(b.data);
+                    for (auto& entityBuffer : mEntitiesBFast.buffers)
+                    {
+                        auto& table = mEntityTables[entityBuffer.name];
+                        table.mName = entityBuffer.name;
+                        auto tableBFast = bfast::Bfast::unpack(entityBuffer.data);
+                        for (auto& tableBuffer : tableBFast.buffers)
+                        {
+                            if (tableBuffer.name == "properties")
+                            {
+                                table.mProperties = Span<SerializableProperty>::FromBytes(tableBuffer.data);
+                                continue;
+                            }
+                            auto index = tableBuffer.name.find_first_of(':');
+                            auto type = tableBuffer.name.substr(0, index);
+                            auto name = tableBuffer.name.substr(index + 1);
+                            if (type == "numeric")
+                                table.mNumericColumns[name] = Span<double>::FromBytes(tableBuffer.data);
+                            else if (type == "index")
+                                table.mIndexColumns[name] = Span<int>::FromBytes(tableBuffer.data);
+                            else if (type == "string")
+                                table.mStringColumns[name] = Span<int>::FromBytes(tableBuffer.data);
+                        }
+                    }
+                }
+            }
+        }
+
+        /// Collects a pointer to the start of every string. This touches all of the string data.
+        std::vector<const char*> GetStrings() const
+        {
+            std::vector<const char*> r;
+            auto p = mStringData.begin();
+            while (p < mStringData.end())
+            {
+                r.push_back(p);
+                p = std::find(p, mStringData.end(), '\0') + 1;
+            }
+            return r;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,531 @@
+/*
+    Surface and Solid Voxelization of G3D Instances and VIM Scene Nodes
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __VOXELIZE_H__
+#define __VOXELIZE_H__
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "bits.h"
+#include "geometry.h"
+#include "parallel.h"
+#include "culling.h"
+#include "vim.h"
+#include "transforms.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// A regular grid of nx * ny * nz cubic voxels starting at origin
+    struct VoxelGrid
+    {
+        Vector3 origin = { 0, 0, 0 };
+        float voxel_size = 1;
+        int32_t nx = 0, ny = 0, nz = 0;
+
+        /// Returns the smallest grid of the given voxel size that covers the bounds
+        static VoxelGrid fit(const AABox& bounds, float voxel_size) {
+            if (!(voxel_size > 0))
+                throw runtime_error("The voxel size must be positive");
+            VoxelGrid r;
+            r.voxel_size = voxel_size;
+            if (bounds.is_empty()) return r;
+            r.origin = bounds.min;
+            auto e = bounds.extent();
+            r.nx = max(1, (int32_t)ceil(e.x / voxel_size));
+            r.ny = max(1, (int32_t)ceil(e.y / voxel_size));
+            r.nz = max(1, (int32_t)ceil(e.z / voxel_size));
+            return r;
+        }
+
+        size_t num_voxels() const { return (size_t)nx * ny * nz; }
+        int32_t bricks_x() const { return (nx + 7) / 8; }
+        int32_t bricks_y() const { return (ny + 7) / 8; }
+        int32_t bricks_z() const { return (nz + 7) / 8; }
+        uint64_t brick_key(int32_t bx, int32_t by, int32_t bz) const { return ((uint64_t)bz * bricks_y() + by) * bricks_x() + bx; }
+
+        AABox voxel_box(int32_t x, int32_t y, int32_t z) const {
+            auto min = origin + Vector3{ x * voxel_size, y * voxel_size, z * voxel_size };
+            return { min, min + Vector3{ voxel_size, voxel_size, voxel_size } };
+        }
+    };
+
+    /// 8 x 8 x 8 voxels. Word z holds the layer z, with voxel (x, y) at bit y * 8 + x.
+    struct VoxelBrick
+    {
+        uint64_t bits[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+        bool get(int32_t x, int32_t y, int32_t z) const { return (bits[z] >> (y * 8 + x)) & 1; }
+        bool empty() const {
+            uint64_t r = 0;
+            for (auto w : bits) r |= w;
+            return r == 0;
+        }
+    };
+
+    /// A sparse voxel grid: only the bricks that contain set voxels are stored, ordered by their key (see VoxelGrid::brick_key).
+    /// If ids are stored, each brick has 512 of them in the order of its bits, with -1 for voxels that are not set.
+    struct BrickMap
+    {
+        VoxelGrid grid;
+        vector<uint64_t> keys;
+        vector<VoxelBrick> bricks;
+        vector<int32_t> ids;
+
+        /// Returns the index of the brick that contains the voxel, or -1 if there is none
+        int64_t find(int32_t x, int32_t y, int32_t z) const {
+            if (x < 0 || y < 0 || z < 0 || x >= grid.nx || y >= grid.ny || z >= grid.nz) return -1;
+            auto key = grid.brick_key(x / 8, y / 8, z / 8);
+            auto it = lower_bound(keys.begin(), keys.end(), key);
+            return it != keys.end() && *it == key ? it - keys.begin() : -1;
+        }
+
+        bool get(int32_t x, int32_t y, int32_t z) const {
+            auto b = find(x, y, z);
+            return b >= 0 && bricks[b].get(x & 7, y & 7, z & 7);
+        }
+
+        /// The id of the instance that set the voxel, or -1
+        int32_t id(int32_t x, int32_t y, int32_t z) const {
+            auto b = find(x, y, z);
+            return b >= 0 && !ids.empty() ? ids[b * 512 + (z & 7) * 64 + (y & 7) * 8 + (x & 7)] : -1;
+        }
+
+        size_t count() const {
+            size_t r = 0;
+            for (auto& b : bricks)
+                for (auto w : b.bits)
+                    r += popcount(w);
+            return r;
+        }
+    };
+
+    /// A dense voxel grid. Each row of voxels along x starts at a new 64-bit word, so rows can be written independently.
+    struct DenseVoxels
+    {
+        VoxelGrid grid;
+        size_t row_words = 0;
+        Bitset bits;
+        vector<int32_t> ids;
+
+        size_t bit_index(int32_t x, int32_t y, int32_t z) const { return ((size_t)z * grid.ny + y) * row_words * 64 + x; }
+        bool get(int32_t x, int32_t y, int32_t z) const { return bits.get(bit_index(x, y, z)); }
+        int32_t id(int32_t x, int32_t y, int32_t z) const { return ids.empty() ? -1 : ids[((size_t)z * grid.ny + y) * grid.nx + x]; }
+    };
+
+    /// Expands a brick map into a dense grid, one row of voxels at a time in parallel
+    inline DenseVoxels to_dense(const BrickMap& map)
+    {
+        DenseVoxels r;
+        r.grid = map.grid;
+        r.row_words = (map.grid.nx + 63) / 64;
+        r.bits.resize(r.row_words * 64 * map.grid.ny * map.grid.nz);
+        if (!map.ids.empty())
+            r.ids.assign(map.grid.num_voxels(), -1);
+        parallel_for((size_t)map.grid.ny * map.grid.nz, [&](size_t row) {
+            auto y = (int32_t)(row % map.grid.ny), z = (int32_t)(row / map.grid.ny);
+            auto words = &r.bits.words[row * r.row_words];
+            for (int32_t bx = 0; bx < map.grid.bricks_x(); ++bx) {
+                auto b = map.find(bx * 8, y, z);
+                if (b < 0) continue;
+                auto byte = (map.bricks[b].bits[z & 7] >> ((y & 7) * 8)) & 0xFF;
+                words[bx / 8] |= byte << ((bx % 8) * 8);
+                if (!r.ids.empty())
+                    for (int32_t x = 0; x < 8 && bx * 8 + x < map.grid.nx; ++x)
+                        r.ids[row * map.grid.nx + bx * 8 + x] = map.ids[b * 512 + (z & 7) * 64 + (y & 7) * 8 + x];
+            }
+        }, 64);
+        return r;
+    }
+
+    enum VoxelMode
+    {
+        voxel_surface,  // voxels that overlap a triangle
+        voxel_solid,    // voxels that overlap a triangle, or whose center is inside a closed instance
+    };
+
+    struct VoxelizeOptions
+    {
+        VoxelMode mode = voxel_surface;
+
+        /// Store, for each voxel, the index of the instance that set it. Where instances overlap, the lowest index wins.
+        bool store_ids = true;
+    };
+
+    /// The triangle-box overlap test of Schwarz and Seidel ("Fast Parallel Surface and Solid Voxelization on GPUs", 2010), set up for one triangle.
+    /// A voxel overlaps the triangle if it overlaps the triangle's plane and its projections onto the xy, yz and zx planes overlap the triangle's projections.
+    /// Each test is linear in the voxel position, so a row of voxels along x is tested at once.
+    struct VoxelTriangle
+    {
+        Vector3 n;
+        float d1, d2;
+        float xy[3][3], yz[3][3], zx[3][3];
+        int32_t min[3], max[3];
+
+        /// Sets up the test for a triangle in grid coordinates (relative to the grid origin). Returns false if the triangle is degenerate or outside the grid.
+        bool setup(const Vector3* v, const VoxelGrid& grid)
+        {
+            const auto s = grid.voxel_size;
+            n = cross(v[1] - v[0], v[2] - v[0]);
+            if (!(dot(n, n) > 0))
+                return false;
+            const int32_t dims[3] = { grid.nx, grid.ny, grid.nz };
+            for (auto i = 0; i < 3; ++i) {
+                auto lo = std::min(v[0][i], std::min(v[1][i], v[2][i]));
+                auto hi = std::max(v[0][i], std::max(v[1][i], v[2][i]));
+                min[i] = std::max(0, (int32_t)floor(lo / s));
+                max[i] = std::min(dims[i] - 1, (int32_t)floor(hi / s));
+                if (min[i] > max[i])
+                    return false;
+            }
+
+            Vector3 c = { n.x > 0 ? s : 0, n.y > 0 ? s : 0, n.z > 0 ? s : 0 };
+            d1 = dot(n, c - v[0]);
+            d2 = dot(n, Vector3{ s, s, s } - c - v[0]);
+
+            // Edge functions of the projections. Plane (a, b) uses coordinates a and b, and the sign of the remaining normal component.
+            auto edges = [&](float (*out)[3], int a, int b, float sign) {
+                for (auto i = 0; i < 3; ++i) {
+                    auto e = v[(i + 1) % 3] - v[i];
+                    auto na = -e[b] * sign, nb = e[a] * sign;
+                    out[i][0] = na;
+                    out[i][1] = nb;
+                    out[i][2] = -(na * v[i][a] + nb * v[i][b]) + std::max(0.0f, s * na) + std::max(0.0f, s * nb);
+                }
+            };
+            edges(xy, 0, 1, n.z < 0 ? -1.0f : 1.0f);
+            edges(yz, 1, 2, n.x < 0 ? -1.0f : 1.0f);
+            edges(zx, 2, 0, n.y < 0 ? -1.0f : 1.0f);
+            return true;
+        }
+
+        /// Tests the voxels (x0 + i, y, z) for i in [0, 8) and returns a bit mask of those that overlap the triangle.
+        /// The caller restricts the mask to the triangle bounds.
+        uint32_t test_row(int32_t x0, int32_t y, int32_t z, float s) const
+        {
+            const auto py = y * s, pz = z * s;
+            for (auto i = 0; i < 3; ++i)
+                if (yz[i][0] * py + yz[i][1] * pz + yz[i][2] < 0)
+                    return 0;
+            const auto plane_yz = n.y * py + n.z * pz;
+#if defined(__AVX2__) || defined(__AVX512F__)
+            auto px = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps((float)x0), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)), _mm256_set1_ps(s));
+            auto np = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(n.x), px), _mm256_set1_ps(plane_yz));
+            auto pass = _mm256_cmp_ps(_mm256_mul_ps(_mm256_add_ps(np, _mm256_set1_ps(d1)), _mm256_add_ps(np, _mm256_set1_ps(d2))), _mm256_setzero_ps(), _CMP_LE_OQ);
+            for (auto i = 0; i < 3; ++i) {
+                auto exy = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(xy[i][0]), px), _mm256_set1_ps(xy[i][1] * py + xy[i][2]));
+                auto ezx = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(zx[i][1]), px), _mm256_set1_ps(zx[i][0] * pz + zx[i][2]));
+                pass = _mm256_and_ps(pass, _mm256_cmp_ps(exy, _mm256_setzero_ps(), _CMP_GE_OQ));
+                pass = _mm256_and_ps(pass, _mm256_cmp_ps(ezx, _mm256_setzero_ps(), _CMP_GE_OQ));
+            }
+            return (uint32_t)_mm256_movemask_ps(pass);
+#else
+            uint32_t r = 0;
+            for (auto l = 0; l < 8; ++l) {
+                auto px = (x0 + l) * s;
+                auto np = n.x * px + plane_yz;
+                auto pass = (np + d1) * (np + d2) <= 0;
+                for (auto i = 0; i < 3; ++i) {
+                    pass &= xy[i][0] * px + xy[i][1] * py + xy[i][2] >= 0;
+                    pass &= zx[i][0] * pz + zx[i][1] * px + zx[i][2] >= 0;
+                }
+                r |= (uint32_t)pass << l;
+            }
+            return r;
+#endif
+        }
+    };
+
+    /// Voxelizes instances into a brick map.
+    /// Triangles are binned into the 8 x 8 x 8 bricks (tiles) they may overlap. The bins are sorted by brick with a parallel radix sort,
+    /// and then each brick is filled in parallel, testing each of its triangles against rows of 8 voxels at once.
+    /// In solid mode, the interior of each instance is found by casting rays along x through the voxel centers and filling between pairs of crossings,
+    /// so instances must be closed for their interior to be filled.
+    class Voxelizer
+    {
+    public:
+        Voxelizer(const G3d& g, const InstanceView& instances, const VoxelGrid& grid, const VoxelizeOptions& options)
+            : mesh(g), instances(instances), grid(grid), options(options)
+        { }
+
+        BrickMap run()
+        {
+            BrickMap r;
+            r.grid = grid;
+            if (grid.num_voxels() == 0)
+                return r;
+
+            // Bin the triangles and interior spans of each range of instances
+            const size_t grain = 64;
+            vector<Chunk> chunks((instances.count + grain - 1) / grain);
+            parallel_for_chunks(instances.count, grain, [&](size_t begin, size_t end) {
+                auto& chunk = chunks[begin / grain];
+                vector<Hit> hits;
+                for (auto i = begin; i < end; ++i)
+                    bin_instance((int32_t)i, chunk, hits);
+            });
+
+            size_t num_work = 0;
+            for (auto& c : chunks) {
+                for (auto& w : c.work)
+                    if (w.item < 0)
+                        w.item = ~(int32_t)(~w.item + spans.size());
+                spans.insert(spans.end(), c.spans.begin(), c.spans.end());
+                num_work += c.keys.size();
+            }
+            vector<uint64_t> keys;
+            vector<Work> work;
+            keys.reserve(num_work);
+            work.reserve(num_work);
+            for (auto& c : chunks) {
+                keys.insert(keys.end(), c.keys.begin(), c.keys.end());
+                work.insert(work.end(), c.work.begin(), c.work.end());
+                c = Chunk();
+            }
+
+            // The sort is stable and the work is in instance order, so each brick sees its instances in increasing order
+            radix_sort(keys, work);
+            vector<size_t> runs;
+            for (size_t i = 0; i < keys.size(); ++i)
+                if (i == 0 || keys[i] != keys[i - 1])
+                    runs.push_back(i);
+            runs.push_back(keys.size());
+
+            const auto num_bricks = runs.size() - 1;
+            vector<VoxelBrick> bricks(num_bricks);
+            vector<int32_t> ids(options.store_ids ? num_bricks * 512 : 0, -1);
+            parallel_for(num_bricks, [&](size_t b) {
+                fill_brick(keys[runs[b]], &work[runs[b]], runs[b + 1] - runs[b], bricks[b], options.store_ids ? &ids[b * 512] : nullptr);
+            }, 16);
+
+            for (size_t b = 0; b < num_bricks; ++b) {
+                if (bricks[b].empty()) continue;
+                r.keys.push_back(keys[runs[b]]);
+                r.bricks.push_back(bricks[b]);
+                if (options.store_ids)
+                    r.ids.insert(r.ids.end(), ids.begin() + b * 512, ids.begin() + (b + 1) * 512);
+            }
+            return r;
+        }
+
+    private:
+        /// A triangle (item >= 0) or an interior span (item < 0, the span is ~item) of an instance that touches a brick
+        struct Work
+        {
+            int32_t instance;
+            int32_t item;
+        };
+
+        /// A run of interior voxel centers [x_begin, x_end) along x
+        struct Span
+        {
+            int32_t y, z, x_begin, x_end;
+        };
+
+        struct Hit
+        {
+            int32_t y, z;
+            float x;
+
+            bool operator<(const Hit& h) const { return z != h.z ? z < h.z : y != h.y ? y < h.y : x < h.x; }
+        };
+
+        struct Chunk
+        {
+            vector<uint64_t> keys;
+            vector<Work> work;
+            vector<Span> spans;
+        };
+
+        MeshView mesh;
+        InstanceView instances;
+        VoxelGrid grid;
+        VoxelizeOptions options;
+        vector<Span> spans;
+
+        /// Gets a triangle of an instance in grid coordinates
+        void triangle(int32_t instance, size_t t, Vector3* v) const
+        {
+            size_t c[3];
+            mesh.triangle_corners(instances.subgeo(instance), t, c);
+            for (auto k = 0; k < 3; ++k)
+                v[k] = transform_point(instances.transform(instance), mesh.corner_position(c[k])) - grid.origin;
+        }
+
+        void bin_instance(int32_t instance, Chunk& chunk, vector<Hit>& hits) const
+        {
+            auto s = instances.subgeo(instance);
+            if (s < 0 || (size_t)s >= mesh.num_subgeos) return;
+            const auto size = grid.voxel_size * 8;
+            hits.clear();
+
+            for (size_t t = 0; t < mesh.num_triangles(s); ++t) {
+                Vector3 v[3];
+                triangle(instance, t, v);
+                VoxelTriangle tri;
+                if (tri.setup(v, grid)) {
+                    // Skip the bricks in the triangle bounds that its plane misses
+                    auto offset = dot(tri.n, v[0]);
+                    for (auto bz = tri.min[2] / 8; bz <= tri.max[2] / 8; ++bz)
+                        for (auto by = tri.min[1] / 8; by <= tri.max[1] / 8; ++by)
+                            for (auto bx = tri.min[0] / 8; bx <= tri.max[0] / 8; ++bx) {
+                                Vector3 lo = { bx * size, by * size, bz * size };
+                                float a = 0, b = 0;
+                                for (auto i = 0; i < 3; ++i) {
+                                    auto p = tri.n[i] * lo[i], q = tri.n[i] * (lo[i] + size);
+                                    a += std::min(p, q);
+                                    b += std::max(p, q);
+                                }
+                                if (offset < a || offset > b) continue;
+                                chunk.keys.push_back(grid.brick_key(bx, by, bz));
+                                chunk.work.push_back({ instance, (int32_t)t });
+                            }
+                }
+                if (options.mode == voxel_solid)
+                    add_hits(v, hits);
+            }
+
+            if (options.mode == voxel_solid && !hits.empty())
+                add_spans(instance, hits, chunk);
+        }
+
+        /// Adds the crossings of the triangle with the rays along +x through the voxel centers.
+        /// Centers on a shared edge are counted for only one of the triangles (the top-left rule), so closed meshes give an even number of crossings per ray.
+        void add_hits(const Vector3* v, vector<Hit>& hits) const
+        {
+            const auto s = grid.voxel_size;
+            Vector3 a = v[0], b = v[1], c = v[2];
+            auto area = (b.y - a.y) * (c.z - a.z) - (b.z - a.z) * (c.y - a.y);
+            if (area == 0) return;
+            if (area < 0) swap(b, c);
+            auto n = cross(b - a, c - a);
+            auto offset = dot(n, a);
+
+            auto y0 = std::max(0, (int32_t)ceil(std::min(a.y, std::min(b.y, c.y)) / s - 0.5f));
+            auto y1 = std::min(grid.ny - 1, (int32_t)floor(std::max(a.y, std::max(b.y, c.y)) / s - 0.5f));
+            auto z0 = std::max(0, (int32_t)ceil(std::min(a.z, std::min(b.z, c.z)) / s - 0.5f));
+            auto z1 = std::min(grid.nz - 1, (int32_t)floor(std::max(a.z, std::max(b.z, c.z)) / s - 0.5f));
+
+            auto inside = [](const Vector3& p, const Vector3& q, float y, float z) {
+                auto w = (q.y - p.y) * (z - p.z) - (q.z - p.z) * (y - p.y);
+                if (w != 0) return w > 0;
+                // On the edge: include it only for top and left edges of the counter-clockwise triangle
+                return (q.z == p.z && q.y < p.y) || q.z < p.z;
+            };
+
+            for (auto z = z0; z <= z1; ++z)
+                for (auto y = y0; y <= y1; ++y) {
+                    auto py = (y + 0.5f) * s, pz = (z + 0.5f) * s;
+                    if (inside(a, b, py, pz) && inside(b, c, py, pz) && inside(c, a, py, pz))
+                        hits.push_back({ y, z, (offset - n.y * py - n.z * pz) / n.x });
+                }
+        }
+
+        /// Sorts the crossings of an instance by ray and fills the voxel centers between each pair. An unpaired last crossing of a ray is ignored.
+        void add_spans(int32_t instance, vector<Hit>& hits, Chunk& chunk) const
+        {
+            const auto s = grid.voxel_size;
+            sort(hits.begin(), hits.end());
+            for (size_t i = 0; i + 1 < hits.size(); ) {
+                const auto& h0 = hits[i];
+                const auto& h1 = hits[i + 1];
+                if (h0.y != h1.y || h0.z != h1.z) {
+                    ++i;
+                    continue;
+                }
+                // Centers x with h0.x < x <= h1.x
+                auto x_begin = std::max(0, (int32_t)floor(h0.x / s - 0.5f) + 1);
+                auto x_end = std::min(grid.nx, (int32_t)floor(h1.x / s - 0.5f) + 1);
+                if (x_begin < x_end) {
+                    auto index = (int32_t)chunk.spans.size();
+                    chunk.spans.push_back({ h0.y, h0.z, x_begin, x_end });
+                    for (auto bx = x_begin / 8; bx <= (x_end - 1) / 8; ++bx) {
+                        chunk.keys.push_back(grid.brick_key(bx, h0.y / 8, h0.z / 8));
+                        chunk.work.push_back({ instance, ~index });
+                    }
+                }
+                i += 2;
+            }
+        }
+
+        void fill_brick(uint64_t key, const Work* work, size_t count, VoxelBrick& brick, int32_t* ids) const
+        {
+            const int32_t bx = (int32_t)(key % grid.bricks_x());
+            const int32_t by = (int32_t)(key / grid.bricks_x() % grid.bricks_y());
+            const int32_t bz = (int32_t)(key / grid.bricks_x() / grid.bricks_y());
+            const auto x0 = bx * 8, y0 = by * 8, z0 = bz * 8;
+
+            auto set = [&](int32_t y, int32_t z, uint64_t mask, int32_t instance) {
+                auto& word = brick.bits[z - z0];
+                mask <<= (y - y0) * 8;
+                auto added = mask & ~word;
+                word |= mask;
+                if (ids)
+                    for (; added != 0; added &= added - 1)
+                        ids[(z - z0) * 64 + count_trailing_zeros(added)] = instance;
+            };
+
+            for (size_t w = 0; w < count; ++w) {
+                auto instance = work[w].instance;
+                if (work[w].item < 0) {
+                    const auto& span = spans[~work[w].item];
+                    auto a = std::max(span.x_begin, x0) - x0, b = std::min(span.x_end, x0 + 8) - x0;
+                    if (a < b)
+                        set(span.y, span.z, ((1u << b) - 1) & ~((1u << a) - 1), instance);
+                    continue;
+                }
+                Vector3 v[3];
+                triangle(instance, work[w].item, v);
+                VoxelTriangle tri;
+                if (!tri.setup(v, grid)) continue;
+                auto xa = std::max(tri.min[0], x0) - x0, xb = std::min(tri.max[0], x0 + 7) - x0;
+                if (xa > xb) continue;
+                auto x_mask = ((2u << xb) - 1) & ~((1u << xa) - 1);
+                for (auto z = std::max(tri.min[2], z0); z <= std::min(tri.max[2], z0 + 7); ++z)
+                    for (auto y = std::max(tri.min[1], y0); y <= std::min(tri.max[1], y0 + 7); ++y) {
+                        auto mask = tri.test_row(x0, y, z, grid.voxel_size) & x_mask;
+                        if (mask)
+                            set(y, z, mask, instance);
+                    }
+            }
+        }
+    };
+
+    /// Voxelizes the instances into a brick map (see Voxelizer)
+    inline BrickMap voxelize(const G3d& g, const InstanceView& instances, const VoxelGrid& grid, const VoxelizeOptions& options = {})
+    {
+        return Voxelizer(g, instances, grid, options).run();
+    }
+
+    /// Voxelizes a G3d: its instances if it has any, otherwise each of its sub-geometries in place
+    inline BrickMap voxelize(const G3d& g, const VoxelGrid& grid, const VoxelizeOptions& options = {})
+    {
+        return voxelize(g, InstanceView::from_g3d_or_subgeos(g), grid, options);
+    }
+}
+
+namespace Vim
+{
+    /// Voxelizes the scene on a grid of the given voxel size that covers all nodes. Voxel ids are node indices.
+    inline g3d::BrickMap VoxelizeScene(const Scene& scene, float voxelSize, const g3d::VoxelizeOptions& options = {})
+    {
+        WorldInstances world(scene);
+        auto& nodes = world.View();
+        g3d::AABox bounds;
+        for (auto& box : g3d::FrustumCuller::instance_boxes(g3d::MeshView(scene.mGeometry), nodes))
+            bounds.merge(box);
+        return g3d::voxelize(scene.mGeometry, nodes, g3d::VoxelGrid::fit(bounds, voxelSize), options);
+    }
+}
+
+#endif
@@ -1,6 +1,9 @@
 ﻿using NUnit.Framework;
 using System;
+using System.Collections.Generic;
 using System.IO;
+using System.Linq;
+using System.Text;
 
 namespace Vim.G3d.CppCLR.Tests
 {
@@ -43,9 +46,383 @@ namespace Vim.G3d.CppCLR.Tests
             }
         }
 
+        /// <summary>
+        /// Packs named buffers into a BFAST: a header, the range of each array, then the arrays aligned to 64 bytes, the first holding the names.
+        /// </summary>
+        public static byte[] PackBFast(params KeyValuePair<string, byte[]>[] buffers)
+        {
+            var arrays = new List<byte[]> { Encoding.UTF8.GetBytes(string.Concat(buffers.Select(b => b.Key + "\0"))) };
+            arrays.AddRange(buffers.Select(b => b.Value));
+            long Align(long n) => (n + 63) / 64 * 64;
+            var offsets = new List<long>();
+            var position = Align(32 + 16 * arrays.Count);
+            foreach (var a in arrays)
+            {
+                offsets.Add(position);
+                position = Align(position + a.Length);
+            }
+            var r = new byte[position];
+            using (var w = new BinaryWriter(new MemoryStream(r)))
+            {
+                w.Write(0xBFA5L);
+                w.Write(offsets[0]);
+                w.Write(offsets.Last() + arrays.Last().Length);
+                w.Write((long)arrays.Count);
+                for (var i = 0; i < arrays.Count; ++i)
+                {
+                    w.Write(offsets[i]);
+                    w.Write(offsets[i] + arrays[i].Length);
+                }
+            }
+            for (var i = 0; i < arrays.Count; ++i)
+                Buffer.BlockCopy(arrays[i], 0, r, (int)offsets[i], arrays[i].Length);
+            return r;
+        }
+
+        public static KeyValuePair<string, byte[]> Named(string name, byte[] data)
+            => new KeyValuePair<string, byte[]>(name, data);
+
+        public static byte[] ToBytes<T>(T[] values) where T : struct
+        {
+            var r = new byte[Buffer.ByteLength(values)];
+            Buffer.BlockCopy(values, 0, r, 0, r.Length);
+            return r;
+        }
+
+        public static byte[] NodeBytes(int parent, int geometry, int instance, float x)
+        {
+            var transform = new float[16];
+            transform[0] = transform[5] = transform[10] = transform[15] = 1;
+            transform[12] = x;
+            return ToBytes(new[] { parent, geometry, instance }).Concat(ToBytes(transform)).ToArray();
+        }
+
+        [Test]
+        public static void VimRoundTripTest()
+        {
+            var area = new[] { 12.5, 40.0 };
+            var level = new[] { -1, 0 };
+            var name = new[] { 0, 1 };
+            // Each property is an entity, a name string and a value string
+            var properties = new[] { 0, 2, 3, 1, 2, 1 };
+            var table = PackBFast(
+                Named("numeric:Area", ToBytes(area)),
+                Named("index:Rvt.Level:Level", ToBytes(level)),
+                Named("string:Name", ToBytes(name)),
+                Named("properties", ToBytes(properties)));
+            var vim = PackBFast(
+                Named("header", Encoding.UTF8.GetBytes("vim:1.0.0:generator:test")),
+                Named("assets", PackBFast()),
+                Named("entities", PackBFast(Named("Rvt.Element", table))),
+                Named("strings", Encoding.UTF8.GetBytes("Wall\0Door\0Mark\0A1\0")),
+                Named("nodes", NodeBytes(-1, -1, 0, 10).Concat(NodeBytes(0, -1, 1, 20)).ToArray()));
+
+            Directory.CreateDirectory(TestOutputFolderCpp);
+            var path = Path.Combine(TestOutputFolderCpp, "roundtrip.vim");
+            File.WriteAllBytes(path, vim);
+
+            var x = new ManagedVim();
+            x.Load(path);
+            Assert.AreEqual(2, x.GetNodeCount());
+            Assert.AreEqual(-1, x.GetNodeParentIndex(0));
+            Assert.AreEqual(0, x.GetNodeParentIndex(1));
+            Assert.AreEqual(1, x.GetNodeInstanceIndex(1));
+            Assert.AreEqual(20.0f, x.GetNodeTransform(1, 12));
+            Assert.AreEqual(1.0f, x.GetNodeTransform(1, 15));
+            Assert.AreEqual(4, x.GetStringCount());
+            Assert.AreEqual("Wall", x.GetString(0));
+            Assert.AreEqual("A1", x.GetString(3));
+            Assert.AreEqual(1, x.GetEntityTableCount());
+            Assert.AreEqual(3, x.GetColumnCount("Rvt.Element"));
+            Assert.AreEqual(area, x.GetNumericColumn("Rvt.Element", "Area"));
+            Assert.AreEqual(level, x.GetIndexColumn("Rvt.Element", "Rvt.Level:Level"));
+            Assert.AreEqual(name, x.GetStringColumn("Rvt.Element", "Name"));
+            Assert.AreEqual(2, x.GetPropertyCount("Rvt.Element"));
+
+            // The nodes alone need more than the budget
+            Assert.Throws<InvalidOperationException>(() => x.Load(path, 64));
+
+            // Only the selected column is read, and nothing is allocated for the other buffers
+            x.LoadColumns(path, new[] { "Rvt.Element" }, new[] { "Area" });
+            Assert.AreEqual(area, x.GetNumericColumn("Rvt.Element", "Area"));
+            Assert.IsNull(x.GetIndexColumn("Rvt.Element", "Rvt.Level:Level"));
+            Assert.IsNull(x.GetStringColumn("Rvt.Element", "Name"));
+            Assert.AreEqual(1, x.GetColumnCount("Rvt.Element"));
+            Assert.AreEqual(0, x.GetPropertyCount("Rvt.Element"));
+            Assert.AreEqual(0, x.GetNodeCount());
+            Assert.AreEqual(0, x.GetStringCount());
+            Assert.AreEqual(area.Length * sizeof(double), x.GetMemoryUsed());
+        }
+
+        public const string Position = "g3d:vertex:position:0:float32:3";
+        public const string Index = "g3d:corner:index:0:int32:1";
+        public const string FaceSize = "g3d:all:facesize:0:int32:1";
+        public const string CornerUv = "g3d:corner:uv:0:float32:2";
+        public const string FaceGroup = "g3d:face:group:0:int32:1";
+
+        public static ManagedG3d Mesh(float[] positions, int[] indices, int faceSize)
+        {
+            var g = new ManagedG3d();
+            g.AddAttribute(Position, positions);
+            g.AddAttribute(Index, indices);
+            g.AddAttribute(FaceSize, new[] { faceSize });
+            return g;
+        }
+
+        /// <summary>
+        /// The unit cube as six quads. Vertex k is at (k &amp; 1, (k &gt;&gt; 1) &amp; 1, (k &gt;&gt; 2) &amp; 1).
+        /// </summary>
+        public static ManagedG3d QuadCube()
+        {
+            var positions = Enumerable.Range(0, 8).SelectMany(k => new float[] { k & 1, (k >> 1) & 1, (k >> 2) & 1 }).ToArray();
+            var indices = new[] { 0, 2, 3, 1, 4, 5, 7, 6, 0, 1, 5, 4, 2, 6, 7, 3, 0, 4, 6, 2, 1, 3, 7, 5 };
+            return Mesh(positions, indices, 4);
+        }
+
+        [Test]
+        public static void SubdivideCubeTest()
+        {
+            var cube = QuadCube();
+            cube.AddAttribute(FaceGroup, Enumerable.Range(0, 6).ToArray());
+
+            // Each level splits every quad into four, which keep the attributes of their face
+            var one = cube.Subdivide(1);
+            Assert.AreEqual(26 * 3, one.GetFloatAttribute(Position).Length);
+            Assert.AreEqual(24 * 4, one.GetIntAttribute(Index).Length);
+            Assert.AreEqual(new[] { 4 }, one.GetIntAttribute(FaceSize));
+            Assert.AreEqual(Enumerable.Range(0, 6).SelectMany(f => Enumerable.Repeat(f, 4)).ToArray(), one.GetIntAttribute(FaceGroup));
+
+            var two = cube.Subdivide(2);
+            Assert.AreEqual(98 * 3, two.GetFloatAttribute(Position).Length);
+            Assert.AreEqual(96 * 4, two.GetIntAttribute(Index).Length);
+            Assert.AreEqual(Enumerable.Range(0, 6).SelectMany(f => Enumerable.Repeat(f, 16)).ToArray(), two.GetIntAttribute(FaceGroup));
+
+            Assert.Throws<InvalidOperationException>(() => Mesh(new float[] { 0, 0, 0, 1, 0, 0 }, new[] { 0, 1 }, 2).Subdivide(1));
+        }
+
+        [Test]
+        public static void SubdivideBoundaryTest()
+        {
+            var quad = Mesh(new float[] { 0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0 }, new[] { 0, 1, 2, 3 }, 4);
+            quad.AddAttribute(CornerUv, new float[] { 0, 0, 1, 0, 1, 1, 0, 1 });
+            quad.AddAttribute(FaceGroup, new[] { 7 });
+            var r = quad.Subdivide(1);
+
+            // The coarse vertices come first, then one per edge, then one per face.
+            // The boundary edges are creases: their points are the edge midpoints, and the corners move along the boundary curve.
+            Assert.AreEqual(new float[] { 0.125f, 0.125f, 0, 0.875f, 0.125f, 0, 0.875f, 0.875f, 0, 0.125f, 0.875f, 0, 0.5f, 0, 0, 0, 0.5f, 0, 1, 0.5f, 0, 0.5f, 1, 0, 0.5f, 0.5f, 0 },
+                r.GetFloatAttribute(Position));
+            Assert.AreEqual(new[] { 0, 4, 8, 5, 1, 6, 8, 4, 2, 7, 8, 6, 3, 5, 8, 7 }, r.GetIntAttribute(Index));
+
+            // Corner UVs are interpolated bilinearly over the coarse face
+            Assert.AreEqual(new float[] { 0, 0, 0.5f, 0, 0.5f, 0.5f, 0, 0.5f, 1, 0, 1, 0.5f, 0.5f, 0.5f, 0.5f, 0, 1, 1, 0.5f, 1, 0.5f, 0.5f, 1, 0.5f, 0, 1, 0, 0.5f, 0.5f, 0.5f, 0.5f, 1 },
+                r.GetFloatAttribute(CornerUv));
+            Assert.AreEqual(new[] { 7, 7, 7, 7 }, r.GetIntAttribute(FaceGroup));
+        }
+
+        public const string InstanceSubGeometry = "g3d:instance:subgeometry:0:int32:1";
+        public const string InstanceTransform = "g3d:instance:transform:0:float32:16";
+
+        /// <summary>
+        /// A closed axis-aligned box of 12 triangles
+        /// </summary>
+        public static ManagedG3d TriangleBox(float x0, float y0, float z0, float x1, float y1, float z1)
+        {
+            var positions = Enumerable.Range(0, 8).SelectMany(k => new[] { (k & 1) == 0 ? x0 : x1, (k & 2) == 0 ? y0 : y1, (k & 4) == 0 ? z0 : z1 }).ToArray();
+            var indices = new[] { 0, 2, 3, 0, 3, 1, 4, 5, 7, 4, 7, 6, 0, 1, 5, 0, 5, 4, 2, 6, 7, 2, 7, 3, 0, 4, 6, 0, 6, 2, 1, 3, 7, 1, 7, 5 };
+            return Mesh(positions, indices, 3);
+        }
+
+        /// <summary>
+        /// Instances of sub-geometry 0, each moved by the given offset
+        /// </summary>
+        public static void AddTranslatedInstances(ManagedG3d g, params float[][] offsets)
+        {
+            g.AddAttribute(InstanceSubGeometry, new int[offsets.Length]);
+            g.AddAttribute(InstanceTransform, offsets.SelectMany(t => new[] { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, t[0], t[1], t[2], 1 }).ToArray());
+        }
+
+        [Test]
+        public static void VoxelizeTest()
+        {
+            // A box from 0.5 to 3.5 covers 4 x 4 x 4 unit voxels, and its faces cross the outer ones
+            var box = TriangleBox(0.5f, 0.5f, 0.5f, 3.5f, 3.5f, 3.5f);
+            var origin = new float[] { 0, 0, 0 };
+            var surface = box.Voxelize(origin, 1, 8, 4, 4, false);
+            Assert.AreEqual(4 * 4 * 4 - 2 * 2 * 2, surface.VoxelCount());
+            Assert.IsTrue(surface.IsSet(0, 0, 0));
+            Assert.IsFalse(surface.IsSet(1, 1, 1));
+            Assert.IsFalse(surface.IsSet(4, 0, 0));
+            Assert.AreEqual(0, surface.GetId(0, 0, 0));
+            Assert.AreEqual(-1, surface.GetId(1, 1, 1));
+
+            var solid = box.Voxelize(origin, 1, 8, 4, 4, true);
+            Assert.AreEqual(4 * 4 * 4, solid.VoxelCount());
+            Assert.IsTrue(solid.IsSet(1, 1, 1));
+
+            // The dense grid holds the same voxels as the bricks
+            var dense = surface.ToDense();
+            Assert.AreEqual(8 * 4 * 4, dense.Length);
+            Assert.AreEqual(1, surface.BrickCount());
+            Assert.AreEqual(surface.VoxelCount(), dense.Count(v => v));
+            for (int z = 0, i = 0; z < 4; ++z)
+                for (var y = 0; y < 4; ++y)
+                    for (var x = 0; x < 8; ++x, ++i)
+                        Assert.AreEqual(surface.IsSet(x, y, z), dense[i]);
+
+            // Instance 0 is moved 3 voxels along x, so both instances set the voxels of the layer x = 3, which keep the lower id
+            AddTranslatedInstances(box, new float[] { 3, 0, 0 }, new float[] { 0, 0, 0 });
+            var overlapping = box.Voxelize(origin, 1, 8, 4, 4, false);
+            Assert.AreEqual(2 * 56 - 16, overlapping.VoxelCount());
+            var ids = Enumerable.Range(0, 8).Select(x => overlapping.GetId(x, 0, 0)).ToArray();
+            Assert.AreEqual(new[] { 1, 1, 1, 0, 0, 0, 0, -1 }, ids);
+            Assert.AreEqual(0, overlapping.GetId(3, 1, 1));
+            Assert.AreEqual(ids, overlapping.ToDenseIds().Take(8).ToArray());
+        }
+
+        /// <summary>
+        /// Two instances of the unit box, the second moved by the offset
+        /// </summary>
+        public static ManagedG3d BoxPair(float x, float y, float z)
+        {
+            var g = TriangleBox(0, 0, 0, 1, 1, 1);
+            AddTranslatedInstances(g, new float[] { 0, 0, 0 }, new[] { x, y, z });
+            return g;
+        }
+
+        [Test]
+        public static void ClashTest()
+        {
+            var overlapping = BoxPair(0.5f, 0.25f, 0.25f);
+            Assert.AreEqual(new[] { 0, 1 }, overlapping.FindHardClashes(0));
+            Assert.AreEqual(new[] { 0, 1 }, overlapping.FindClearanceClashes(0.01f));
+
+            // Contact is not a hard clash: sharing a face, part of a face, an edge or a corner, or being the same box
+            foreach (var contact in new[] { BoxPair(1, 0, 0), BoxPair(1, 0.5f, 0.5f), BoxPair(1, 1, 0), BoxPair(1, 1, 1), BoxPair(0, 0, 0) })
+            {
+                Assert.IsEmpty(contact.FindHardClashes(0));
+                Assert.AreEqual(new[] { 0, 1 }, contact.FindClearanceClashes(0.01f));
+            }
+
+            // A gap of 0.05 is only reported when the clearance is larger
+            var gap = BoxPair(1.05f, 0, 0);
+            Assert.IsEmpty(gap.FindHardClashes(0));
+            Assert.AreEqual(new[] { 0, 1 }, gap.FindClearanceClashes(0.1f));
+            Assert.IsEmpty(gap.FindClearanceClashes(0.01f));
+        }
+
+        public const string SubGeoVertexOffset = "g3d:subgeo:vertexoffset:0:int32:1";
+        public const string SubGeoIndexOffset = "g3d:subgeo:indexoffset:0:int32:1";
+        public const string SubGeoInstance = "g3d:subgeo:instance:0:int32:1";
+        public const string SubGeoPlane = "g3d:subgeo:plane:0:int32:1";
+        public const string SubGeoClosed = "g3d:subgeo:closed:0:int32:1";
+
+        [Test]
+        public static void SectionTest()
+        {
+            // Two instances of the unit box, the second moved 2 along x, cut at two heights
+            var boxes = BoxPair(2, 0, 0);
+            var heights = new[] { 0.25f, 0.75f };
+            var loops = boxes.Section(new float[] { 0, 0, 1 }, heights);
+            Assert.AreEqual(new[] { 2 }, loops.GetIntAttribute(FaceSize));
+            Assert.AreEqual(new[] { 0, 0, 1, 1 }, loops.GetIntAttribute(SubGeoInstance));
+            Assert.AreEqual(new[] { 0, 1, 0, 1 }, loops.GetIntAttribute(SubGeoPlane));
+            Assert.AreEqual(new[] { 1, 1, 1, 1 }, loops.GetIntAttribute(SubGeoClosed));
+
+            // Each side face of a box is two triangles, so a loop has 8 points and 8 segments
+            Assert.AreEqual(new[] { 0, 8, 16, 24 }, loops.GetIntAttribute(SubGeoVertexOffset));
+            Assert.AreEqual(new[] { 0, 16, 32, 48 }, loops.GetIntAttribute(SubGeoIndexOffset));
+            var points = loops.GetFloatAttribute(Position);
+            Assert.AreEqual(32 * 3, points.Length);
+            for (var i = 0; i < 32; ++i)
+            {
+                var loop = i / 8;
+                var x = points[i * 3];
+                Assert.AreEqual(heights[loop % 2], points[i * 3 + 2]);
+                Assert.IsTrue(loop < 2 ? x >= 0 && x <= 1 : x >= 2 && x <= 3);
+            }
+
+            // Without the face x = 0 the box is open, and its section is a chain from one side of the hole to the other
+            var open = TriangleBox(0, 0, 0, 1, 1, 1);
+            var indices = open.GetIntAttribute(Index).ToList();
+            indices.RemoveRange(24, 6);
+            open.AddAttribute(Index, indices.ToArray());
+            var chain = open.Section(new float[] { 0, 0, 1 }, new[] { 0.5f });
+            Assert.AreEqual(new[] { 0 }, chain.GetIntAttribute(SubGeoClosed));
+            Assert.AreEqual(new[] { 0 }, chain.GetIntAttribute(SubGeoInstance));
+            points = chain.GetFloatAttribute(Position);
+            Assert.AreEqual(7 * 3, points.Length);
+            Assert.AreEqual(6 * 2, chain.GetIntAttribute(Index).Length);
+            Assert.AreEqual(0, points[0]);
+            Assert.AreEqual(0, points[points.Length - 3]);
+
+            Assert.Throws<InvalidOperationException>(() => boxes.Section(new float[] { 0, 0, 1 }, new[] { 0.75f, 0.25f }));
+        }
+
+        public const string MapChannelData = "g3d:none:map_channel_data:1:float32:3";
+        public const string MapChannelIndex = "g3d:corner:map_channel_index:1:int32:1";
+        public const string MapChannel = "g3d:vertex:map_channel:1:float32:3";
+
+        [Test]
+        public static void UnifyTest()
+        {
+            // Two unit boxes as sub-geometries. Map channel 1 has one value per face of the first box, and a single value for the whole second box.
+            var box = TriangleBox(0, 0, 0, 1, 1, 1);
+            var positions = box.GetFloatAttribute(Position);
+            var boxIndices = box.GetIntAttribute(Index);
+            var indices = boxIndices.Concat(boxIndices.Select(i => i + 8)).ToArray();
+            var channel = Enumerable.Range(0, 72).Select(c => c < 36 ? c / 6 : 0).ToArray();
+            var values = Enumerable.Range(0, 6).SelectMany(f => new float[] { f, 0, 0 }).ToArray();
+            var mesh = Mesh(positions.Concat(positions.Select((x, i) => i % 3 == 0 ? x + 2 : x)).ToArray(), indices, 3);
+            mesh.AddAttribute(SubGeoVertexOffset, new[] { 0, 8 });
+            mesh.AddAttribute(SubGeoIndexOffset, new[] { 0, 36 });
+            mesh.AddAttribute(MapChannelData, values);
+            mesh.AddAttribute(MapChannelIndex, channel);
+
+            ManagedG3d.SetThreadCount(1);
+            var serial = mesh.Unify();
+            ManagedG3d.SetThreadCount(0);
+            var unified = mesh.Unify();
+
+            // Each face of the first box gets its own 4 vertices, while the second box keeps its 8
+            var newPositions = unified.GetFloatAttribute(Position);
+            var newIndices = unified.GetIntAttribute(Index);
+            var mapped = unified.GetFloatAttribute(MapChannel);
+            Assert.AreEqual((6 * 4 + 8) * 3, newPositions.Length);
+            Assert.AreEqual(newPositions.Length, mapped.Length);
+            Assert.AreEqual(new[] { 0, 24 }, unified.GetIntAttribute(SubGeoVertexOffset));
+            Assert.AreEqual(new[] { 0, 36 }, unified.GetIntAttribute(SubGeoIndexOffset));
+            Assert.IsNull(unified.GetIntAttribute(MapChannelIndex));
+            Assert.AreEqual(72, newIndices.Length);
+            var oldPositions = mesh.GetFloatAttribute(Position);
+            for (var c = 0; c < 72; ++c)
+            {
+                var v = newIndices[c];
+                Assert.IsTrue(c < 36 ? v < 24 : v >= 24);
+                for (var k = 0; k < 3; ++k)
+                {
+                    Assert.AreEqual(oldPositions[indices[c] * 3 + k], newPositions[v * 3 + k]);
+                    Assert.AreEqual(values[channel[c] * 3 + k], mapped[v * 3 + k]);
+                }
+            }
+
+            // The vertices are numbered in the order of the corners, whatever the number of threads
+            Assert.AreEqual(newIndices, serial.GetIntAttribute(Index));
+            Assert.AreEqual(newPositions, serial.GetFloatAttribute(Position));
+            Assert.AreEqual(mapped, serial.GetFloatAttribute(MapChannel));
+            Assert.AreEqual(unified.GetIntAttribute(SubGeoVertexOffset), serial.GetIntAttribute(SubGeoVertexOffset));
+        }
+
         public static void Main(string[] args)
         {
             CppTest();
+            VimRoundTripTest();
+            SubdivideCubeTest();
+            SubdivideBoundaryTest();
+            VoxelizeTest();
+            ClashTest();
+            SectionTest();
+            UnifyTest();
         }
     }
 }